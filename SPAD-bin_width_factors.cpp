@@ -16,6 +16,15 @@ int gnBinWidthFactors = 0;
 
 int check_bin_width_factors_space(int width, int height, int timebins)
 {
+    // Called before the factors are changed, so any correction plan or compressed factors made from them are now out of date
+    invalidate_correction_plan();
+    deactivate_bin_width_pca();
+
+    if (gBinWidthFactors && gnBinWidthFactors != height * width * timebins) {   // different size of image
+        release_calibration_array(gBinWidthFactors);
+        gBinWidthFactors = NULL;
+    }
+
     if (!gBinWidthFactors) {
         gBinWidthFactors = (double*)malloc(height * width * timebins * sizeof(double));  // one set for each pixel sensor
         gnBinWidthFactors = height * width * timebins;
@@ -106,21 +115,88 @@ int SPAD_reset_bin_width_factors(int width, int height, int timebins)
 
 double* SPAD_get_bin_width_factors_ptr()
 {
+    invalidate_correction_plan();   // caller may change the factors through the pointer
+    deactivate_bin_width_pca();
     return gBinWidthFactors;
 }
 
+/*
+Compact storage of the factors in the files. The factors are close to 1.0 so they keep enough precision as float32 or
+as 16 bit fixed point deviations from 1.0, 1/BWF_FIXED16_ONE per step, for a quarter of the file size and load time.
+The fixed point values are rounded from the running total of the deviations, so the bin borders made from them are never
+more than a step from the exact ones however many bins are added up.
+The file format is known from the file size, the files have no header.
+*/
+#define BWF_FIXED16_ONE 16384.0     // deviations from -2 to +2
+
+void pack_bin_width_factors_fixed16(double* factors, short* packed, size_t n)
+{
+    double total = 0.0, done = 0.0;
+
+    for (size_t i = 0; i < n; i++) {
+        total += (factors[i] - 1.0) * BWF_FIXED16_ONE;
+        double q = min(max(floor(total + 0.5) - done, -32768.0), 32767.0);
+        packed[i] = (short)q;
+        done += q;
+    }
+}
+
+void unpack_bin_width_factors_fixed16(short* packed, double* factors, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        factors[i] = 1.0 + packed[i] / BWF_FIXED16_ONE;
+}
+
 int SPAD_write_bin_width_factors_to_file(char filepath[])
+{
+    return(SPAD_write_bin_width_factors_to_file_precision(filepath, SPAD_PRECISION_DOUBLE));
+}
+
+int SPAD_write_bin_width_factors_to_file_precision(char filepath[], int precision)
 {
     FILE* fp;
     size_t nWrote;
 
+    if (!gBinWidthFactors || gnBinWidthFactors <= 0) {
+        printf("ERROR: No bin width factors to save.\n");
+        return(-1);
+    }
+
+    if (precision != SPAD_PRECISION_DOUBLE && precision != SPAD_PRECISION_FLOAT32 && precision != SPAD_PRECISION_FIXED16) {
+        printf("ERROR: Unknown bin width factors precision %d.\n", precision);
+        return(-1);
+    }
+
     fopen_s(&fp, filepath, "wb");
     if (!fp) {
         printf("ERROR: Could not save bin width factors file.\n");
         return(-1);
     }
 
-    nWrote = fwrite(gBinWidthFactors, sizeof(double), gnBinWidthFactors, fp);
+    if (precision == SPAD_PRECISION_DOUBLE) {
+        nWrote = fwrite(gBinWidthFactors, sizeof(double), gnBinWidthFactors, fp);
+    }
+    else if (precision == SPAD_PRECISION_FLOAT32) {
+        float* packed = (float*)malloc(gnBinWidthFactors * sizeof(float));
+        if (!packed) {
+            fclose(fp);
+            return(-2);
+        }
+        for (int i = 0; i < gnBinWidthFactors; i++)
+            packed[i] = (float)gBinWidthFactors[i];
+        nWrote = fwrite(packed, sizeof(float), gnBinWidthFactors, fp);
+        free(packed);
+    }
+    else {
+        short* packed = (short*)malloc(gnBinWidthFactors * sizeof(short));
+        if (!packed) {
+            fclose(fp);
+            return(-2);
+        }
+        pack_bin_width_factors_fixed16(gBinWidthFactors, packed, gnBinWidthFactors);
+        nWrote = fwrite(packed, sizeof(short), gnBinWidthFactors, fp);
+        free(packed);
+    }
 
     fclose(fp);
 
@@ -134,6 +210,7 @@ int SPAD_read_bin_width_factors_from_file(char filepath[], int width, int height
 {
     FILE* fp;
     size_t nRead;
+    size_t nValues = (size_t)width * height * timebins;
 
     fopen_s(&fp, filepath, "rb");
     if (!fp) {
@@ -143,7 +220,35 @@ int SPAD_read_bin_width_factors_from_file(char filepath[], int width, int height
 
     if (check_bin_width_factors_space(width, height, timebins) < 0) return (-2);
 
-    nRead = fread(gBinWidthFactors, sizeof(double), gnBinWidthFactors, fp);
+    // Format from the file size
+    fseek(fp, 0, SEEK_END);
+    size_t nBytes = (size_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    if (nBytes == nValues * sizeof(float)) {
+        float* packed = (float*)malloc(nValues * sizeof(float));
+        if (!packed) {
+            fclose(fp);
+            return(-2);
+        }
+        nRead = fread(packed, sizeof(float), nValues, fp);
+        for (size_t i = 0; i < nRead; i++)
+            gBinWidthFactors[i] = packed[i];
+        free(packed);
+    }
+    else if (nBytes == nValues * sizeof(short)) {
+        short* packed = (short*)malloc(nValues * sizeof(short));
+        if (!packed) {
+            fclose(fp);
+            return(-2);
+        }
+        nRead = fread(packed, sizeof(short), nValues, fp);
+        unpack_bin_width_factors_fixed16(packed, gBinWidthFactors, nRead);
+        free(packed);
+    }
+    else {
+        nRead = fread(gBinWidthFactors, sizeof(double), nValues, fp);
+    }
 
     fclose(fp);
 
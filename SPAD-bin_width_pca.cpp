@@ -0,0 +1,340 @@
+#include <windows.h>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+
+extern double* gBinWidthFactors;
+extern int gnBinWidthFactors;
+extern double* gTimebaseShifts;
+extern double* gTimebaseScales;
+
+/*
+Low rank (PCA) compressed bin width factors.
+
+The bin width pattern of every detector comes mostly from the shared design of the TDCs, so the factors of all the
+detectors are close to a mean transient plus a few shared basis transients:
+
+    factor[k][i] = mean[i] + sum over c of coeffs[k][c] * basis[c][i]
+
+The basis are the principal components of the factors, the eigenvectors with the largest eigenvalues of their covariance
+over the detectors. Only nComponents coefficients are stored for each detector, and the mean and basis are small enough to
+stay in cache, so the factors of each transient are rebuilt as it is corrected instead of reading them, or the correction
+plan made from them, from memory for every image.
+
+File layout, all little endian:
+    int   nComponents, width, height, timebins
+    float mean[timebins]
+    float basis[nComponents][timebins]
+    float coeffs[width * height][nComponents]
+*/
+
+typedef struct
+{
+    int nComponents;
+    int width;
+    int height;
+    int timebins;
+    float* mean;
+    float* basis;
+    float* coeffs;
+    void* block;     // single allocation for all of the above
+
+} bin_width_pca;
+
+static bin_width_pca gBinWidthPCA = { 0 };
+int gBinWidthPCAActive = 0;   // also used by corrections
+
+void free_bin_width_pca(void)
+{
+    free(gBinWidthPCA.block);
+    memset(&gBinWidthPCA, 0, sizeof(gBinWidthPCA));
+    gBinWidthPCAActive = 0;
+}
+
+// Called when the dense factors are changed, the compressed ones are then out of date
+void deactivate_bin_width_pca(void)
+{
+    gBinWidthPCAActive = 0;
+}
+
+int bin_width_pca_active(int width, int height, int timebins)
+{
+    return (gBinWidthPCAActive && gBinWidthPCA.width == width && gBinWidthPCA.height == height && gBinWidthPCA.timebins == timebins);
+}
+
+static int alloc_bin_width_pca(int nComponents, int width, int height, int timebins)
+{
+    size_t nPixels = (size_t)width * height;
+    size_t nValues = timebins + (size_t)nComponents * timebins + nPixels * nComponents;
+
+    free_bin_width_pca();
+
+    gBinWidthPCA.block = malloc(nValues * sizeof(float));
+    if (!gBinWidthPCA.block) return(-1);
+
+    gBinWidthPCA.nComponents = nComponents;
+    gBinWidthPCA.width = width;
+    gBinWidthPCA.height = height;
+    gBinWidthPCA.timebins = timebins;
+    gBinWidthPCA.mean = (float*)gBinWidthPCA.block;
+    gBinWidthPCA.basis = gBinWidthPCA.mean + timebins;
+    gBinWidthPCA.coeffs = gBinWidthPCA.basis + (size_t)nComponents * timebins;
+
+    return(0);
+}
+
+/// Rebuild the factors of one detector, factors must have space for timebins + 1 values
+void reconstruct_bin_width_factors(int detector, double* factors)
+{
+    int timebins = gBinWidthPCA.timebins;
+    int nComponents = gBinWidthPCA.nComponents;
+    float* c = gBinWidthPCA.coeffs + (size_t)detector * nComponents;
+
+    for (int i = 0; i < timebins; i++)
+        factors[i] = gBinWidthPCA.mean[i];
+
+    for (int n = 0; n < nComponents; n++) {
+        float* basis = gBinWidthPCA.basis + (size_t)n * timebins;
+        double cn = c[n];
+        for (int i = 0; i < timebins; i++)
+            factors[i] += cn * basis[i];
+    }
+
+    factors[timebins] = 1.0;   // calc_bin_borders reads one past the end
+}
+
+// Eigenvalues and vectors of a symmetric matrix by cyclic Jacobi rotations. a is destroyed, its diagonal ends up as the
+// eigenvalues, the columns of v are the eigenvectors.
+static void jacobi_eigen(double* a, double* v, int n)
+{
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+            v[i * n + j] = (i == j) ? 1.0 : 0.0;
+
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off = 0.0, diag = 0.0;
+        for (int i = 0; i < n; i++) {
+            diag += a[i * n + i] * a[i * n + i];
+            for (int j = i + 1; j < n; j++)
+                off += a[i * n + j] * a[i * n + j];
+        }
+        if (off <= 1E-24 * diag) break;
+
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) {
+                double apq = a[p * n + q];
+                if (fabs(apq) < 1E-300) continue;
+
+                double theta = (a[q * n + q] - a[p * n + p]) / (2.0 * apq);
+                double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+                double c = 1.0 / sqrt(t * t + 1.0);
+                double s = t * c;
+
+                for (int k = 0; k < n; k++) {   // columns p and q
+                    double akp = a[k * n + p], akq = a[k * n + q];
+                    a[k * n + p] = c * akp - s * akq;
+                    a[k * n + q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < n; k++) {   // rows p and q
+                    double apk = a[p * n + k], aqk = a[q * n + k];
+                    a[p * n + k] = c * apk - s * aqk;
+                    a[q * n + k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < n; k++) {
+                    double vkp = v[k * n + p], vkq = v[k * n + q];
+                    v[k * n + p] = c * vkp - s * vkq;
+                    v[k * n + q] = s * vkp + c * vkq;
+                }
+            }
+        }
+    }
+}
+
+int SPAD_compress_bin_width_factors(int width, int height, int timebins, int nComponents)
+{
+    int nPixels = width * height;
+
+    if (!gBinWidthFactors || gnBinWidthFactors != nPixels * timebins) {
+        printf("ERROR: No bin width factors for a %d x %d x %d image to compress.\n", width, height, timebins);
+        return(-1);
+    }
+    if (nComponents < 1 || nComponents > timebins) {
+        printf("ERROR: Number of components must be from 1 to %d.\n", timebins);
+        return(-1);
+    }
+
+    double* mean = (double*)calloc(timebins, sizeof(double));
+    double* cov = (double*)calloc((size_t)timebins * timebins, sizeof(double));
+    double* vectors = (double*)malloc((size_t)timebins * timebins * sizeof(double));
+    double* x = (double*)malloc(timebins * sizeof(double));
+    int* order = (int*)malloc(timebins * sizeof(int));
+
+    if (!mean || !cov || !vectors || !x || !order || alloc_bin_width_pca(nComponents, width, height, timebins) < 0) {
+        printf("ERROR: Could not allocate space to compress the bin width factors.\n");
+        free(mean); free(cov); free(vectors); free(x); free(order);
+        return(-2);
+    }
+
+    // Mean transient
+    for (int k = 0; k < nPixels; k++) {
+        double* f = &gBinWidthFactors[(size_t)k * timebins];
+        for (int i = 0; i < timebins; i++)
+            mean[i] += f[i];
+    }
+    for (int i = 0; i < timebins; i++)
+        mean[i] /= nPixels;
+
+    // Covariance, upper triangle then copied
+    for (int k = 0; k < nPixels; k++) {
+        double* f = &gBinWidthFactors[(size_t)k * timebins];
+        for (int i = 0; i < timebins; i++)
+            x[i] = f[i] - mean[i];
+        for (int i = 0; i < timebins; i++) {
+            double xi = x[i];
+            double* row = cov + (size_t)i * timebins;
+            for (int j = i; j < timebins; j++)
+                row[j] += xi * x[j];
+        }
+    }
+    for (int i = 0; i < timebins; i++)
+        for (int j = 0; j < i; j++)
+            cov[(size_t)i * timebins + j] = cov[(size_t)j * timebins + i];
+
+    jacobi_eigen(cov, vectors, timebins);
+
+    // Largest eigenvalues first
+    for (int i = 0; i < timebins; i++) order[i] = i;
+    std::sort(order, order + timebins, [&](int a, int b) { return cov[(size_t)a * timebins + a] > cov[(size_t)b * timebins + b]; });
+
+    double total_var = 0.0, kept_var = 0.0;
+    for (int i = 0; i < timebins; i++) {
+        double e = max(cov[(size_t)order[i] * timebins + order[i]], 0.0);
+        total_var += e;
+        if (i < nComponents) kept_var += e;
+    }
+
+    for (int i = 0; i < timebins; i++)
+        gBinWidthPCA.mean[i] = (float)mean[i];
+    for (int n = 0; n < nComponents; n++)
+        for (int i = 0; i < timebins; i++)
+            gBinWidthPCA.basis[(size_t)n * timebins + i] = (float)vectors[(size_t)i * timebins + order[n]];
+
+    // Coefficients are the projections onto the (float) basis
+    for (int k = 0; k < nPixels; k++) {
+        double* f = &gBinWidthFactors[(size_t)k * timebins];
+        for (int n = 0; n < nComponents; n++) {
+            float* basis = gBinWidthPCA.basis + (size_t)n * timebins;
+            double c = 0.0;
+            for (int i = 0; i < timebins; i++)
+                c += (f[i] - gBinWidthPCA.mean[i]) * basis[i];
+            gBinWidthPCA.coeffs[(size_t)k * nComponents + n] = (float)c;
+        }
+    }
+
+    free(mean); free(cov); free(vectors); free(x); free(order);
+
+    gBinWidthPCAActive = 1;
+    invalidate_correction_plan();
+
+    // Reconstruction error, of the factors and of the bin borders they make
+    double* factors = (double*)malloc((timebins + 1) * sizeof(double));
+    double sum2 = 0.0, max_error = 0.0, max_border = 0.0;
+    if (factors) {
+        for (int k = 0; k < nPixels; k++) {
+            double* f = &gBinWidthFactors[(size_t)k * timebins];
+            double scale = gTimebaseScales ? gTimebaseScales[k] : 1.0;
+            double border = 0.0;
+            reconstruct_bin_width_factors(k, factors);
+            for (int i = 0; i < timebins; i++) {
+                double e = factors[i] - f[i];
+                sum2 += e * e;
+                max_error = max(max_error, fabs(e));
+                border += e * scale;
+                max_border = max(max_border, fabs(border));
+            }
+        }
+        free(factors);
+    }
+
+    printf("Bin width factors compressed to %d components, %.2f%% of the variance. Factor error rms %.2e max %.2e, max bin border error %.2e bins\n",
+        nComponents, total_var > 0 ? 100.0 * kept_var / total_var : 100.0, sqrt(sum2 / ((double)nPixels * timebins)), max_error, max_border);
+
+    return(0);
+}
+
+int SPAD_write_bin_width_pca_to_file(char filepath[])
+{
+    FILE* fp;
+
+    if (!gBinWidthPCA.block) {
+        printf("ERROR: No compressed bin width factors to save.\n");
+        return(-1);
+    }
+
+    fopen_s(&fp, filepath, "wb");
+    if (!fp) {
+        printf("ERROR: Could not save compressed bin width factors file.\n");
+        return(-1);
+    }
+
+    int dims[4] = { gBinWidthPCA.nComponents, gBinWidthPCA.width, gBinWidthPCA.height, gBinWidthPCA.timebins };
+    size_t nValues = gBinWidthPCA.timebins * (size_t)(1 + gBinWidthPCA.nComponents) + (size_t)gBinWidthPCA.width * gBinWidthPCA.height * gBinWidthPCA.nComponents;
+
+    size_t nWrote = fwrite(dims, sizeof(int), 4, fp);
+    nWrote += fwrite(gBinWidthPCA.block, sizeof(float), nValues, fp);
+
+    fclose(fp);
+
+    if (nWrote != 4 + nValues) {
+        printf("ERROR: Compressed bin width factors were not written to file correctly.\n");
+        return(-2);
+    }
+
+    return(0);
+}
+
+int SPAD_read_bin_width_pca_from_file(char filepath[], int width, int height, int timebins)
+{
+    FILE* fp;
+    int dims[4];
+
+    fopen_s(&fp, filepath, "rb");
+    if (!fp) {
+        printf("ERROR: Could not open compressed bin width factors file.\n");
+        return(-1);
+    }
+
+    if (fread(dims, sizeof(int), 4, fp) != 4 || dims[1] != width || dims[2] != height || dims[3] != timebins || dims[0] < 1 || dims[0] > timebins) {
+        printf("ERROR: Compressed bin width factors file does not match a %d x %d x %d image.\n", width, height, timebins);
+        fclose(fp);
+        return(-2);
+    }
+
+    if (alloc_bin_width_pca(dims[0], width, height, timebins) < 0) {
+        fclose(fp);
+        return(-3);
+    }
+
+    size_t nValues = timebins * (size_t)(1 + dims[0]) + (size_t)width * height * dims[0];
+    size_t nRead = fread(gBinWidthPCA.block, sizeof(float), nValues, fp);
+
+    fclose(fp);
+
+    if (nRead != nValues) {
+        printf("ERROR: Compressed bin width factors were not read from file correctly.\n");
+        free_bin_width_pca();
+        return(-4);
+    }
+
+    // The dense factors are not needed, the corrections rebuild them from the components
+    release_calibration_array(gBinWidthFactors);
+    gBinWidthFactors = NULL;
+    gnBinWidthFactors = 0;
+
+    gBinWidthPCAActive = 1;
+    invalidate_correction_plan();
+
+    return(0);
+}
@@ -1,61 +1,539 @@
 
 #include <windows.h>
+#include <iostream>
 #include "SPAD-correct.h"
 #include "SPAD-correct_internal.h"
+#include "SPAD-random.h"
 
 
-void SPAD_bin_by_2(USHORT* histogram, int width, int height, int timebins, int* new_width, int* new_height)
+/*
+Binning by 2, the most used case, has its own kernels.
+
+Each output row is made from 2 input rows by adding 2 x 2 transients bin by bin. Both the input pairs and the output row
+are contiguous, so the kernels just add 4 streams of 16 bit values, 16 at a time with AVX2. How sums above 65535 are
+stored is chosen with the overflow policy:
+    SPAD_BIN_WRAP       16 bit adds, as the original loop
+    SPAD_BIN_SATURATE   16 bit saturating adds, adding 4 values saturating one at a time is the same as saturating the sum
+    SPAD_BIN_WIDEN      each value widened to 32 bits and added into a UINT output image
+
+The output rows are tasks for the thread pool. In place, output row y is written over input rows from y / 2, so the
+rows are done in waves: [0,1), [1,4), [4,16), ... The outputs of a wave [a, 4a) end at input row 2a, where the inputs
+of the wave start, and all rows before a are finished, so the rows within a wave never overwrite anything still needed.
+Within a row each output transient is at or before its inputs, so it can go in place in order.
+*/
+
+typedef void (*bin_by_2_row_func)(USHORT* row, USHORT* row_dn, void* out, int new_width, int timebins);
+
+static inline USHORT add_saturate(USHORT a, USHORT b)
+{
+	UINT sum = (UINT)a + b;
+	return (sum > 65535) ? 65535 : (USHORT)sum;
+}
+
+template <int POLICY>
+static void bin_by_2_row_scalar(USHORT* row, USHORT* row_dn, void* out, int new_width, int timebins)
+{
+	for (int x = 0; x < new_width; x++) {
+		USHORT* tran1_ptr = row + 2 * (size_t)x * timebins;
+		USHORT* tran2_ptr = tran1_ptr + timebins;
+		USHORT* tran3_ptr = row_dn + 2 * (size_t)x * timebins;
+		USHORT* tran4_ptr = tran3_ptr + timebins;
+		size_t o = (size_t)x * timebins;
+
+		for (int t = 0; t < timebins; t++) {
+			if (POLICY == SPAD_BIN_WIDEN)
+				((UINT*)out)[o + t] = (UINT)tran1_ptr[t] + tran2_ptr[t] + tran3_ptr[t] + tran4_ptr[t];
+			else if (POLICY == SPAD_BIN_SATURATE)
+				((USHORT*)out)[o + t] = add_saturate(add_saturate(tran1_ptr[t], tran2_ptr[t]), add_saturate(tran3_ptr[t], tran4_ptr[t]));
+			else
+				((USHORT*)out)[o + t] = tran1_ptr[t] + tran2_ptr[t] + tran3_ptr[t] + tran4_ptr[t];
+		}
+	}
+}
+
+#ifdef SPAD_X86
+
+template <int POLICY>
+SPAD_TARGET_AVX2 static void bin_by_2_row_avx2(USHORT* row, USHORT* row_dn, void* out, int new_width, int timebins)
+{
+	for (int x = 0; x < new_width; x++) {
+		USHORT* tran1_ptr = row + 2 * (size_t)x * timebins;
+		USHORT* tran2_ptr = tran1_ptr + timebins;
+		USHORT* tran3_ptr = row_dn + 2 * (size_t)x * timebins;
+		USHORT* tran4_ptr = tran3_ptr + timebins;
+		size_t o = (size_t)x * timebins;
+
+		int t = 0;
+		for (; t + 16 <= timebins; t += 16) {
+			__m256i a = _mm256_loadu_si256((__m256i*)(tran1_ptr + t));
+			__m256i b = _mm256_loadu_si256((__m256i*)(tran2_ptr + t));
+			__m256i c = _mm256_loadu_si256((__m256i*)(tran3_ptr + t));
+			__m256i d = _mm256_loadu_si256((__m256i*)(tran4_ptr + t));
+
+			if (POLICY == SPAD_BIN_WIDEN) {
+				__m256i lo = _mm256_add_epi32(
+					_mm256_add_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(a)), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(b))),
+					_mm256_add_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(c)), _mm256_cvtepu16_epi32(_mm256_castsi256_si128(d))));
+				__m256i hi = _mm256_add_epi32(
+					_mm256_add_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(a, 1)), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(b, 1))),
+					_mm256_add_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(c, 1)), _mm256_cvtepu16_epi32(_mm256_extracti128_si256(d, 1))));
+				_mm256_storeu_si256((__m256i*)((UINT*)out + o + t), lo);
+				_mm256_storeu_si256((__m256i*)((UINT*)out + o + t + 8), hi);
+			}
+			else if (POLICY == SPAD_BIN_SATURATE) {
+				__m256i sum = _mm256_adds_epu16(_mm256_adds_epu16(a, b), _mm256_adds_epu16(c, d));
+				_mm256_storeu_si256((__m256i*)((USHORT*)out + o + t), sum);
+			}
+			else {
+				__m256i sum = _mm256_add_epi16(_mm256_add_epi16(a, b), _mm256_add_epi16(c, d));
+				_mm256_storeu_si256((__m256i*)((USHORT*)out + o + t), sum);
+			}
+		}
+
+		for (; t < timebins; t++) {
+			if (POLICY == SPAD_BIN_WIDEN)
+				((UINT*)out)[o + t] = (UINT)tran1_ptr[t] + tran2_ptr[t] + tran3_ptr[t] + tran4_ptr[t];
+			else if (POLICY == SPAD_BIN_SATURATE)
+				((USHORT*)out)[o + t] = add_saturate(add_saturate(tran1_ptr[t], tran2_ptr[t]), add_saturate(tran3_ptr[t], tran4_ptr[t]));
+			else
+				((USHORT*)out)[o + t] = tran1_ptr[t] + tran2_ptr[t] + tran3_ptr[t] + tran4_ptr[t];
+		}
+	}
+}
+
+#endif // SPAD_X86
+
+static bin_by_2_row_func select_bin_by_2_row(int overflow)
+{
+#ifdef SPAD_X86
+	if (simd_level() >= SPAD_SIMD_AVX2) {
+		switch (overflow) {
+		case SPAD_BIN_SATURATE: return bin_by_2_row_avx2<SPAD_BIN_SATURATE>;
+		case SPAD_BIN_WIDEN: return bin_by_2_row_avx2<SPAD_BIN_WIDEN>;
+		default: return bin_by_2_row_avx2<SPAD_BIN_WRAP>;
+		}
+	}
+#endif
+	switch (overflow) {
+	case SPAD_BIN_SATURATE: return bin_by_2_row_scalar<SPAD_BIN_SATURATE>;
+	case SPAD_BIN_WIDEN: return bin_by_2_row_scalar<SPAD_BIN_WIDEN>;
+	default: return bin_by_2_row_scalar<SPAD_BIN_WRAP>;
+	}
+}
+
+typedef struct
+{
+	USHORT* histogram;
+	void* binned;
+	size_t out_value_bytes;   // sizeof(USHORT), or sizeof(UINT) to widen
+	int width;
+	int timebins;
+	int new_width;
+	int first_row;
+	bin_by_2_row_func row_func;
+
+} bin_by_2_info;
+
+int thread_bin_by_2(void* param, int task, int worker)
+{
+	bin_by_2_info* info = (bin_by_2_info*)param;
+	int y = info->first_row + task;
+	size_t row = (size_t)info->width * info->timebins;
+
+	USHORT* row_ptr = info->histogram + 2 * (size_t)y * row;    // row to get data from
+	USHORT* row_ptr_dn = row_ptr + row;                          // and the row down from that
+	BYTE* row_ptr_binned = (BYTE*)info->binned + (size_t)y * info->new_width * info->timebins * info->out_value_bytes;   // row to put data into
+
+	info->row_func(row_ptr, row_ptr_dn, row_ptr_binned, info->new_width, info->timebins);
+
+	return(0);
+}
+
+int bin_by_2(USHORT* histogram, int width, int height, int timebins, int overflow, void* binned, int* new_width, int* new_height)
 {
+	if (histogram == NULL) return(-1);
+	if (overflow != SPAD_BIN_WRAP && overflow != SPAD_BIN_SATURATE && overflow != SPAD_BIN_WIDEN) {
+		printf("ERROR: Unknown binning overflow policy %d.\n", overflow);
+		return(-1);
+	}
+	if (overflow == SPAD_BIN_WIDEN && (binned == NULL || binned == histogram)) {
+		printf("ERROR: Binning to 32 bits needs a separate output image.\n");
+		return(-1);
+	}
+
 	int w = width / 2;
 	int h = height / 2;
+	int ret = 0;
+
+	if (new_width != NULL) *new_width = w;
+	if (new_height != NULL) *new_height = h;
+
+	bin_by_2_info info;
+	info.histogram = histogram;
+	info.binned = (binned != NULL) ? binned : histogram;
+	info.out_value_bytes = (overflow == SPAD_BIN_WIDEN) ? sizeof(UINT) : sizeof(USHORT);
+	info.width = width;
+	info.timebins = timebins;
+	info.new_width = w;
+	info.row_func = select_bin_by_2_row(overflow);
+
+	if (info.binned != histogram) {   // all rows at once
+		info.first_row = 0;
+		return(pool_run(h, thread_bin_by_2, &info));
+	}
+
+	for (int a = 0; a < h && ret == 0; a = (a == 0) ? 1 : 4 * a) {   // in place, in waves
+		info.first_row = a;
+		ret = pool_run(min((a == 0) ? 1 : 4 * a, h) - a, thread_bin_by_2, &info);
+	}
+
+	return(ret);
+}
+
+/*
+Binning pyramid, the image binned 2 x 2, 4 x 4, ... 2^nLevels x 2^nLevels in one pass.
 
-	for (int y = 0; y < h; y++) {
-		// rows (col start pts)
-		USHORT* row_ptr = histogram + 2 * y * width * timebins;    // row to get data from
-		USHORT* row_ptr_dn = row_ptr + width * timebins;           // and the row down from that
+Each task takes a strip of 2^nLevels input rows, bins it by 2 into 2^(nLevels-1) rows of the first level, bins those,
+still in cache, into the rows of the next level and so on down to one row of the last level. Every level is made from the
+one before rather than from the full image, so the image is read once and each level is read once more from cache.
+Levels are added with saturating adds, which is the same as saturating each binned value once, as SPAD_bin does.
+*/
 
-		USHORT* row_ptr_binned = histogram + y * w * timebins;     // row to put data into
+static void bin_by_2_row_float(float* row, float* row_dn, void* out, int new_width, int timebins)
+{
+	for (int x = 0; x < new_width; x++) {
+		float* tran1_ptr = row + 2 * (size_t)x * timebins;
+		float* tran2_ptr = tran1_ptr + timebins;
+		float* tran3_ptr = row_dn + 2 * (size_t)x * timebins;
+		float* tran4_ptr = tran3_ptr + timebins;
+		float* tran_ptr_binned = (float*)out + (size_t)x * timebins;
+
+		for (int t = 0; t < timebins; t++)
+			tran_ptr_binned[t] = tran1_ptr[t] + tran2_ptr[t] + tran3_ptr[t] + tran4_ptr[t];
+	}
+}
+
+#define MAX_PYRAMID_LEVELS 16
 
-		for (int x = 0; x < w; x++) {
-			// pixels (transient start pts)
-			USHORT* tran1_ptr = row_ptr + 2 * x * timebins;
-			USHORT* tran2_ptr = tran1_ptr + timebins;
-			USHORT* tran3_ptr = row_ptr_dn + 2 * x * timebins;
-			USHORT* tran4_ptr = tran3_ptr + timebins;
+template <typename T>
+struct bin_pyramid_info
+{
+	T* levels[MAX_PYRAMID_LEVELS + 1];   // level 0 is the image
+	int widths[MAX_PYRAMID_LEVELS + 1];
+	int heights[MAX_PYRAMID_LEVELS + 1];
+	int nLevels;
+	int timebins;
+	void (*row_func)(T* row, T* row_dn, void* out, int new_width, int timebins);
+};
+
+template <typename T>
+int thread_bin_pyramid(void* param, int task, int worker)
+{
+	bin_pyramid_info<T>* info = (bin_pyramid_info<T>*)param;
+	int timebins = info->timebins;
 
-			USHORT* tran_ptr_binned = row_ptr_binned + x * timebins;
+	for (int l = 1; l <= info->nLevels; l++) {
+		int nRows = 1 << (info->nLevels - l);   // rows of this level in the strip
+		int last = min((task + 1) * nRows, info->heights[l]);
+		size_t in_row = (size_t)info->widths[l - 1] * timebins;
+		size_t out_row = (size_t)info->widths[l] * timebins;
 
-			for (int t = 0; t < timebins; t++) {
+		for (int y = task * nRows; y < last; y++) {
+			T* row_ptr = info->levels[l - 1] + 2 * (size_t)y * in_row;
+			info->row_func(row_ptr, row_ptr + in_row, info->levels[l] + (size_t)y * out_row, info->widths[l], timebins);
+		}
+	}
 
-				*tran_ptr_binned = *tran1_ptr + *tran2_ptr + *tran3_ptr + *tran4_ptr;
+	return(0);
+}
+
+template <typename T>
+int bin_pyramid(T* histogram, int width, int height, int timebins, int nLevels, T* levels[], int widths[], int heights[],
+	void (*row_func)(T* row, T* row_dn, void* out, int new_width, int timebins))
+{
+	if (histogram == NULL || levels == NULL) return(-1);
+	if (nLevels < 1 || nLevels > MAX_PYRAMID_LEVELS) {
+		printf("ERROR: A binning pyramid has 1 to %d levels, not %d.\n", MAX_PYRAMID_LEVELS, nLevels);
+		return(-1);
+	}
+
+	bin_pyramid_info<T> info;
+	info.levels[0] = histogram;
+	info.widths[0] = width;
+	info.heights[0] = height;
+	for (int l = 1; l <= nLevels; l++) {
+		if (levels[l - 1] == NULL) return(-1);
+		info.levels[l] = levels[l - 1];
+		info.widths[l] = info.widths[l - 1] / 2;
+		info.heights[l] = info.heights[l - 1] / 2;
+		if (widths != NULL) widths[l - 1] = info.widths[l];
+		if (heights != NULL) heights[l - 1] = info.heights[l];
+	}
+	info.nLevels = nLevels;
+	info.timebins = timebins;
+	info.row_func = row_func;
+
+	int strip = 1 << (nLevels - 1);   // rows of the first level in each task
+	int nTasks = (info.heights[1] + strip - 1) / strip;
+
+	return(pool_run(nTasks, thread_bin_pyramid<T>, &info));
+}
 
-				// Move all ptrs aong 1 since we are not binning in time! phew!
-				tran1_ptr++;
-				tran2_ptr++;
-				tran3_ptr++;
-				tran4_ptr++;
-				tran_ptr_binned++;
+int SPAD_bin_pyramid(USHORT* histogram, int width, int height, int timebins, int nLevels, USHORT* levels[], int widths[], int heights[])
+{
+	return(bin_pyramid(histogram, width, height, timebins, nLevels, levels, widths, heights, select_bin_by_2_row(SPAD_BIN_SATURATE)));
+}
+
+int SPAD_bin_pyramid_float(float* histogram, int width, int height, int timebins, int nLevels, float* levels[], int widths[], int heights[])
+{
+	return(bin_pyramid(histogram, width, height, timebins, nLevels, levels, widths, heights, bin_by_2_row_float));
+}
+
+/*
+Binning by any bin_x x bin_y in one pass over the image.
+
+Each output pixel adds up its bin_x * bin_y input transients in an accumulator of wider type, a UINT for USHORT images,
+and is then stored once, saturating at 65535 rather than wrapping. The output rows are independent so they are the tasks
+for the thread pool. Each task reads bin_y whole input rows and writes one output row.
+
+The output is a separate image. In place, output rows overwrite input rows that another task may still be reading, so the
+output goes to a temporary image that is copied back. If there is no memory for that, the rows are done in order on one
+thread. That is still safe in place: each output pixel is stored at or before the first of its input transients.
+*/
+
+#define BIN_NXM_CHUNK 32   // timebins added up at once
+
+static inline UINT bin_accumulator(USHORT value) { return(value); }
+static inline float bin_accumulator(float value) { return(value); }
+static inline USHORT bin_store(UINT sum) { return (sum > 65535) ? 65535 : (USHORT)sum; }
+static inline float bin_store(float sum) { return(sum); }
+
+template <typename T>
+struct bin_nxm_info
+{
+	T* histogram;
+	T* binned;
+	int width;
+	int timebins;
+	int bin_x;
+	int bin_y;
+	int new_width;
+};
+
+template <typename T, typename A>
+int thread_bin_nxm(void* param, int task, int worker)
+{
+	bin_nxm_info<T>* info = (bin_nxm_info<T>*)param;
+	int timebins = info->timebins;
+	size_t row = (size_t)info->width * timebins;
+
+	T* row_ptr = info->histogram + (size_t)task * info->bin_y * row;            // first input row
+	T* row_ptr_binned = info->binned + (size_t)task * info->new_width * timebins;   // output row
+
+	for (int x = 0; x < info->new_width; x++) {
+		T* tran_ptr = row_ptr + (size_t)x * info->bin_x * timebins;
+		T* tran_ptr_binned = row_ptr_binned + (size_t)x * timebins;
+
+		// A chunk of the transient at a time, so the sums stay in registers rather than going through memory
+		for (int t0 = 0; t0 < timebins; t0 += BIN_NXM_CHUNK) {
+			int n = min(BIN_NXM_CHUNK, timebins - t0);
+			A sum[BIN_NXM_CHUNK] = { 0 };
+
+			for (int dy = 0; dy < info->bin_y; dy++) {
+				for (int dx = 0; dx < info->bin_x; dx++) {
+					T* trans = tran_ptr + dy * row + (size_t)dx * timebins + t0;
+					if (n == BIN_NXM_CHUNK) {   // fixed trip count, unrolled
+						for (int t = 0; t < BIN_NXM_CHUNK; t++)
+							sum[t] += bin_accumulator(trans[t]);
+					}
+					else {
+						for (int t = 0; t < n; t++)
+							sum[t] += bin_accumulator(trans[t]);
+					}
+				}
 			}
+
+			for (int t = 0; t < n; t++)
+				tran_ptr_binned[t0 + t] = bin_store(sum[t]);
 		}
 	}
 
+	return(0);
+}
+
+template <typename T, typename A>
+int bin_nxm(T* histogram, int width, int height, int timebins, int bin_x, int bin_y, T* binned, int* new_width, int* new_height)
+{
+	if (histogram == NULL) return(-1);
+	if (bin_x < 1 || bin_y < 1) {
+		printf("ERROR: Bin size %d x %d is not allowed.\n", bin_x, bin_y);
+		return(-1);
+	}
+
+	int w = width / bin_x;
+	int h = height / bin_y;
+	int ret = 0;
+
 	if (new_width != NULL) *new_width = w;
 	if (new_height != NULL) *new_height = h;
+
+	if (bin_x == 1 && bin_y == 1) {   // nothing to add up
+		if (binned != NULL && binned != histogram)
+			memcpy(binned, histogram, (size_t)width * height * timebins * sizeof(T));
+		return(0);
+	}
+
+	bin_nxm_info<T> info;
+	info.histogram = histogram;
+	info.width = width;
+	info.timebins = timebins;
+	info.bin_x = bin_x;
+	info.bin_y = bin_y;
+	info.new_width = w;
+
+	T* temp = NULL;
+	if (binned == NULL || binned == histogram) {
+		temp = (T*)malloc((size_t)w * h * timebins * sizeof(T));
+		binned = histogram;
+	}
+
+	if (temp != NULL) {
+		info.binned = temp;
+		ret = pool_run(h, thread_bin_nxm<T, A>, &info);
+		memcpy(histogram, temp, (size_t)w * h * timebins * sizeof(T));
+		free(temp);
+	}
+	else if (binned == histogram) {   // in place in row order
+		info.binned = histogram;
+		for (int y = 0; y < h && ret == 0; y++)
+			ret = thread_bin_nxm<T, A>(&info, y, 0);
+	}
+	else {
+		info.binned = binned;
+		ret = pool_run(h, thread_bin_nxm<T, A>, &info);
+	}
+
+	if (ret < 0)
+		printf("ERROR: Could not bin the image.\n");
+
+	return(ret);
+}
+
+void SPAD_bin_by_2(USHORT* histogram, int width, int height, int timebins, int* new_width, int* new_height)
+{
+	bin_by_2(histogram, width, height, timebins, SPAD_BIN_WRAP, NULL, new_width, new_height);
+}
+
+int SPAD_bin_by_2_overflow(USHORT* histogram, int width, int height, int timebins, int overflow, void* binned, int* new_width, int* new_height)
+{
+	return(bin_by_2(histogram, width, height, timebins, overflow, binned, new_width, new_height));
 }
 
 void SPAD_bin(USHORT* histogram, int width, int height, int timebins, int bin_size, int* new_width, int* new_height)
 {
-	int w = width;
-	int	h = height;
+	bin_nxm<USHORT, UINT>(histogram, width, height, timebins, max(bin_size, 1), max(bin_size, 1), NULL, new_width, new_height);
+}
 
-	while (bin_size > 1) {
-		SPAD_bin_by_2(histogram, width, height, timebins, &w, &h);
-		width = w;
-		height = h;
-		bin_size = bin_size / 2;
+void SPAD_bin_float(float* histogram, int width, int height, int timebins, int bin_size, int* new_width, int* new_height)
+{
+	bin_nxm<float, float>(histogram, width, height, timebins, max(bin_size, 1), max(bin_size, 1), NULL, new_width, new_height);
+}
+
+int SPAD_bin_nxm(USHORT* histogram, int width, int height, int timebins, int bin_x, int bin_y, USHORT* binned, int* new_width, int* new_height)
+{
+	return(bin_nxm<USHORT, UINT>(histogram, width, height, timebins, bin_x, bin_y, binned, new_width, new_height));
+}
+
+int SPAD_bin_nxm_float(float* histogram, int width, int height, int timebins, int bin_x, int bin_y, float* binned, int* new_width, int* new_height)
+{
+	return(bin_nxm<float, float>(histogram, width, height, timebins, bin_x, bin_y, binned, new_width, new_height));
+}
+
+int SPAD_bin_by_2_benchmark(char filepath[], int repeats)
+{
+	const int sizes[][3] = { { 192, 128, 256 }, { 768, 512, 256 } };   // one sensor image, and a 4 x 4 mosaic of them
+	const char* policies[] = { "wrap", "saturate", "widen" };
+	FILE* fp;
+	int ret = 0;
+
+	if (repeats < 1) return(-1);
+
+	fopen_s(&fp, filepath, "w");
+	if (!fp) {
+		printf("ERROR: Could not open binning benchmark file.\n");
+		return(-1);
 	}
 
-	if (new_width != NULL) *new_width = w;
-	if (new_height != NULL) *new_height = h;
+	int level = simd_level();
+	fprintf(fp, "width, height, timebins, overflow, kernel, threads, ms, GB per s read, speedup\n");
+
+	for (int n = 0; ret == 0 && n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+		int width = sizes[n][0], height = sizes[n][1], timebins = sizes[n][2];
+		size_t nValues = (size_t)width * height * timebins;
+		size_t nBinned = (size_t)(width / 2) * (height / 2) * timebins;
+
+		USHORT* original = (USHORT*)malloc(nValues * sizeof(USHORT));
+		USHORT* image = (USHORT*)malloc(nValues * sizeof(USHORT));
+		UINT* reference = (UINT*)malloc(nBinned * sizeof(UINT));
+		UINT* binned = (UINT*)malloc(nBinned * sizeof(UINT));
+		if (!original || !image || !reference || !binned) {
+			printf("ERROR: Could not allocate space for the binning benchmark.\n");
+			ret = -2;
+		}
+
+		// Made up counts, a few high enough to overflow
+		spad_rng rng;
+		spad_rng_init(&rng, 2024, n, 0);
+		for (size_t i = 0; ret == 0 && i < nValues; i++) {
+			UINT r = spad_rng_next(&rng);
+			original[i] = (USHORT)((r & 0xFF) == 0 ? 20000 + (r >> 16) % 20000 : r % 64);
+		}
+
+		for (int overflow = SPAD_BIN_WRAP; ret == 0 && overflow <= SPAD_BIN_WIDEN; overflow++) {
+			size_t out_bytes = nBinned * ((overflow == SPAD_BIN_WIDEN) ? sizeof(UINT) : sizeof(USHORT));
+			double ms[2] = { 0.0, 0.0 };
+
+			for (int simd = 0; simd < 2; simd++) {
+				SPAD_set_simd_level(simd ? level : SPAD_SIMD_SCALAR);
+
+				for (int r = 0; r < repeats; r++) {
+					memcpy(image, original, nValues * sizeof(USHORT));
+					void* out = (overflow == SPAD_BIN_WIDEN) ? (void*)binned : NULL;   // in place unless widening
+
+					clock_t tStart = clock();
+					SPAD_bin_by_2_overflow(image, width, height, timebins, overflow, out, NULL, NULL);
+					ms[simd] += 1000.0 * ((double)clock() - (double)tStart) / CLOCKS_PER_SEC / repeats;
+				}
+
+				// The scalar kernel is the reference for the simd one
+				void* result = (overflow == SPAD_BIN_WIDEN) ? (void*)binned : (void*)image;
+				if (!simd)
+					memcpy(reference, result, out_bytes);
+				else if (memcmp(reference, result, out_bytes) != 0)
+					ret = -3;
+
+				// The level the simd run was at, AVX-512 uses the AVX2 kernels
+				const char* levels[] = { "scalar", "avx2", "avx512 (avx2 kernel)" };
+				const char* name = simd ? levels[level] : "scalar";
+				double gb_per_s = (ms[simd] > 0) ? nValues * sizeof(USHORT) / ms[simd] / 1E6 : 0.0;
+				double speedup = (simd && ms[1] > 0) ? ms[0] / ms[1] : 1.0;
+				fprintf(fp, "%d, %d, %d, %s, %s, %d, %.3f, %.2f, %.2f\n", width, height, timebins, policies[overflow], name, pool_number_of_workers(),
+					ms[simd], gb_per_s, speedup);
+			}
+			printf("%d x %d x %d %s: %.2f ms scalar, %.2f ms simd\n", width, height, timebins, policies[overflow], ms[0], ms[1]);
+		}
+
+		free(original);
+		free(image);
+		free(reference);
+		free(binned);
+	}
+
+	if (ret == -3)
+		printf("ERROR: SIMD binning differs from the scalar binning.\n");
+
+	SPAD_set_simd_level(level);
+	fclose(fp);
 
+	return(ret);
 }
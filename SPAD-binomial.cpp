@@ -0,0 +1,201 @@
+#include <windows.h>
+#include <iostream>
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+#include "SPAD-random.h"
+#include <random>
+#include <cmath>
+
+/*
+Binomial random numbers for the redistribution of photons between time bins.
+
+rbinom is the one used by the corrections. It is exact and does no allocation or object construction per call:
+    small n             photon by photon, one 32 bit random number per photon
+    n*p < 10            inversion, sequential search from 0, one uniform
+    otherwise           BTRS, transformed rejection with squeeze, W. Hormann, "The generation of binomial random
+                        variates", J. Stat. Comput. Simul. 46 (1993). Each try takes 2 uniforms, 1.4 tries per
+                        variate at n*p = 10 falling to 1.15 at n*p = 10000, so 2.3 to 2.8 uniforms.
+All state is on the stack or in the caller's random stream, so it is safe to use from any number of threads.
+
+The previous samplers are kept for comparison by SPAD_binomial_benchmark.
+*/
+
+#define RBINOM_PHOTON_MAX_N 8       // below this counting photons is cheaper than the setup of the other methods
+#define RBINOM_INVERSION_MAX_NP 10.0
+
+// MSVC Binomial random number generation, 39 ms for 16x16
+
+using BinomialDist = std::binomial_distribution<>;
+
+int MSVC_rbinom(int n, double p, spad_rng* rng)
+{
+    if (p <= 0.0) return(0);
+    if (p >= 1.0) return(n);
+    BinomialDist rand_binom(n, p);
+    spad_rng_engine gen(rng);
+    return rand_binom(gen);
+}
+
+// Brute force photon by photon, 17 ms for 16x16
+// Speed depends on n with large n slower
+int rbinom_photons(int n, double p, spad_rng* rng)
+{
+    if (p <= 0.0) return(0);
+    if (p >= 1.0) return(n);
+
+    int x = 0;
+    unsigned int P = (unsigned int)(p * 4294967296.0);   // p < 1 so this fits
+
+    for (int i = 0; i < n; i++) {
+        if (spad_rng_next(rng) < P) {
+            x++;
+        }
+    }
+
+    return (x);
+}
+
+// Original combination, photons up to 100 then MSVC
+int rbinom_original(int n, double p, spad_rng* rng)
+{
+    if (n > 100) return(MSVC_rbinom(n, p, rng));
+
+    return(rbinom_photons(n, p, rng));
+}
+
+// Inversion by sequential search, for p <= 0.5 and small n*p
+static int rbinom_inversion(int n, double p, spad_rng* rng)
+{
+    double q = 1.0 - p;
+    double s = p / q;
+    double a = (n + 1) * s;
+    double r = pow(q, n);      // P(0)
+    double u = spad_rng_uniform(rng);
+    int x = 0;
+
+    while (u > r) {
+        u -= r;
+        x++;
+        if (x > n) {    // rounding has left u just above the total, start again
+            u = spad_rng_uniform(rng);
+            r = pow(q, n);
+            x = 0;
+            continue;
+        }
+        r *= (a / x - s);
+    }
+
+    return(x);
+}
+
+// BTRS for p <= 0.5 and n*p >= 10
+static int rbinom_btrs(int n, double p, spad_rng* rng)
+{
+    double q = 1.0 - p;
+    double spq = sqrt(n * p * q);
+    double b = 1.15 + 2.53 * spq;
+    double a = -0.0873 + 0.0248 * b + 0.01 * p;
+    double c = n * p + 0.5;
+    double v_r = 0.92 - 4.2 / b;
+    double alpha = (2.83 + 5.1 / b) * spq;
+    double lpq = log(p / q);
+    int m = (int)floor((n + 1) * p);    // mode
+    double h = lgamma(m + 1.0) + lgamma(n - m + 1.0);
+
+    while (1) {
+        double u = spad_rng_uniform(rng) - 0.5;
+        double v = spad_rng_uniform(rng);
+        double us = 0.5 - fabs(u);
+        int k = (int)floor((2.0 * a / us + b) * u + c);
+
+        if (k < 0 || k > n) continue;
+
+        // Most variates are accepted here without any logs
+        if (us >= 0.07 && v <= v_r) return(k);
+
+        // Otherwise compare with the exact probability
+        v = log(v * alpha / (a / (us * us) + b));
+        double bound = h - lgamma(k + 1.0) - lgamma(n - k + 1.0) + (k - m) * lpq;
+        if (v <= bound) return(k);
+    }
+}
+
+int rbinom(int n, double p, spad_rng* rng)
+{
+    if (p <= 0.0 || n <= 0) return(0);
+    if (p >= 1.0) return(n);
+
+    if (n < RBINOM_PHOTON_MAX_N) return(rbinom_photons(n, p, rng));
+
+    // Both methods below need p <= 0.5
+    if (p > 0.5) return(n - rbinom(n, 1.0 - p, rng));
+
+    if (n * p < RBINOM_INVERSION_MAX_NP) return(rbinom_inversion(n, p, rng));
+
+    return(rbinom_btrs(n, p, rng));
+}
+
+// Non random alternative for comparison with redistribution of photons fractionally
+// Should return n*p
+// But result needs to remain integer for saving back to uint16
+// To use, uncomment and comment the real version.
+// This is better tested in R.
+/*
+int rbinom(int n, double p, spad_rng* rng)
+{
+    return ((int)((double)n * p));
+}
+*/
+
+
+/* test functions */
+
+typedef int (*rbinom_func)(int n, double p, spad_rng* rng);
+
+int SPAD_binomial_benchmark(char filepath[])
+{
+    FILE* fp;
+    const int nValues[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 5000, 20000 };
+    const double pValues[] = { 0.01, 0.1, 0.3, 0.5, 0.7, 0.9 };
+    const rbinom_func funcs[] = { rbinom_original, MSVC_rbinom, rbinom };
+    const char* names[] = { "original", "MSVC", "rbinom" };
+    const int nDraws = 200000;
+
+    fopen_s(&fp, filepath, "w");
+    if (!fp) {
+        printf("ERROR: Could not open binomial benchmark file.\n");
+        return(-1);
+    }
+
+    fprintf(fp, "n, p, method, ns per draw, mean, expected mean, variance, expected variance\n");
+
+    for (int in = 0; in < sizeof(nValues) / sizeof(nValues[0]); in++) {
+        for (int ip = 0; ip < sizeof(pValues) / sizeof(pValues[0]); ip++) {
+            int n = nValues[in];
+            double p = pValues[ip];
+
+            for (int f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+                spad_rng rng;
+                spad_rng_init(&rng, 12345, in, ip);
+                double sum = 0, sum2 = 0;
+
+                clock_t tStart = clock();
+                for (int i = 0; i < nDraws; i++) {
+                    int x = funcs[f](n, p, &rng);
+                    sum += x;
+                    sum2 += (double)x * x;
+                }
+                double ns = 1E9 * ((double)clock() - (double)tStart) / CLOCKS_PER_SEC / nDraws;
+
+                double mean = sum / nDraws;
+                double var = sum2 / nDraws - mean * mean;
+                fprintf(fp, "%d, %.2f, %s, %.1f, %.4f, %.4f, %.4f, %.4f\n", n, p, names[f], ns, mean, n * p, var, n * p * (1 - p));
+                printf("n=%d p=%.2f %s: %.1f ns per draw\n", n, p, names[f], ns);
+            }
+        }
+    }
+
+    fclose(fp);
+
+    return(0);
+}
@@ -18,6 +18,8 @@ void configure_parser(cli::Parser& parser) {
 	parser.set_required<int>("st", "start_bin", "The first timebin to use from each signal. Usually 10 (UCL) or 40 (KCL).");
 	parser.set_required<int>("sp", "stop_bin", "The lasst timebin to use from each signal. Usually 245 (UCL) or 230 (KCL).");
 	parser.set_optional<double>("d", "delta", -1.0, "The delay between peaks 1 and 2 in real time will be used to calbrate the time axis. If -1.0 (default) the median time from the data will be used.");
+	parser.set_optional<int>("p", "precision", SPAD_PRECISION_DOUBLE, "Precision of the bin width factors in binwidth_factors.dat and calibration.spadcal: 0 = double, 1 = float32 (half size), 2 = 16 bit fixed point (quarter size).");
+	parser.set_optional<int>("pca", "pca-components", 0, "Also save binwidth_factors_pca.dat, the bin width factors compressed to this many shared components (e.g. 8). 0 for none.");
 	parser.set_optional<bool>("t", "test-files", false, "Produce text files and detector signals as well as data files to collect statistics on this detector array and test the output.");
 
     // Examples
@@ -184,7 +186,7 @@ int main(int argc, char** argv)
 		char datafile[] = "binwidth_factors.dat";
 		printf("SPAD_write_bin_width_factors_to_file %s...", datafile);
 		tStart = clock();
-		ret = SPAD_write_bin_width_factors_to_file(datafile);
+		ret = SPAD_write_bin_width_factors_to_file_precision(datafile, parser.get<int>("p"));
 		printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
 
 		if (ret < 0) {
@@ -192,6 +194,21 @@ int main(int argc, char** argv)
 			return(-2);
 		}
 
+		int nComponents = parser.get<int>("pca");
+		if (nComponents > 0) {
+			char pcafile[] = "binwidth_factors_pca.dat";
+			printf("SPAD_compress_bin_width_factors %d components...\n", nComponents);
+			tStart = clock();
+			ret = SPAD_compress_bin_width_factors(w, h, t, nComponents);
+			if (ret >= 0) ret = SPAD_write_bin_width_pca_to_file(pcafile);
+			printf("SPAD_write_bin_width_pca_to_file %s time taken: %.2fs\n", pcafile, ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+
+			if (ret < 0) {
+				printf("ERROR: %d\n", ret);
+				return(-2);
+			}
+		}
+
 		if (test_dump) {
 			char datafile[] = "binwidth_factors_dump.txt";
 			printf("SPAD_dump_bin_width_factors_to_text_file %s...", datafile);
@@ -316,6 +333,20 @@ int main(int argc, char** argv)
 
 	}
 
+	// All the calibration in one file, now the time calibration is final
+	{
+		char datafile[] = "calibration.spadcal";
+		printf("SPAD_write_calibration_file %s...", datafile);
+		clock_t tSave = clock();
+		ret = SPAD_write_calibration_file(datafile, w, h, t, parser.get<int>("p"), start_bin, stop_bin);
+		printf(" time taken: %.2fs\n", ((double)clock() - (double)tSave) / CLOCKS_PER_SEC);
+
+		if (ret < 0) {
+			printf("ERROR: %d\n", ret);
+			return(-2);
+		}
+	}
+
 	double new_ns_per_bin = SPAD_get_calibrated_timebase();
 	if (new_ns_per_bin > 0) {   // a value was calculated
 		ns_per_bin = new_ns_per_bin;
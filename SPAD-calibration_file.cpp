@@ -0,0 +1,342 @@
+#include <windows.h>
+#include <iostream>
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+
+extern double* gBinWidthFactors;
+extern int gnBinWidthFactors;
+extern double* gTimebaseShifts;
+extern int gnTimebaseShifts;
+extern double* gTimebaseScales;
+extern int gnTimebaseScales;
+
+/*
+Single file calibration container.
+
+Holds all the calibration with what is needed to check it belongs to an image, and is memory mapped to load it. The
+double arrays are used in place in the mapping, so starting a correction only reads the pages of the file that are used
+and processes correcting on the same machine share them. The mapping is copy on write, the calibration can still be
+changed in memory without changing the file.
+
+File layout, all little endian, each array starts on a CALIBRATION_FILE_ALIGN byte boundary:
+    calibration_file_header (header_bytes, 128 for version 1)
+    bin width factors       width * height * timebins values, double, float32 or fixed16 (see SPAD-bin_width_factors.cpp)
+    timebase shifts         width * height + 1 doubles, the last is the mean peak position
+    timebase scales         width * height + 1 doubles, the last is the calibrated ns per bin
+
+The checksum is FNV-1a 64 over the 8 byte words of everything after the header.
+*/
+
+#define CALIBRATION_FILE_MAGIC "SPADCAL"
+#define CALIBRATION_FILE_VERSION 1
+#define CALIBRATION_FILE_ALIGN 64
+
+typedef struct
+{
+    char magic[8];
+    int version;
+    int header_bytes;           // start of the data, later versions can add to the header
+    int width;
+    int height;
+    int timebins;
+    int dtype;                  // SPAD_PRECISION_* of the bin width factors
+    int start_bin;              // bins used for the bin width factors, -1 if not known
+    int stop_bin;
+    double ns_per_bin;          // calibrated timebase, 0 if not known
+    unsigned long long offsets[3];  // bin width factors, timebase shifts, timebase scales
+    unsigned long long sizes[3];
+    unsigned long long checksum;
+    BYTE reserved[24];
+
+} calibration_file_header;
+
+static_assert(sizeof(calibration_file_header) == 128, "calibration file header must be 128 bytes");
+
+static spad_mapped_file gCalibrationMap = { 0 };
+
+static unsigned long long calibration_checksum(BYTE* data, size_t nBytes)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    size_t nWords = nBytes / 8;
+
+    for (size_t i = 0; i < nWords; i++) {
+        unsigned long long w;
+        memcpy(&w, data + i * 8, 8);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (size_t i = nWords * 8; i < nBytes; i++) {
+        h = (h ^ data[i]) * 1099511628211ULL;
+    }
+
+    return(h);
+}
+
+static size_t calibration_dtype_bytes(int dtype)
+{
+    if (dtype == SPAD_PRECISION_DOUBLE) return(sizeof(double));
+    if (dtype == SPAD_PRECISION_FLOAT32) return(sizeof(float));
+    if (dtype == SPAD_PRECISION_FIXED16) return(sizeof(short));
+    return(0);
+}
+
+static unsigned long long calibration_align(unsigned long long n)
+{
+    return ((n + CALIBRATION_FILE_ALIGN - 1) / CALIBRATION_FILE_ALIGN * CALIBRATION_FILE_ALIGN);
+}
+
+// Free a calibration array unless it is in the mapped file
+void release_calibration_array(double* p)
+{
+    if (!in_mapped_file(&gCalibrationMap, p)) free(p);
+}
+
+int SPAD_write_calibration_file(char filepath[], int width, int height, int timebins, int precision, int start_bin, int stop_bin)
+{
+    FILE* fp;
+    int nPixels = width * height;
+    size_t nValues = (size_t)nPixels * timebins;
+    size_t dtype_bytes = calibration_dtype_bytes(precision);
+
+    if (!dtype_bytes) {
+        printf("ERROR: Unknown bin width factors precision %d.\n", precision);
+        return(-1);
+    }
+
+    if (!gBinWidthFactors || !gTimebaseShifts || !gTimebaseScales ||
+        gnBinWidthFactors != nValues || gnTimebaseShifts != nPixels || gnTimebaseScales != nPixels) {
+        printf("ERROR: No calibration for a %d x %d x %d image to save.\n", width, height, timebins);
+        return(-1);
+    }
+
+    calibration_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CALIBRATION_FILE_MAGIC, sizeof(CALIBRATION_FILE_MAGIC));
+    header.version = CALIBRATION_FILE_VERSION;
+    header.header_bytes = sizeof(calibration_file_header);
+    header.width = width;
+    header.height = height;
+    header.timebins = timebins;
+    header.dtype = precision;
+    header.start_bin = start_bin;
+    header.stop_bin = stop_bin;
+    header.ns_per_bin = SPAD_get_calibrated_timebase();
+    header.sizes[0] = nValues * dtype_bytes;
+    header.sizes[1] = (nPixels + 1) * sizeof(double);
+    header.sizes[2] = (nPixels + 1) * sizeof(double);
+    header.offsets[0] = calibration_align(header.header_bytes);
+    header.offsets[1] = calibration_align(header.offsets[0] + header.sizes[0]);
+    header.offsets[2] = calibration_align(header.offsets[1] + header.sizes[1]);
+
+    // Build the data in memory, it is needed whole for the checksum
+    size_t nDataBytes = (size_t)(header.offsets[2] + header.sizes[2] - header.header_bytes);
+    BYTE* data = (BYTE*)calloc(nDataBytes, 1);
+    if (!data) {
+        printf("ERROR: Could not allocate calibration file.\n");
+        return(-2);
+    }
+
+    void* bwf = data + header.offsets[0] - header.header_bytes;
+    if (precision == SPAD_PRECISION_DOUBLE) {
+        memcpy(bwf, gBinWidthFactors, header.sizes[0]);
+    }
+    else if (precision == SPAD_PRECISION_FLOAT32) {
+        for (size_t i = 0; i < nValues; i++)
+            ((float*)bwf)[i] = (float)gBinWidthFactors[i];
+    }
+    else {
+        pack_bin_width_factors_fixed16(gBinWidthFactors, (short*)bwf, nValues);
+    }
+    memcpy(data + header.offsets[1] - header.header_bytes, gTimebaseShifts, header.sizes[1]);
+    memcpy(data + header.offsets[2] - header.header_bytes, gTimebaseScales, header.sizes[2]);
+
+    header.checksum = calibration_checksum(data, nDataBytes);
+
+    fopen_s(&fp, filepath, "wb");
+    if (!fp) {
+        printf("ERROR: Could not save calibration file.\n");
+        free(data);
+        return(-1);
+    }
+
+    size_t nWrote = fwrite(&header, sizeof(header), 1, fp);
+    if (nWrote == 1) nWrote = fwrite(data, 1, nDataBytes, fp);
+    else nWrote = 0;
+
+    fclose(fp);
+    free(data);
+
+    if (nWrote != nDataBytes) {
+        printf("ERROR: Calibration was not written to file correctly.\n");
+        return(-3);
+    }
+
+    return(0);
+}
+
+int SPAD_read_calibration_file(char filepath[], int width, int height, int timebins, int verify)
+{
+    spad_mapped_file map;
+    int nPixels = width * height;
+    size_t nValues = (size_t)nPixels * timebins;
+
+    if (map_file(filepath, 1, &map) < 0) {
+        printf("ERROR: Could not open calibration file.\n");
+        return(-1);
+    }
+
+    calibration_file_header* header = (calibration_file_header*)map.data;
+
+    if (map.size < sizeof(calibration_file_header) || memcmp(header->magic, CALIBRATION_FILE_MAGIC, sizeof(CALIBRATION_FILE_MAGIC)) != 0) {
+        printf("ERROR: %s is not a calibration file.\n", filepath);
+        unmap_file(&map);
+        return(-2);
+    }
+
+    if (header->version > CALIBRATION_FILE_VERSION || header->header_bytes < sizeof(calibration_file_header)) {
+        printf("ERROR: Calibration file version %d is newer than this program reads (%d).\n", header->version, CALIBRATION_FILE_VERSION);
+        unmap_file(&map);
+        return(-2);
+    }
+
+    if (header->width != width || header->height != height || header->timebins != timebins) {
+        printf("ERROR: Calibration file is for a %d x %d x %d image, not %d x %d x %d.\n",
+            header->width, header->height, header->timebins, width, height, timebins);
+        unmap_file(&map);
+        return(-3);
+    }
+
+    size_t dtype_bytes = calibration_dtype_bytes(header->dtype);
+    unsigned long long expected_sizes[3] = { nValues * dtype_bytes, (nPixels + 1) * sizeof(double), (nPixels + 1) * sizeof(double) };
+    for (int i = 0; i < 3; i++) {
+        if (!dtype_bytes || header->sizes[i] != expected_sizes[i] || header->offsets[i] < (unsigned long long)header->header_bytes ||
+            header->offsets[i] % sizeof(double) != 0 || header->offsets[i] + header->sizes[i] > map.size) {
+            printf("ERROR: Calibration file is damaged or truncated.\n");
+            unmap_file(&map);
+            return(-4);
+        }
+    }
+
+    if (verify) {
+        BYTE* data = (BYTE*)map.data + header->header_bytes;
+        if (calibration_checksum(data, map.size - header->header_bytes) != header->checksum) {
+            printf("ERROR: Calibration file checksum does not match, the file is damaged.\n");
+            unmap_file(&map);
+            return(-5);
+        }
+    }
+
+    // Bin width factors in double are used where they are, the compact ones are expanded
+    double* factors;
+    void* bwf = (BYTE*)map.data + header->offsets[0];
+    if (header->dtype == SPAD_PRECISION_DOUBLE) {
+        factors = (double*)bwf;
+    }
+    else {
+        factors = (double*)malloc(nValues * sizeof(double));
+        if (!factors) {
+            printf("ERROR: Could not allocate bin width factors.\n");
+            unmap_file(&map);
+            return(-6);
+        }
+        if (header->dtype == SPAD_PRECISION_FLOAT32) {
+            for (size_t i = 0; i < nValues; i++)
+                factors[i] = ((float*)bwf)[i];
+        }
+        else {
+            unpack_bin_width_factors_fixed16((short*)bwf, factors, nValues);
+        }
+    }
+
+    // Replace the old calibration, which may be in an older mapped file
+    release_calibration_array(gBinWidthFactors);
+    release_calibration_array(gTimebaseShifts);
+    release_calibration_array(gTimebaseScales);
+    unmap_file(&gCalibrationMap);
+    gCalibrationMap = map;
+
+    gBinWidthFactors = factors;
+    gnBinWidthFactors = (int)nValues;
+    gTimebaseShifts = (double*)((BYTE*)map.data + header->offsets[1]);
+    gnTimebaseShifts = nPixels;
+    gTimebaseScales = (double*)((BYTE*)map.data + header->offsets[2]);
+    gnTimebaseScales = nPixels;
+
+    invalidate_correction_plan();
+    deactivate_bin_width_pca();
+
+    // Only write if different, so the page stays shared
+    if (header->ns_per_bin > 0.0 && SPAD_get_calibrated_timebase() != header->ns_per_bin)
+        SPAD_set_calibrated_timebase(header->ns_per_bin);
+
+    printf("Calibration for %d x %d x %d image, bin width factors from bins %d to %d, %.5f ns per bin.\n",
+        width, height, timebins, header->start_bin, header->stop_bin, SPAD_get_calibrated_timebase());
+
+    return(0);
+}
+
+int SPAD_release_calibration_rows(int width, int height, int timebins, int first_row, int nRows)
+{
+    int nPixels = width * height;
+
+    if (first_row < 0 || nRows < 1 || first_row + nRows > height) {
+        printf("ERROR: Rows %d to %d are not in a %d row image.\n", first_row, first_row + nRows - 1, height);
+        return(-1);
+    }
+    if (!gBinWidthFactors || !gTimebaseShifts || !gTimebaseScales ||
+        gnBinWidthFactors != (size_t)nPixels * timebins || gnTimebaseShifts != nPixels || gnTimebaseScales != nPixels)
+        return(0);   // nothing for this image
+
+    // Legacy files, compact bin width factors expanded on reading and reset parts of the calibration are in ordinary memory
+    if (!in_mapped_file(&gCalibrationMap, gBinWidthFactors) || !in_mapped_file(&gCalibrationMap, gTimebaseShifts) ||
+        !in_mapped_file(&gCalibrationMap, gTimebaseScales))
+        return(0);
+
+    size_t first = (size_t)first_row * width, n = (size_t)nRows * width;
+    release_mapped_pages(&gCalibrationMap, gBinWidthFactors + first * timebins, n * timebins * sizeof(double));
+    release_mapped_pages(&gCalibrationMap, gTimebaseShifts + first, n * sizeof(double));
+    release_mapped_pages(&gCalibrationMap, gTimebaseScales + first, n * sizeof(double));
+
+    return(1);
+}
+
+// Size of a legacy calibration file, they have no header so this is all there is to check
+static long long legacy_file_size(char filepath[])
+{
+    FILE* fp;
+
+    fopen_s(&fp, filepath, "rb");
+    if (!fp) return(-1);
+
+    _fseeki64(fp, 0, SEEK_END);
+    long long nBytes = _ftelli64(fp);
+    fclose(fp);
+
+    return(nBytes);
+}
+
+int SPAD_convert_calibration_files(char bin_width_factors_path[], char timebase_shifts_path[], char timebase_scales_path[],
+    char filepath[], int width, int height, int timebins, int precision, int start_bin, int stop_bin)
+{
+    long long nValues = (long long)width * height * timebins;
+    long long nBwfBytes = legacy_file_size(bin_width_factors_path);
+    long long nTimebaseBytes = ((long long)width * height + 1) * sizeof(double);
+
+    if (nBwfBytes != nValues * (long long)sizeof(double) && nBwfBytes != nValues * (long long)sizeof(float) && nBwfBytes != nValues * (long long)sizeof(short)) {
+        printf("ERROR: %s is not bin width factors for a %d x %d x %d image.\n", bin_width_factors_path, width, height, timebins);
+        return(-1);
+    }
+    if (legacy_file_size(timebase_shifts_path) != nTimebaseBytes) {
+        printf("ERROR: %s is not timebase shifts for a %d x %d image.\n", timebase_shifts_path, width, height);
+        return(-1);
+    }
+    if (legacy_file_size(timebase_scales_path) != nTimebaseBytes) {
+        printf("ERROR: %s is not timebase scales for a %d x %d image.\n", timebase_scales_path, width, height);
+        return(-1);
+    }
+
+    if (SPAD_read_bin_width_factors_from_file(bin_width_factors_path, width, height, timebins) < 0) return(-2);
+    if (SPAD_read_timebase_shifts_from_file(timebase_shifts_path, width, height) < 0) return(-2);
+    if (SPAD_read_timebase_scales_from_file(timebase_scales_path, width, height) < 0) return(-2);
+
+    return(SPAD_write_calibration_file(filepath, width, height, timebins, precision, start_bin, stop_bin));
+}
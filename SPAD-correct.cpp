@@ -9,6 +9,11 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 #include <windows.h>
 #include <time.h>
 #include <pathcch.h>
@@ -82,12 +87,33 @@ void configure_parser(cli::Parser& parser) {
     parser.set_required<std::string>("i", "input", "Path to input file. Wildcards allowed in the filename.");
     parser.set_optional<std::string>("s", "suffix", "_corrected", "Output filename suffix.");
     parser.set_optional<std::string>("bwf", "binwidth-factors-file", default_binwidth_factors_path, "Bin width factors calibration file (binary).");
+    parser.set_optional<std::string>("bwfc", "binwidth-pca-file", "", "Compressed bin width factors file (binary) from SPAD-calibrate -pca, used instead of the bin width factors file if given.");
     parser.set_optional<std::string>("tsh", "timebase-shifts-file", default_timebase_shifts_path, "Timebase shifts calibration file (binary).");
     parser.set_optional<std::string>("tsc", "timebase-scales-file", default_timebase_scales_path, "Timebase scales calibration file (binary).");
+    parser.set_optional<std::string>("cal", "calibration-file", "", "Single calibration file (binary) from SPAD-calibrate, used instead of the three separate files if given.");
+    parser.set_optional<std::string>("wcal", "write-calibration-file", "", "Convert the three separate calibration files to a single calibration file at this path, and use it.");
+    parser.set_optional<bool>("vcs", "verify-checksum", false, "Check the checksum of the calibration file, this reads the whole file, also with -mem. Otherwise only its header is checked and it is only read as far as it is used.");
     parser.set_optional<bool>("nbwf", "no-binwidth-factors", false, "Turn off the bin width correction.");
     parser.set_optional<bool>("ntsh", "no-timebase-shifts", false, "Turn off the timebase shift correction.");
     parser.set_optional<bool>("ntsc", "no-timebase-scales", false, "Turn off the timebase scale correction.");
-    parser.set_optional<int>("b", "binning", 0, "Bin after correction by b x b.");
+    parser.set_optional<int>("b", "binning", 0, "Bin after correction by b x b, any whole number. Done in the same pass as the correction, except with -bn.");
+    parser.set_optional<bool>("int", "intensity", false, "Also save the intensity image of the corrected (and binned) image, made in the same pass as the correction. Not with -bn.");
+    parser.set_optional<int>("pyr", "pyramid", 0, "Also save the corrected (and binned) image binned 2x2, 4x4, ... up to 2^pyr x 2^pyr, all made in one pass, as ics files ending _bin2, _bin4 etc.");
+    parser.set_optional<int>("ts", "time-start", 0, "First corrected time bin to save.");
+    parser.set_optional<int>("te", "time-stop", 0, "Save corrected time bins up to but not including this one, 0 for all the bins to the end.");
+    parser.set_optional<int>("tb", "time-binning", 1, "Add this many corrected time bins together into each saved bin. Done during the correction with -ts and -te.");
+    parser.set_optional<bool>("nmap", "no-map", false, "Read each image into memory before correcting it rather than memory mapping uncompressed files.");
+    parser.set_optional<int>("mem", "memory-budget", 0, "Read, correct and save each image a slab of rows at a time in about this many MB, for images too big to hold. Saved uncompressed, the data in a .ids file next to the .ics, which names it without a folder. Not with -bn or -pyr. Memory use only stays within this, whatever the height of the image, with -cal and a double precision calibration file (SPAD-calibrate -p 0, or -wcal), otherwise the calibration is held for the whole image.");
+    parser.set_optional<int>("c", "compression", 1, "gzip compression level of the saved images, 0 = none, 1 = fastest, 9 = smallest.");
+    parser.set_optional<int>("zb", "gzip-block", 0, "Compress the saved images in blocks of this many KB on all the threads, into a .ids file next to the .ics, which names it without a folder, so keep the two (and the .spadgzi index) together. 0 to compress on one thread in the .ics.");
+    parser.set_optional<int>("nt", "threads", 0, "Number of threads to use for the correction, 0 to use all available.");
+    parser.set_optional<int>("m", "method", SPAD_CORRECTION_BINOMIAL, "How photons are split between bins: 0 = chain of binomials, 1 = one multinomial draw per bin, 2 = no random numbers, round the expected counts with error diffusion.");
+    parser.set_optional<bool>("f", "float", false, "Deterministic correction, save the expected photon counts as floats instead of redistributing whole photons at random.");
+    parser.set_optional<int>("p", "precision", SPAD_PRECISION_FLOAT32, "Precision of the weights for the deterministic corrections (-f and -m 2): 1 = float32, 2 = 16 bit fixed point, less memory traffic.");
+    parser.set_optional<int>("bn", "batch", 1, "Number of images to load and correct together, the calibration is then read once for all of them. Needs memory for this many images.");
+    parser.set_optional<bool>("pl", "pipeline", false, "Load the next file and save the previous one on their own threads while the current one is corrected, and report the time of each stage at the end. Not with -bn or -mem.");
+    parser.set_optional<int>("pmem", "pipeline-memory", 0, "Most memory in MB for the images in the pipeline with -pl, from the start of loading to the end of saving. 0 for no limit other than the 2 images waiting between stages. An image over the limit still goes through alone.");
+    parser.set_optional<unsigned long long>("sd", "seed", 0, "Seed for the random redistribution of photons, gives identical output for identical input at the same position in the list of files, with or without -bn, -mem or -pl. Each file has its own random streams. 0 for a different seed every time.");
 
     // Examples
     //parser.set_optional<std::string>("o", "output", "data", "Strings are naturally included.");
@@ -110,68 +136,156 @@ int once_only(const char* path, const char* filename, cli::Parser& parser, int w
     if (nbwf && ntsh && ntsc)
         return(0);
 
-    if (nbwf) {
-        if (SPAD_reset_bin_width_factors(w, h, t) < 0)
-            return(-1);
+    std::string cal = parser.get<std::string>("cal");
+    std::string wcal = parser.get<std::string>("wcal");
+
+    if (!wcal.empty()) {
+        printf("SPAD_convert_calibration_files\n");
+        std::string bwf = parser.get<std::string>("bwf");
+        std::string tsh = parser.get<std::string>("tsh");
+        std::string tsc = parser.get<std::string>("tsc");
+        if (SPAD_convert_calibration_files((char*)bwf.c_str(), (char*)tsh.c_str(), (char*)tsc.c_str(), (char*)wcal.c_str(), w, h, t, SPAD_PRECISION_DOUBLE, -1, -1) < 0)
+            return(-7);
+        cal = wcal;
     }
-    else {
-        printf("SPAD_read_bin_width_factors_from_file\n");
-        sss = parser.get<std::string>("bwf");
-        dataPath = (char*)sss.c_str();
-        if (SPAD_read_bin_width_factors_from_file(dataPath, w, h, t) < 0)
+
+    if (!cal.empty()) {
+        printf("SPAD_read_calibration_file\n");
+        // Checking the checksum reads the whole file, so only when asked, the header is always checked
+        if (SPAD_read_calibration_file((char*)cal.c_str(), w, h, t, parser.get<bool>("vcs")) < 0)
             return(-2);
-    }
 
-    if (ntsh) {
-        if (SPAD_reset_timebase_shifts(w, h, t) < 0)
+        // The switches still turn off parts of the calibration in the file
+        if (nbwf && SPAD_reset_bin_width_factors(w, h, t) < 0)
+            return(-1);
+        if (!nbwf && !parser.get<std::string>("bwfc").empty()) {
+            printf("SPAD_read_bin_width_pca_from_file\n");
+            sss = parser.get<std::string>("bwfc");
+            if (SPAD_read_bin_width_pca_from_file((char*)sss.c_str(), w, h, t) < 0)
+                return(-2);
+        }
+        if (ntsh && SPAD_reset_timebase_shifts(w, h, t) < 0)
             return(-3);
-    }
-    else {
-        printf("SPAD_read_timebase_shifts_from_file\n");
-        sss = parser.get<std::string>("tsh");
-        dataPath = (char*)sss.c_str();
-        if (SPAD_read_timebase_shifts_from_file(dataPath, w, h) < 0)
-            return(-4);
-    }
-
-    if (ntsc) {
-        if (SPAD_reset_timebase_scales(w, h) < 0)
+        if (ntsc && SPAD_reset_timebase_scales(w, h) < 0)
             return(-5);
     }
     else {
-        printf("SPAD_read_timebase_scales_from_file\n");
-        sss = parser.get<std::string>("tsc");
-        dataPath = (char*)sss.c_str();
-        if (SPAD_read_timebase_scales_from_file(dataPath, w, h) < 0)
-            return(-6);
+        if (nbwf) {
+            if (SPAD_reset_bin_width_factors(w, h, t) < 0)
+                return(-1);
+        }
+        else if (!parser.get<std::string>("bwfc").empty()) {
+            printf("SPAD_read_bin_width_pca_from_file\n");
+            sss = parser.get<std::string>("bwfc");
+            dataPath = (char*)sss.c_str();
+            if (SPAD_read_bin_width_pca_from_file(dataPath, w, h, t) < 0)
+                return(-2);
+        }
+        else {
+            printf("SPAD_read_bin_width_factors_from_file\n");
+            sss = parser.get<std::string>("bwf");
+            dataPath = (char*)sss.c_str();
+            if (SPAD_read_bin_width_factors_from_file(dataPath, w, h, t) < 0)
+                return(-2);
+        }
+
+        if (ntsh) {
+            if (SPAD_reset_timebase_shifts(w, h, t) < 0)
+                return(-3);
+        }
+        else {
+            printf("SPAD_read_timebase_shifts_from_file\n");
+            sss = parser.get<std::string>("tsh");
+            dataPath = (char*)sss.c_str();
+            if (SPAD_read_timebase_shifts_from_file(dataPath, w, h) < 0)
+                return(-4);
+        }
+
+        if (ntsc) {
+            if (SPAD_reset_timebase_scales(w, h) < 0)
+                return(-5);
+        }
+        else {
+            printf("SPAD_read_timebase_scales_from_file\n");
+            sss = parser.get<std::string>("tsc");
+            dataPath = (char*)sss.c_str();
+            if (SPAD_read_timebase_scales_from_file(dataPath, w, h) < 0)
+                return(-6);
+        }
     }
 
+    // Streamed images build the plan for each slab as it is corrected, the plan for the whole image is too big
+    if (parser.get<int>("mem") > 0)
+        return(0);
+
+    // Same calibration is used for all files, so precalculate the corrections once
+    printf("SPAD_build_correction_plan...");
+    clock_t tStart = clock();
+    if (SPAD_build_correction_plan(w, h, t) < 0)
+        printf(" not used,");
+    printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+
     return(0);
 }
 
-int process(const char* path, const char* filename, cli::Parser& parser)
+// One image on its way through load, correct and save
+typedef struct
 {
     USHORT* image;
-    int w, h, t, final_w, final_h;
-    char datafilepath[MAX_PATH];
+    float* float_image;    // deterministic correction output, NULL when correcting in place
+    int w, h, t;
+    double xy_microns_per_pixel, ns_per_bin;
+    int binned;            // already binned to w x h by the fused correction
+    UINT* intensity;       // w x h photon totals to save, may be NULL
     char savefilepath[MAX_PATH];
     char intensitysavefilepath[MAX_PATH];
-    double xy_microns_per_pixel, ns_per_bin, scale;
+    unsigned long long index;   // of the file in the list, picks its random streams with -sd
+
+} loaded_image;
+
+void free_loaded_image(loaded_image* li)
+{
+    SPAD_free3DICSimage(li->image);
+    free(li->float_image);
+    free(li->intensity);
+    li->image = NULL;
+    li->float_image = NULL;
+    li->intensity = NULL;
+}
+
+// Binning or the intensity image are made in the same pass as the correction
+bool use_fused_correction(cli::Parser& parser)
+{
+    return (parser.get<int>("b") > 1 || parser.get<bool>("int"));
+}
+
+int load_image(const char* path, const char* filename, cli::Parser& parser, bool fused, loaded_image* li)
+{
+    char datafilepath[MAX_PATH];
     static int first_time = 1;
 
-    setup_file_paths(path, filename, parser.get<std::string>("s").c_str(), datafilepath, savefilepath, intensitysavefilepath);
+    li->image = NULL;
+    li->float_image = NULL;
+    li->intensity = NULL;
+    li->binned = 0;
 
-    printf("SPAD_load3DICSfile...");
+    setup_file_paths(path, filename, parser.get<std::string>("s").c_str(), datafilepath, li->savefilepath, li->intensitysavefilepath);
+
+    // Mapped unless reading it all first is asked for, or the corrected image will be saved over the file
+    bool map = !parser.get<bool>("nmap") && strcmp(datafilepath, li->savefilepath) != 0;
+
+    printf(map ? "SPAD_map3DICSfile..." : "SPAD_load3DICSfile...");
     clock_t tStart = clock();
-    if (SPAD_load3DICSfile(datafilepath, &image, &w, &h, &t) < 0) {
+    int ret = map ? SPAD_map3DICSfile(datafilepath, &li->image, &li->w, &li->h, &li->t) : SPAD_load3DICSfile(datafilepath, &li->image, &li->w, &li->h, &li->t);
+    if (ret < 0) {
         printf("\nERROR: Failed to load %s\n", datafilepath);
         return(-1);
     }
     printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
 
     if (first_time) {
-        if (once_only(path, filename, parser, w, h, t) < 0) {
-            free(image);
+        if (once_only(path, filename, parser, li->w, li->h, li->t) < 0) {
+            free_loaded_image(li);
             return(-2);
         }
         first_time = 0;
@@ -181,26 +295,87 @@ int process(const char* path, const char* filename, cli::Parser& parser)
     tStart = clock();
     ICS* ip;
     IcsOpen(&ip, datafilepath, "r");  // should work since we just opened above
-    IcsGetPosition(ip, 0, NULL, &ns_per_bin, NULL);
-    IcsGetPosition(ip, 1, NULL, &xy_microns_per_pixel, NULL);
+    IcsGetPosition(ip, 0, NULL, &li->ns_per_bin, NULL);
+    IcsGetPosition(ip, 1, NULL, &li->xy_microns_per_pixel, NULL);
     IcsClose(ip);
     printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
 
-    printf("SPAD_CorrectTransients...");
-    tStart = clock();
-    if (SPAD_CorrectTransients(image, w, h, t) < 0) {
-    //if (SPAD_CorrectTransients_SingleThread(image, w, h, t) < 0) {
-            free(image);
-        return(-3);
+    // Deterministic correction to a separate float image, unless the fused correction makes a binned one
+    if (parser.get<bool>("f") && !fused) {
+        li->float_image = (float*)malloc((size_t)li->w * li->h * li->t * sizeof(float));
+        if (li->float_image == NULL) {
+            printf("\nERROR: Could not allocate float image\n");
+            free_loaded_image(li);
+            return(-3);
+        }
     }
+
+    return(0);
+}
+
+// Save the binning pyramid of a corrected image, scale is the pixel size change from any binning already done
+int save_pyramid(cli::Parser& parser, loaded_image* li, int w, int h, int t, double scale, double ns_per_bin)
+{
+    int nLevels = min(parser.get<int>("pyr"), 16);
+    void* levels[16] = { NULL };
+    int widths[16], heights[16];
+    size_t value_bytes = li->float_image ? sizeof(float) : sizeof(USHORT);
+    int ret = 0;
+
+    for (int l = 0; l < nLevels; l++) {
+        levels[l] = malloc((size_t)(w >> (l + 1)) * (h >> (l + 1)) * t * value_bytes);
+        if (!levels[l]) ret = -1;
+    }
+
+    printf("SPAD_bin_pyramid...");
+    clock_t tStart = clock();
+    if (ret < 0)
+        printf("\nERROR: Could not allocate binning pyramid\n");
+    else if (li->float_image)
+        ret = SPAD_bin_pyramid_float(li->float_image, w, h, t, nLevels, (float**)levels, widths, heights);
+    else
+        ret = SPAD_bin_pyramid(li->image, w, h, t, nLevels, (USHORT**)levels, widths, heights);
     printf(" time taken: %.3fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
 
+    for (int l = 0; ret == 0 && l < nLevels; l++) {
+        char levelfilepath[MAX_PATH];
+        int b = max(parser.get<int>("b"), 1) << (l + 1);   // binning from the original image
+        strcpy_s(levelfilepath, MAX_PATH, li->savefilepath);
+        char* last_dot = strrchr(levelfilepath, '.');
+        if (last_dot) *last_dot = '\0';
+        sprintf_s(levelfilepath + strlen(levelfilepath), MAX_PATH - strlen(levelfilepath), "_bin%d.ics", b);
+
+        printf("SPAD_save3DICSfile: %s ...", levelfilepath);
+        tStart = clock();
+        double microns = scale * (1 << (l + 1)) * li->xy_microns_per_pixel;
+        if (li->float_image)
+            SPAD_save3DICSfile_float(levelfilepath, (float*)levels[l], widths[l], heights[l], t, parser.get<int>("c"), NULL, 0, microns, ns_per_bin);
+        else
+            SPAD_save3DICSfile(levelfilepath, (USHORT*)levels[l], widths[l], heights[l], t, parser.get<int>("c"), NULL, 0, microns, ns_per_bin);
+        printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+    }
+
+    for (int l = 0; l < nLevels; l++)
+        free(levels[l]);
+
+    return(ret);
+}
+
+// Bin and save a corrected image, then free it
+int finish_image(cli::Parser& parser, loaded_image* li)
+{
+    int w = li->w, h = li->h, t = SPAD_get_output_timebins(li->t), final_w, final_h;   // the correction has applied the time window
+    double scale, ns_per_bin = li->ns_per_bin;
+    clock_t tStart;
 
     int b = parser.get<int>("b");
-    if (b > 1) {
+    if (b > 1 && !li->binned) {
         printf("SPAD_bin...");
         tStart = clock();
-        SPAD_bin(image, w, h, t, b, &final_w, &final_h);
+        if (li->float_image)
+            SPAD_bin_float(li->float_image, w, h, t, b, &final_w, &final_h);
+        else
+            SPAD_bin(li->image, w, h, t, b, &final_w, &final_h);
         printf(" time taken: %.3fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
         scale = (double)w / (double)final_w;
     }
@@ -210,18 +385,644 @@ int process(const char* path, const char* filename, cli::Parser& parser)
         scale = 1.0;
     }
 
-    printf("SPAD_save3DICSfile: %s ...", savefilepath);
+    printf("SPAD_save3DICSfile: %s ...", li->savefilepath);
     tStart = clock();
 
     double new_ns_per_bin = SPAD_get_calibrated_timebase();
     if (new_ns_per_bin > 0) {   // a value was calculated
         ns_per_bin = new_ns_per_bin;
     }
+    ns_per_bin *= parser.get<int>("tb");
     
-    SPAD_save3DICSfile(savefilepath, image, final_w, final_h, t, 1, NULL, 0, scale*xy_microns_per_pixel, ns_per_bin);
+    if (li->float_image)
+        SPAD_save3DICSfile_float(li->savefilepath, li->float_image, final_w, final_h, t, parser.get<int>("c"), NULL, 0, scale*li->xy_microns_per_pixel, ns_per_bin);
+    else
+        SPAD_save3DICSfile(li->savefilepath, li->image, final_w, final_h, t, parser.get<int>("c"), NULL, 0, scale*li->xy_microns_per_pixel, ns_per_bin);
     printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
 
-    free(image);
+    if (li->intensity) {
+        printf("SPAD_save2DICSfile: %s ...", li->intensitysavefilepath);
+        tStart = clock();
+        SPAD_save2DICSfile(li->intensitysavefilepath, li->intensity, final_w, final_h, 32, parser.get<int>("c"), NULL, 0, scale*li->xy_microns_per_pixel);
+        printf(" time taken: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+    }
+
+    if (parser.get<int>("pyr") > 0)
+        save_pyramid(parser, li, final_w, final_h, t, scale, ns_per_bin);
+
+    free_loaded_image(li);
+
+    return(0);
+}
+
+// Correct, bin and make the intensity image in one pass, the corrected image replaces the loaded one
+int correct_fused(cli::Parser& parser, loaded_image* li)
+{
+    int b = max(parser.get<int>("b"), 1);
+    int w = li->w, h = li->h, t = li->t, final_w, final_h;
+    size_t nOut = SPAD_get_output_timebins(t);
+    size_t nBinned = (size_t)(w / b) * (h / b);
+    USHORT* binned = NULL;
+    float* float_binned = NULL;
+    UINT* intensity = (UINT*)malloc(nBinned * sizeof(UINT));
+    float* float_intensity = NULL;
+    int ret;
+
+    if (parser.get<bool>("f")) {
+        float_binned = (float*)malloc(nBinned * nOut * sizeof(float));
+        float_intensity = (float*)malloc(nBinned * sizeof(float));
+    }
+    else {
+        binned = (USHORT*)malloc(nBinned * nOut * sizeof(USHORT));
+    }
+
+    if (!intensity || (!binned && !float_binned) || (float_binned && !float_intensity)) {
+        printf("\nERROR: Could not allocate binned image\n");
+        ret = -3;
+    }
+    else if (float_binned) {
+        ret = SPAD_CorrectBinIntensity_Float(li->image, w, h, t, b, float_binned, float_intensity, &final_w, &final_h);
+        for (int i = 0; i < final_w * final_h; i++)
+            intensity[i] = (UINT)(float_intensity[i] + 0.5f);
+    }
+    else {
+        ret = SPAD_CorrectBinIntensity(li->image, w, h, t, b, binned, intensity, &final_w, &final_h);
+    }
+
+    free(float_intensity);
+    SPAD_free3DICSimage(li->image);
+    li->image = binned;
+    li->float_image = float_binned;
+
+    if (parser.get<bool>("int"))
+        li->intensity = intensity;
+    else
+        free(intensity);
+
+    if (ret < 0)
+        return(ret);
+
+    li->binned = 1;
+    li->xy_microns_per_pixel *= (double)w / (double)final_w;
+    li->w = final_w;
+    li->h = final_h;
+
+    return(0);
+}
+
+// Correct a loaded image, freeing it on error
+int correct_image(cli::Parser& parser, bool fused, loaded_image* li)
+{
+    int ret;
+
+    SPAD_set_image_index(li->index);
+
+    clock_t tStart = clock();
+    if (fused) {
+        printf("SPAD_CorrectBinIntensity...");
+        ret = correct_fused(parser, li);
+    }
+    else {
+        printf("SPAD_CorrectTransients...");
+        if (li->float_image)
+            ret = SPAD_CorrectTransients_Float(li->image, li->float_image, li->w, li->h, li->t);
+        else
+            ret = SPAD_CorrectTransients(li->image, li->w, li->h, li->t);
+        //ret = SPAD_CorrectTransients_SingleThread(li->image, li->w, li->h, li->t);
+    }
+    if (ret < 0) {
+        free_loaded_image(li);
+        return(-3);
+    }
+    printf(" time taken: %.3fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+
+    return(0);
+}
+
+int process(const char* path, const char* filename, size_t index, cli::Parser& parser)
+{
+    loaded_image li;
+
+    bool fused = use_fused_correction(parser);
+    int ret = load_image(path, filename, parser, fused, &li);
+    if (ret < 0)
+        return(ret);
+    li.index = index;
+
+    ret = correct_image(parser, fused, &li);
+    if (ret < 0)
+        return(ret);
+
+    return(finish_image(parser, &li));
+}
+
+/*
+Read, correct and save an image a slab of rows at a time with IcsGetDataBlock, for images too big to hold in memory.
+The slabs are as many rows as fit in the memory budget with their output and the correction plan for them, so the memory
+used does not depend on the height of the image. Each slab is written straight to a raw data file, and the ics header
+referring to it is written at the end.
+*/
+
+#define STREAMED_PLAN_GUESS_BYTES_PER_BIN 32   // correction plan and band size used until the first slab has built one
+
+// Rows to correct at a time, a multiple of bin_size
+int streamed_slab_rows(cli::Parser& parser, int w, int h, int t, size_t plan_detector_bytes)
+{
+    int b = max(parser.get<int>("b"), 1);
+    size_t value_bytes = parser.get<bool>("f") ? sizeof(float) : sizeof(USHORT);
+    size_t nOut = SPAD_get_output_timebins(t);
+
+    size_t row_bytes = (size_t)w * t * sizeof(USHORT);                           // the slab
+    row_bytes += (size_t)(w / b) * nOut * value_bytes / b;                        // binned, float or time window output
+    if (use_fused_correction(parser)) row_bytes += (size_t)(w / b) * 2 * sizeof(UINT) / b;   // intensity
+    row_bytes += (size_t)w * plan_detector_bytes;
+
+    size_t rows = (size_t)parser.get<int>("mem") * 1024 * 1024 / row_bytes;
+    rows = rows / b * b;
+    if (rows < (size_t)b) rows = b;
+    if (rows > (size_t)h) rows = h;
+
+    return((int)rows);
+}
+
+int process_streamed(const char* path, const char* filename, size_t index, cli::Parser& parser)
+{
+    char datafilepath[MAX_PATH], savefilepath[MAX_PATH], intensitysavefilepath[MAX_PATH];
+    char rawfilepath[MAX_PATH], intensityrawfilepath[MAX_PATH];
+    static int first_time = 1;
+    ICS* ip;
+    Ics_DataType dt;
+    int ndims;
+    size_t dims[ICS_MAXDIM];
+    double ns_per_bin, xy_microns_per_pixel;
+
+    setup_file_paths(path, filename, parser.get<std::string>("s").c_str(), datafilepath, savefilepath, intensitysavefilepath);
+
+    // The slabs are saved as they are corrected, while the image is still being read
+    if (strcmp(datafilepath, savefilepath) == 0) {
+        printf("ERROR: Cannot save over %s a slab at a time, give a suffix\n", datafilepath);
+        return(-1);
+    }
+
+    if (IcsOpen(&ip, datafilepath, "r") != IcsErr_Ok) {
+        printf("ERROR: Failed to open %s\n", datafilepath);
+        return(-1);
+    }
+    resolve_ics_source(ip, datafilepath);
+    IcsGetLayout(ip, &dt, &ndims, dims);
+    if (dt != Ics_uint16 || ndims != 3) {
+        printf("ERROR: %s is not a 3D uint16 image\n", datafilepath);
+        IcsClose(ip);
+        return(-1);
+    }
+    int t = (int)dims[0], w = (int)dims[1], h = (int)dims[2];
+    IcsGetPosition(ip, 0, NULL, &ns_per_bin, NULL);
+    IcsGetPosition(ip, 1, NULL, &xy_microns_per_pixel, NULL);
+
+    if (first_time) {
+        if (once_only(path, filename, parser, w, h, t) < 0) {
+            IcsClose(ip);
+            return(-2);
+        }
+        first_time = 0;
+    }
+
+    // The data files are named as the headers with .ids, next to them, and the headers refer to them by name alone
+    bool intensity = parser.get<bool>("int");
+    strcpy_s(rawfilepath, MAX_PATH, savefilepath);
+    strcpy_s(intensityrawfilepath, MAX_PATH, intensitysavefilepath);
+    strcpy_s(strrchr(rawfilepath, '.'), 5, ".ids");
+    strcpy_s(strrchr(intensityrawfilepath, '.'), 5, ".ids");
+
+    FILE* fp = NULL;
+    FILE* ifp = NULL;
+    fopen_s(&fp, rawfilepath, "wb");
+    if (intensity) fopen_s(&ifp, intensityrawfilepath, "wb");
+    if (!fp || (intensity && !ifp)) {
+        printf("ERROR: Cannot open %s for writing\n", fp ? intensityrawfilepath : rawfilepath);
+        if (fp) fclose(fp);
+        IcsClose(ip);
+        return(-1);
+    }
+
+    bool fused = use_fused_correction(parser);
+    bool deterministic = parser.get<bool>("f");
+    int b = max(parser.get<int>("b"), 1);
+    int nOut = SPAD_get_output_timebins(t);
+    size_t value_bytes = deterministic ? sizeof(float) : sizeof(USHORT);
+    size_t row_bytes = (size_t)w * t * sizeof(USHORT);
+    int rows = streamed_slab_rows(parser, w, h, t, (size_t)t * STREAMED_PLAN_GUESS_BYTES_PER_BIN);
+    int allocated_rows = 0, final_w = w / b, final_h = 0;
+    USHORT* slab = NULL;
+    void* output = NULL;         // binned or float output, NULL when correcting the slab in place
+    UINT* slab_intensity = NULL;
+    float* float_intensity = NULL;
+    int ret = 0;
+
+    printf("Streaming %d x %d x %d in slabs of up to %d rows\n", w, h, t, rows);
+    clock_t tStart = clock();
+
+    SPAD_set_image_index(index);   // all the slabs draw from the streams of this image
+
+    for (int y = 0, nRows; y < h && ret >= 0; y += nRows) {
+        int new_w, new_h;
+        nRows = min(rows, h - y);
+
+        if (nRows > allocated_rows) {
+            size_t nBinned = (size_t)(w / b) * (nRows / b);
+            free(slab);
+            free(output);
+            free(slab_intensity);
+            free(float_intensity);
+            slab = (USHORT*)malloc(nRows * row_bytes);
+            output = (fused || deterministic) ? malloc(nBinned * nOut * value_bytes) : NULL;
+            slab_intensity = fused ? (UINT*)malloc(nBinned * sizeof(UINT)) : NULL;
+            float_intensity = (fused && deterministic) ? (float*)malloc(nBinned * sizeof(float)) : NULL;
+            if (!slab || ((fused || deterministic) && !output) || (fused && !slab_intensity) || (fused && deterministic && !float_intensity)) {
+                printf("ERROR: Could not allocate slab of %d rows\n", nRows);
+                ret = -3;
+                break;
+            }
+            allocated_rows = nRows;
+        }
+
+        if (IcsGetDataBlock(ip, slab, nRows * row_bytes) != IcsErr_Ok) {
+            printf("ERROR: Failed to read rows %d to %d of %s\n", y, y + nRows - 1, datafilepath);
+            ret = -1;
+            break;
+        }
+
+        if (fused && deterministic) {
+            ret = SPAD_CorrectBinIntensityRows_Float(slab, w, h, t, y, nRows, b, (float*)output, float_intensity, &new_w, &new_h);
+            for (int i = 0; i < new_w * new_h; i++)
+                slab_intensity[i] = (UINT)(float_intensity[i] + 0.5f);
+        }
+        else if (fused) {
+            ret = SPAD_CorrectBinIntensityRows(slab, w, h, t, y, nRows, b, (USHORT*)output, slab_intensity, &new_w, &new_h);
+        }
+        else {
+            new_w = w;
+            new_h = nRows;
+            if (deterministic)
+                ret = SPAD_CorrectTransientsRows_Float(slab, (float*)output, w, h, t, y, nRows);
+            else
+                ret = SPAD_CorrectTransientsRows(slab, w, h, t, y, nRows);   // with a time window the output is packed at the start of the slab
+        }
+        if (ret < 0) break;
+
+        size_t nValues = (size_t)new_w * new_h * nOut;
+        if (fwrite(output ? output : slab, value_bytes, nValues, fp) != nValues ||
+            (intensity && fwrite(slab_intensity, sizeof(UINT), (size_t)new_w * new_h, ifp) != (size_t)new_w * new_h)) {
+            printf("ERROR: Failed to write rows %d to %d\n", y, y + nRows - 1);
+            ret = -4;
+            break;
+        }
+        final_h += new_h;
+        if (SPAD_release_calibration_rows(w, h, t, y, nRows) == 0 && y == 0)
+            printf("Warning: The calibration is held in memory for the whole image, memory use grows with its height. "
+                "Use -cal with a double precision calibration file (SPAD-calibrate -p 0, or -wcal) to keep it within -mem.\n");
+
+        // The first slab has built a plan, size the rest with it
+        if (y == 0) {
+            rows = streamed_slab_rows(parser, w, h, t, SPAD_get_correction_plan_detector_bytes());
+            printf("Slabs of up to %d rows\n", rows);
+        }
+    }
+
+    IcsClose(ip);
+    fclose(fp);
+    if (ifp) fclose(ifp);
+    free(slab);
+    free(output);
+    free(slab_intensity);
+    free(float_intensity);
+
+    if (ret < 0)
+        return(ret);
+    printf("Corrected: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+
+    double new_ns_per_bin = SPAD_get_calibrated_timebase();
+    if (new_ns_per_bin > 0) {   // a value was calculated
+        ns_per_bin = new_ns_per_bin;
+    }
+    ns_per_bin *= parser.get<int>("tb");
+    xy_microns_per_pixel *= b;
+
+    printf("SPAD_save3DICSheader: %s\n", savefilepath);
+    if (deterministic)
+        ret = SPAD_save3DICSheader_float(savefilepath, (char*)ics_source_name(rawfilepath), final_w, final_h, nOut, xy_microns_per_pixel, ns_per_bin);
+    else
+        ret = SPAD_save3DICSheader(savefilepath, (char*)ics_source_name(rawfilepath), final_w, final_h, nOut, xy_microns_per_pixel, ns_per_bin);
+
+    if (ret >= 0 && intensity) {
+        printf("SPAD_save2DICSheader: %s\n", intensitysavefilepath);
+        ret = SPAD_save2DICSheader(intensitysavefilepath, (char*)ics_source_name(intensityrawfilepath), final_w, final_h, 32, xy_microns_per_pixel);
+    }
+
+    return(ret);
+}
+
+// Load several files, correct them together so the calibration is only read once for all of them, then save them
+int process_batch(const char* path, std::vector<std::string>& filenames, size_t first_index, cli::Parser& parser)
+{
+    std::vector<loaded_image> batch;
+    std::vector<USHORT*> images;
+    std::vector<float*> float_images;
+
+    for (size_t i = 0; i < filenames.size(); i++) {
+        loaded_image li;
+        printf("%s\n", filenames[i].c_str());
+        if (load_image(path, filenames[i].c_str(), parser, false, &li) < 0)
+            continue;   // error occurred
+        li.index = first_index + i;
+
+        // Only images the same size as the first can be corrected with it
+        if (!batch.empty() && (li.w != batch[0].w || li.h != batch[0].h || li.t != batch[0].t)) {
+            printf("Image size differs from the rest of the batch, correcting it alone\n");
+            int ret;
+            SPAD_set_image_index(li.index);
+            if (li.float_image)
+                ret = SPAD_CorrectTransients_Float(li.image, li.float_image, li.w, li.h, li.t);
+            else
+                ret = SPAD_CorrectTransients(li.image, li.w, li.h, li.t);
+            if (ret < 0)
+                free_loaded_image(&li);
+            else
+                finish_image(parser, &li);
+            continue;
+        }
+
+        batch.push_back(li);
+        images.push_back(li.image);
+        float_images.push_back(li.float_image);
+    }
+
+    if (batch.empty())
+        return(-1);
+
+    int nImages = (int)batch.size();
+    int w = batch[0].w, h = batch[0].h, t = batch[0].t;
+
+    printf("SPAD_CorrectTransientsBatch %d images...", nImages);
+    clock_t tStart = clock();
+    int ret = 0;
+    // Image n of a batch has the index of the first + n, so a file that did not load or was corrected alone splits it
+    for (int first = 0, n; ret >= 0 && first < nImages; first += n) {
+        for (n = 1; first + n < nImages && batch[first + n].index == batch[first].index + n; n++);
+        SPAD_set_image_index(batch[first].index);
+        if (batch[0].float_image)
+            ret = SPAD_CorrectTransientsBatch_Float(&images[first], &float_images[first], n, w, h, t);
+        else
+            ret = SPAD_CorrectTransientsBatch(&images[first], n, w, h, t);
+    }
+    if (ret < 0) {
+        for (int i = 0; i < nImages; i++)
+            free_loaded_image(&batch[i]);
+        return(-3);
+    }
+    printf(" time taken: %.3fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+
+    for (int i = 0; i < nImages; i++)
+        finish_image(parser, &batch[i]);
+
+    return(0);
+}
+
+/*
+Pipelined processing of many files, one thread for each stage:
+
+    load (read or map and decompress) -> correct -> finish (bin, compress and save)
+
+The stages are joined by short queues, so the next file is loaded and the previous one saved while the current one is
+corrected, and the correction, which uses all the threads, does not wait on the disk. The queues hold few images, and the
+images in the pipeline, from the start of their load to the end of their save, are also kept within a memory limit. An
+image over the limit on its own still goes through, alone. The pool runs one job at a time, so stages that use it, e.g.
+parallel gzip, take turns with the correction rather than competing for the cores.
+
+At the end the time each stage spent working, waiting for an image and waiting for room in the next queue is reported.
+*/
+
+#define PIPELINE_QUEUE_LENGTH 2   // images waiting between two stages
+
+typedef struct
+{
+    loaded_image li;
+    size_t bytes;       // held against the memory limit until saved
+
+} pipeline_item;
+
+class pipeline_queue
+{
+public:
+    pipeline_queue() : closed(false) {}
+
+    // Wait for room, returns the time waited
+    double push(pipeline_item* item)
+    {
+        auto tStart = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return items.size() < PIPELINE_QUEUE_LENGTH; });
+        items.push_back(item);
+        cv.notify_all();
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    }
+
+    // Wait for an image, NULL when the queue is closed and empty
+    pipeline_item* pop(double* waited)
+    {
+        auto tStart = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return !items.empty() || closed; });
+        pipeline_item* item = NULL;
+        if (!items.empty()) {
+            item = items.front();
+            items.pop_front();
+        }
+        cv.notify_all();
+        *waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+        return item;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        cv.notify_all();
+    }
+
+private:
+    std::deque<pipeline_item*> items;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// Bytes of the images in the pipeline, kept within the limit
+class pipeline_memory
+{
+public:
+    pipeline_memory(size_t limit) : limit(limit), used(0) {}
+
+    double acquire(size_t bytes)
+    {
+        auto tStart = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return limit == 0 || used == 0 || used + bytes <= limit; });
+        used += bytes;
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    }
+
+    void release(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= bytes;
+        cv.notify_all();
+    }
+
+private:
+    size_t limit, used;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+typedef struct
+{
+    const char* name;
+    double busy;        // seconds working
+    double starved;     // seconds waiting for an image from the stage before
+    double blocked;     // seconds waiting for room in the queue after, or for memory
+    int images;
+
+} pipeline_stage;
+
+// Memory an image needs from loading to saving, from the size in its header, the output as correct_image will make it
+size_t pipeline_image_bytes(const char* datafilepath, cli::Parser& parser, bool fused)
+{
+    ICS* ip;
+    Ics_DataType dt;
+    int ndims;
+    size_t dims[ICS_MAXDIM];
+
+    if (IcsOpen(&ip, datafilepath, "r") != IcsErr_Ok)
+        return(0);
+    IcsGetLayout(ip, &dt, &ndims, dims);
+    IcsClose(ip);
+    if (ndims != 3)
+        return(0);
+
+    int b = max(parser.get<int>("b"), 1);
+    size_t t = dims[0], w = dims[1], h = dims[2];
+    size_t nOut = SPAD_get_output_timebins((int)t);
+    size_t value_bytes = parser.get<bool>("f") ? sizeof(float) : sizeof(USHORT);
+    size_t bytes = w * h * t * sizeof(USHORT);
+
+    if (fused)
+        bytes += (w / b) * (h / b) * (nOut * value_bytes + sizeof(UINT));
+    else if (parser.get<bool>("f"))
+        bytes += w * h * t * sizeof(float);
+
+    return(bytes);
+}
+
+// Touch a page in every 4 KB so a mapped image is read from disk here rather than during the correction
+void prefetch_image(loaded_image* li)
+{
+    volatile BYTE sum = 0;
+    BYTE* p = (BYTE*)li->image;
+    size_t nBytes = (size_t)li->w * li->h * li->t * sizeof(USHORT);
+
+    for (size_t i = 0; i < nBytes; i += 4096)
+        sum += p[i];
+}
+
+void pipeline_load(const char* path, std::vector<std::string>* list, cli::Parser* parser, bool fused, pipeline_memory* memory,
+    pipeline_queue* out, pipeline_stage* stage)
+{
+    for (size_t i = 0; i < list->size(); i++) {
+        const char* filename = (*list)[i].c_str();
+        char datafilepath[MAX_PATH], savefilepath[MAX_PATH], intensitysavefilepath[MAX_PATH];
+
+        setup_file_paths(path, filename, parser->get<std::string>("s").c_str(), datafilepath, savefilepath, intensitysavefilepath);
+        size_t bytes = pipeline_image_bytes(datafilepath, *parser, fused);
+        stage->blocked += memory->acquire(bytes);
+
+        auto tStart = std::chrono::steady_clock::now();
+        printf("%zd/%zd: %s\n", i + 1, list->size(), filename);
+        pipeline_item* item = new pipeline_item;
+        item->bytes = bytes;
+        if (load_image(path, filename, *parser, fused, &item->li) < 0) {
+            memory->release(bytes);
+            delete item;
+            continue;   // error occurred
+        }
+        item->li.index = i;
+        prefetch_image(&item->li);
+        stage->busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+        stage->images++;
+
+        stage->blocked += out->push(item);
+    }
+
+    out->close();
+}
+
+void pipeline_finish(cli::Parser* parser, pipeline_memory* memory, pipeline_queue* in, pipeline_stage* stage)
+{
+    pipeline_item* item;
+
+    while ((item = in->pop(&stage->starved)) != NULL) {
+        auto tStart = std::chrono::steady_clock::now();
+        finish_image(*parser, &item->li);
+        stage->busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+        stage->images++;
+
+        memory->release(item->bytes);
+        delete item;
+    }
+}
+
+// Load, correct and save the files in a pipeline, the correction on this thread
+int process_pipelined(const char* path, std::vector<std::string>& list, cli::Parser& parser)
+{
+    bool fused = use_fused_correction(parser);
+    pipeline_memory memory((size_t)max(parser.get<int>("pmem"), 0) * 1024 * 1024);
+    pipeline_queue loaded, corrected;
+    pipeline_stage load = { "load", 0.0, 0.0, 0.0, 0 }, correct = { "correct", 0.0, 0.0, 0.0, 0 }, finish = { "save", 0.0, 0.0, 0.0, 0 };
+
+    auto tStart = std::chrono::steady_clock::now();
+
+    std::thread load_thread(pipeline_load, path, &list, &parser, fused, &memory, &loaded, &load);
+    std::thread finish_thread(pipeline_finish, &parser, &memory, &corrected, &finish);
+
+    pipeline_item* item;
+    while ((item = loaded.pop(&correct.starved)) != NULL) {
+        auto tCorrect = std::chrono::steady_clock::now();
+        int ret = correct_image(parser, fused, &item->li);
+        correct.busy += std::chrono::duration<double>(std::chrono::steady_clock::now() - tCorrect).count();
+        if (ret < 0) {
+            memory.release(item->bytes);
+            delete item;
+            continue;   // error occurred
+        }
+        correct.images++;
+
+        correct.blocked += corrected.push(item);
+    }
+    corrected.close();
+
+    load_thread.join();
+    finish_thread.join();
+
+    double total = std::chrono::duration<double>(std::chrono::steady_clock::now() - tStart).count();
+    double busy = load.busy + correct.busy + finish.busy;
+
+    printf("\nPipeline: %d images in %.2fs, the stages were busy for %.2fs between them (%.2fx overlap)\n", finish.images, total, busy,
+        total > 0.0 ? busy / total : 0.0);
+    printf("  stage     images   busy s   waiting for image s   waiting for room s   utilisation\n");
+    pipeline_stage* stages[3] = { &load, &correct, &finish };
+    for (int s = 0; s < 3; s++)
+        printf("  %-8s  %6d   %6.2f   %19.2f   %18.2f   %10.0f%%\n", stages[s]->name, stages[s]->images, stages[s]->busy,
+            stages[s]->starved, stages[s]->blocked, total > 0.0 ? 100.0 * stages[s]->busy / total : 0.0);
 
     return(0);
 }
@@ -234,6 +1035,26 @@ int main(int argc, char** argv)
     configure_parser(parser);
     parser.run_and_exit_if_error();
 
+    // Threads are created once here and reused for all the files
+    int nThreads = SPAD_set_number_of_threads(parser.get<int>("nt"));
+    printf("Using %d threads\n", nThreads);
+
+    if (SPAD_set_gzip_block_size(parser.get<int>("zb")) < 0)
+        return(-1);
+
+    if (SPAD_set_correction_method(parser.get<int>("m")) < 0)
+        return(-1);
+
+    if (SPAD_set_correction_precision(parser.get<int>("p")) < 0)
+        return(-1);
+
+    if (SPAD_set_output_time_window(parser.get<int>("ts"), parser.get<int>("te"), parser.get<int>("tb")) < 0)
+        return(-1);
+
+    unsigned long long seed = parser.get<unsigned long long>("sd");
+    if (seed != 0)
+        SPAD_set_random_seed(seed);
+
     // Get search spec for files
     std::string searchpath = parser.get<std::string>("i");
 
@@ -257,12 +1078,45 @@ int main(int argc, char** argv)
         return(-1);
     }
 
-    for (size_t i = 0; i < count; i++)
-    {
-        const char *filename = list[i].c_str();
-        printf("%zd/%zd: %s\n", i+1, count, filename);
-        if (process(path, filename, parser) < 0)
-            continue;   // error occurred
+    int batch_size = parser.get<int>("bn");
+    bool streamed = parser.get<int>("mem") > 0;
+    bool pipelined = parser.get<bool>("pl") && !streamed;
+
+    if (streamed && (batch_size > 1 || parser.get<int>("pyr") > 0 || parser.get<bool>("pl")))
+        printf("Warning: -bn, -pyr and -pl are not used with -mem\n");
+    if (pipelined && batch_size > 1)
+        printf("Warning: -bn is not used with -pl\n");
+
+    if (streamed) {
+        for (size_t i = 0; i < count; i++)
+        {
+            const char* filename = list[i].c_str();
+            printf("%zd/%zd: %s\n", i + 1, count, filename);
+            if (process_streamed(path, filename, i, parser) < 0)
+                continue;   // error occurred
+        }
+    }
+    else if (pipelined) {
+        process_pipelined(path, list, parser);
+    }
+    else if (batch_size > 1) {
+        for (size_t i = 0; i < count; i += batch_size)
+        {
+            size_t n = min((size_t)batch_size, count - i);
+            std::vector<std::string> filenames(list.begin() + i, list.begin() + i + n);
+            printf("%zd-%zd/%zd:\n", i+1, i+n, count);
+            if (process_batch(path, filenames, i, parser) < 0)
+                continue;   // error occurred
+        }
+    }
+    else {
+        for (size_t i = 0; i < count; i++)
+        {
+            const char *filename = list[i].c_str();
+            printf("%zd/%zd: %s\n", i+1, count, filename);
+            if (process(path, filename, i, parser) < 0)
+                continue;   // error occurred
+        }
     }
 
     return(0);
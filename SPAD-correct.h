@@ -7,6 +7,27 @@
 
 #pragma once
 
+// Correction methods for SPAD_set_correction_method
+#define SPAD_CORRECTION_BINOMIAL     0
+#define SPAD_CORRECTION_MULTINOMIAL  1
+#define SPAD_CORRECTION_ERROR_DIFFUSION  2
+
+// Storage precision for SPAD_write_bin_width_factors_to_file_precision and SPAD_set_correction_precision
+#define SPAD_PRECISION_DOUBLE    0
+#define SPAD_PRECISION_FLOAT32   1
+#define SPAD_PRECISION_FIXED16   2
+
+// Instruction sets for SPAD_set_simd_level
+#define SPAD_SIMD_AUTO    -1
+#define SPAD_SIMD_SCALAR   0
+#define SPAD_SIMD_AVX2     1
+#define SPAD_SIMD_AVX512   2
+
+// What happens to binned values above 65535 for SPAD_bin_by_2_overflow
+#define SPAD_BIN_WRAP       0
+#define SPAD_BIN_SATURATE   1
+#define SPAD_BIN_WIDEN      2
+
 extern "C" {
 
 	/** 
@@ -25,6 +46,9 @@ extern "C" {
 
 	Load a 3D ICS image file into a 3D image buffer. Expects this to be a SPAD image with strides the correct way around
 	(i.e. time bins are contiguous, next larger stride is width, then height), and unsigned short data (uint16).
+	gzip data saved with SPAD_set_gzip_block_size, or made of several gzip members, is decompressed on all the threads,
+	see SPAD_set_number_of_threads. A file of several members without a .spadgzi index is decompressed on one thread the
+	first time, and the index of its members is saved next to it for the next time.
 
 	\param filepath The path of the file to load.
 	\param image A returned pointer to where the image data has been stored. Free it with free when finished.
@@ -34,6 +58,32 @@ extern "C" {
 	*/
 	__declspec(dllexport) int SPAD_load3DICSfile(char filepath[], USHORT** image, int* width, int* height, int* timebins);
 
+	/**
+	SPAD_map3DICSfile
+
+	Version of SPAD_load3DICSfile that memory maps uncompressed ICS version 2 files rather than reading them, so the image
+	is only read from disk as it is used. The mapping is copy-on-write, the image can be changed, e.g. corrected in place,
+	without changing the file. Other files, e.g. gzip compressed, are loaded as SPAD_load3DICSfile. Do not overwrite the
+	file while the image is in use.
+
+	\param filepath The path of the file to load.
+	\param image A returned pointer to the image. Free it with SPAD_free3DICSimage when finished.
+	\param width Returns the width of the image.
+	\param height Returns the height of the image.
+	\param timebins Returns the number of time bins in each transient of the image.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_map3DICSfile(char filepath[], USHORT** image, int* width, int* height, int* timebins);
+
+	/**
+	SPAD_free3DICSimage
+
+	Free an image from SPAD_map3DICSfile, unmapping the file if it was mapped. Also frees images from SPAD_load3DICSfile.
+
+	\param image The image to free, may be NULL.
+	*/
+	__declspec(dllexport) void SPAD_free3DICSimage(USHORT* image);
+
 	/**
 	SPAD_load3DICSfile_LV
 
@@ -70,6 +120,14 @@ extern "C" {
 	__declspec(dllexport) int SPAD_save3DICSfile(char filepath[], USHORT *histogram, int width, int height, int timebins, int compression_level, BYTE *header, 
 		unsigned long long max_header_bytes, double xy_microns_per_pixel, double ns_per_bin);
 
+	/**
+	SPAD_save3DICSfile_float
+
+	As SPAD_save3DICSfile for float (real32) histograms, e.g. from SPAD_CorrectTransients_Float.
+	*/
+	__declspec(dllexport) int SPAD_save3DICSfile_float(char filepath[], float* histogram, int width, int height, int timebins, int compression_level,
+		BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel, double ns_per_bin);
+
 	/**
 	SPAD_save2DICSfile
 
@@ -88,6 +146,53 @@ extern "C" {
 	__declspec(dllexport) int SPAD_save2DICSfile(char filepath[], void *buffer, int width, int height, int bit_depth, int compression_level,
 		BYTE *header, unsigned long long max_header_bytes, double xy_microns_per_pixel);
 
+	/**
+	SPAD_save3DICSheader
+
+	Saves just the ICS header for a 3D histogram that is already in another file, e.g. written there a slab of rows at a
+	time. The data file is raw, uncompressed, in the byte order of this machine and laid out as for SPAD_save3DICSfile, and
+	the header refers to it by name, so the two files must be kept together.
+
+	\param filepath The path to save the header to.
+	\param datafilepath The path of the data file, as it should be written in the header. A name without a folder is
+	looked for next to the header when loaded, so the two can be moved together.
+	\param width The image width.
+	\param height The image height.
+	\param timebins The number of time resolved time bins.
+	\param xy_microns_per_pixel Defines the real scale of the image in the x-y dimensions
+	\param ns_per_bin Defines the timebase of the time resolved data dimension
+	*/
+	__declspec(dllexport) int SPAD_save3DICSheader(char filepath[], char datafilepath[], int width, int height, int timebins, double xy_microns_per_pixel, double ns_per_bin);
+
+	/**
+	SPAD_save3DICSheader_float
+
+	As SPAD_save3DICSheader for float (real32) histograms.
+	*/
+	__declspec(dllexport) int SPAD_save3DICSheader_float(char filepath[], char datafilepath[], int width, int height, int timebins, double xy_microns_per_pixel, double ns_per_bin);
+
+	/**
+	SPAD_save2DICSheader
+
+	As SPAD_save3DICSheader for a 2D image, bit_depth as for SPAD_save2DICSfile.
+	*/
+	__declspec(dllexport) int SPAD_save2DICSheader(char filepath[], char datafilepath[], int width, int height, int bit_depth, double xy_microns_per_pixel);
+
+	/**
+	SPAD_set_gzip_block_size
+
+	Compress the histograms saved by SPAD_save3DICSfile and SPAD_save3DICSfile_float in blocks of this size on all the
+	threads, see SPAD_set_number_of_threads, instead of by libics on one thread. The blocks are written one after the other
+	as a single gzip stream in a .ids file next to the .ics, which refers to it by its full path, so the two files must be
+	kept together. Any gzip reader, libics and TRI2 included, reads them. A .spadgzi index of where the blocks start is
+	saved too, with it SPAD_load3DICSfile decompresses the blocks on all the threads. Smaller blocks share the work better,
+	larger blocks compress slightly better, 1024 KB is a good start. The default is 0.
+
+	\param block_kb Size of the blocks in KB, 0 to compress with libics in the .ics file.
+	\return error code, < 0 if the size is not allowed.
+	*/
+	__declspec(dllexport) int SPAD_set_gzip_block_size(int block_kb);
+
 	/**
 	SPAD_find_integrations
 
@@ -118,22 +223,99 @@ extern "C" {
 	\param new_height Returns the height of the new image
 	*/
 	__declspec(dllexport) void SPAD_bin_by_2(USHORT *histogram, int width, int height, int timebins, int *new_width, int *new_height);
+
+	/**
+	SPAD_bin_by_2_overflow
+
+	SPAD_bin_by_2 with a choice of what happens when a binned value is above 65535. Uses AVX2 if the cpu has it, see
+	SPAD_set_simd_level, and shares the rows between the threads, see SPAD_set_number_of_threads. SPAD_bin_by_2 is this
+	with SPAD_BIN_WRAP in place.
+
+	\param histogram Image input data, should be size: width * height * timebins * size(USHORT) bytes.
+	\param width Pixel width of input image
+	\param height Pixel height of input image
+	\param timebins Number of timebins in each transient of input image
+	\param overflow SPAD_BIN_WRAP to keep the low 16 bits, SPAD_BIN_SATURATE to stop at 65535, SPAD_BIN_WIDEN for a 32 bit output image.
+	\param binned Output image of (width / 2) * (height / 2) * timebins values, UINT for SPAD_BIN_WIDEN, else USHORT. NULL (or histogram) to bin in place, not with SPAD_BIN_WIDEN.
+	\param new_width Returns the width of the new image
+	\param new_height Returns the height of the new image
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_bin_by_2_overflow(USHORT* histogram, int width, int height, int timebins, int overflow, void* binned, int* new_width, int* new_height);
 	
 	/**
 	SPAD_bin
 
-	Bin according to a bin size by repeated use of SPAD_bin_by_2.
+	Bin bin_size x bin_size in one pass, see SPAD_bin_nxm.
 
 	\param histogram Image input data, should be size: width * height * timebins * size(USHORT) bytes. Size of this buffer is not changed, operation is performed in place.
 	\param width Pixel width of input image
 	\param height Pixel height of input image
 	\param timebins Number of timebins in each transient of input image
-	\param bin_size Amount to bin, even numbers only. 2 = bin 2x2, 3 = 2x2, 4 = 4x4, 5 = 4x4 etc.
+	\param bin_size Amount to bin, any whole number. 2 = bin 2x2, 3 = 3x3 etc. Pixels left over at the right and bottom are dropped.
 	\param new_width Returns the width of the new image
 	\param new_height Returns the height of the new image
 	*/
 	__declspec(dllexport) void SPAD_bin(USHORT *histogram, int width, int height, int timebins, int bin_size, int *new_width, int *new_height);
 
+	/**
+	SPAD_bin_float
+
+	SPAD_bin for float histograms.
+	*/
+	__declspec(dllexport) void SPAD_bin_float(float* histogram, int width, int height, int timebins, int bin_size, int* new_width, int* new_height);
+
+	/**
+	SPAD_bin_nxm
+
+	Bin bin_x pixels across by bin_y pixels down in one pass, the output rows are shared between the threads, see
+	SPAD_set_number_of_threads. Each binned bin is added up in 32 bits and saturates at 65535.
+
+	\param histogram Image input data, should be size: width * height * timebins * size(USHORT) bytes.
+	\param width Pixel width of input image
+	\param height Pixel height of input image
+	\param timebins Number of timebins in each transient of input image
+	\param bin_x Number of pixels across to add together, pixels left over at the right are dropped.
+	\param bin_y Number of pixels down to add together, pixels left over at the bottom are dropped.
+	\param binned Output image of size (width / bin_x) * (height / bin_y) * timebins, or NULL (or histogram) to bin in place.
+	\param new_width Returns the width of the new image
+	\param new_height Returns the height of the new image
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_bin_nxm(USHORT* histogram, int width, int height, int timebins, int bin_x, int bin_y, USHORT* binned, int* new_width, int* new_height);
+
+	/**
+	SPAD_bin_nxm_float
+
+	SPAD_bin_nxm for float histograms.
+	*/
+	__declspec(dllexport) int SPAD_bin_nxm_float(float* histogram, int width, int height, int timebins, int bin_x, int bin_y, float* binned, int* new_width, int* new_height);
+
+	/**
+	SPAD_bin_pyramid
+
+	Bin the image 2x2, 4x4, ... up to 2^nLevels x 2^nLevels in one pass, each level made from the one before while it is
+	still in cache. Binned values saturate at 65535, as SPAD_bin. The image is not changed.
+
+	\param histogram Image input data, should be size: width * height * timebins * size(USHORT) bytes.
+	\param width Pixel width of input image
+	\param height Pixel height of input image
+	\param timebins Number of timebins in each transient of input image
+	\param nLevels Number of binned images to make, e.g. 3 for 2x2, 4x4 and 8x8.
+	\param levels Array of nLevels buffers, level l (from 0) of size (width >> (l + 1)) * (height >> (l + 1)) * timebins. Must be pre-allocated.
+	\param widths (optional, can be NULL) Returns the width of each level.
+	\param heights (optional, can be NULL) Returns the height of each level.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_bin_pyramid(USHORT* histogram, int width, int height, int timebins, int nLevels, USHORT* levels[], int widths[], int heights[]);
+
+	/**
+	SPAD_bin_pyramid_float
+
+	SPAD_bin_pyramid for float histograms.
+	*/
+	__declspec(dllexport) int SPAD_bin_pyramid_float(float* histogram, int width, int height, int timebins, int nLevels, float* levels[], int widths[], int heights[]);
+
 	/**
 	SPAD_makeIntensityImage
 
@@ -199,10 +381,23 @@ extern "C" {
 	*/
 	__declspec(dllexport) int SPAD_write_bin_width_factors_to_file(char filepath[]);
 
+	/**
+	SPAD_write_bin_width_factors_to_file_precision
+
+	Write the stored factors to a smaller binary file. SPAD_PRECISION_FLOAT32 halves the size, SPAD_PRECISION_FIXED16 stores
+	16 bit deviations from 1.0 in steps of 1/16384 for a quarter of the size. With fixed point the bin borders made from the
+	factors are within one step of the double ones. SPAD_read_bin_width_factors_from_file reads any of them.
+
+	\param filepath Path to save to.
+	\param precision SPAD_PRECISION_DOUBLE, SPAD_PRECISION_FLOAT32 or SPAD_PRECISION_FIXED16.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_write_bin_width_factors_to_file_precision(char filepath[], int precision);
+
 	/**
 	SPAD_read_bin_width_factors_from_file
 
-	Read and store factors from a file for later use.
+	Read and store factors from a file for later use. The file can be double, float32 or fixed point, known from its size.
 
 	\param filepath Path of file.
 	\param height Image height.
@@ -223,6 +418,46 @@ extern "C" {
 	*/
 	__declspec(dllexport) int SPAD_dump_bin_width_factors_to_text_file(char filepath[], int width, int height, int timebins);
 
+	/**
+	SPAD_compress_bin_width_factors
+
+	Compress the stored factors to a mean transient and a few shared basis transients (principal components) with a
+	coefficient for each of them for every detector. Once compressed the corrections rebuild the factors of each transient
+	from the components as it is corrected, without a correction plan, so very little is read from memory for each image.
+	Prints the fraction of the variance kept and the reconstruction error of the factors and bin borders.
+	The compressed factors stop being used as soon as the stored factors are changed.
+
+	\param width Image width.
+	\param height Image height.
+	\param timebins Number of timebins.
+	\param nComponents Number of basis transients to keep, e.g. 8.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_compress_bin_width_factors(int width, int height, int timebins, int nComponents);
+
+	/**
+	SPAD_write_bin_width_pca_to_file
+
+	Write the compressed factors from SPAD_compress_bin_width_factors to a binary file.
+
+	\param filepath Path to save to.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_write_bin_width_pca_to_file(char filepath[]);
+
+	/**
+	SPAD_read_bin_width_pca_from_file
+
+	Read compressed factors from a file and use them for the corrections in place of the bin width factors.
+
+	\param filepath Path of file.
+	\param width Image width.
+	\param height Image height.
+	\param timebins Number of timebins.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_read_bin_width_pca_from_file(char filepath[], int width, int height, int timebins);
+
 	/**
 	SPAD_intialise_timebase_shifts
 
@@ -359,6 +594,102 @@ extern "C" {
 	*/
 	__declspec(dllexport) int SPAD_dump_timebase_scales_to_text_file(char filepath[]);
 
+	/**
+	SPAD_write_calibration_file
+
+	Write the bin width factors, timebase shifts and timebase scales to one calibration file, with a header holding the image
+	size, the precision of the factors, the bins used to make them, the calibrated ns per bin and a checksum.
+
+	\param filepath Path to save to.
+	\param width Image width.
+	\param height Image height.
+	\param timebins Number of timebins.
+	\param precision SPAD_PRECISION_DOUBLE, SPAD_PRECISION_FLOAT32 or SPAD_PRECISION_FIXED16 for the bin width factors.
+	\param start_bin First bin used for the bin width factors, -1 if not known.
+	\param stop_bin Last bin used for the bin width factors, -1 if not known.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_write_calibration_file(char filepath[], int width, int height, int timebins, int precision, int start_bin, int stop_bin);
+
+	/**
+	SPAD_read_calibration_file
+
+	Use the calibration in a file from SPAD_write_calibration_file. The file is memory mapped rather than read, only the
+	parts used are loaded and processes using the same file share its memory. Sets the calibrated timebase.
+	Fails if the file is not for an image of this size.
+
+	\param filepath Path of file.
+	\param width Image width.
+	\param height Image height.
+	\param timebins Number of timebins.
+	\param verify If not 0 check the checksum, this reads the whole file.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_read_calibration_file(char filepath[], int width, int height, int timebins, int verify);
+
+	/**
+	SPAD_release_calibration_rows
+
+	Lets the OS drop the pages of a calibration file read by SPAD_read_calibration_file that hold the calibration of some
+	rows, once they have been corrected with SPAD_CorrectTransientsRows. They are read from the file again if those rows are
+	corrected again, so memory use stays that of the slabs when correcting an image a slab at a time. Only a calibration
+	used where it is in the file can be released, which needs double precision bin width factors (SPAD_PRECISION_DOUBLE)
+	and none of the calibration reset. Legacy calibration files and compact bin width factors are read into memory for
+	the whole image and nothing is released.
+
+	\param width The width of the image.
+	\param height The height of the image.
+	\param timebins The number of timebins.
+	\param first_row The first row to release.
+	\param nRows The number of rows.
+	\return 1 if the rows were released, 0 if the calibration is not in a calibration file to release, < 0 on error.
+	*/
+	__declspec(dllexport) int SPAD_release_calibration_rows(int width, int height, int timebins, int first_row, int nRows);
+
+	/**
+	SPAD_convert_calibration_files
+
+	Make a calibration file from the separate bin width factors, timebase shifts and timebase scales files. Their sizes are
+	checked against the image size. The calibration from them is left stored for use.
+
+	\param bin_width_factors_path Path of the bin width factors file.
+	\param timebase_shifts_path Path of the timebase shifts file.
+	\param timebase_scales_path Path of the timebase scales file.
+	\param filepath Path of the calibration file to write.
+	\param width Image width.
+	\param height Image height.
+	\param timebins Number of timebins.
+	\param precision Precision of the bin width factors in the new file, as SPAD_write_calibration_file.
+	\param start_bin First bin used for the bin width factors, -1 if not known.
+	\param stop_bin Last bin used for the bin width factors, -1 if not known.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_convert_calibration_files(char bin_width_factors_path[], char timebase_shifts_path[], char timebase_scales_path[],
+		char filepath[], int width, int height, int timebins, int precision, int start_bin, int stop_bin);
+
+	/**
+	SPAD_build_correction_plan
+
+	Precalculate, for every detector, how the photons in each time bin are split between the corrected time bins.
+	The plan depends only on the bin width factors, timebase shifts and timebase scales so it only needs building once after
+	they have been read or initialised. SPAD_CorrectTransients will build it if required, and rebuild it if the factors have
+	been changed by any of the functions above. Call this again if the factors are changed through their pointers after
+	SPAD_get_*_ptr has been used.
+
+	\param width The width of the time resolved images to be corrected.
+	\param height The height of the time resolved images to be corrected.
+	\param timebins The number of timebins in the time resolved images to be corrected.
+	\return error code, if < 0 the plan is not used and the corrections are calculated per transient.
+	*/
+	__declspec(dllexport) int SPAD_build_correction_plan(int width, int height, int timebins);
+
+	/**
+	SPAD_free_correction_plan
+
+	Free the memory used by the correction plan.
+	*/
+	__declspec(dllexport) void SPAD_free_correction_plan(void);
+
 	/**
 	SPAD_CorrectTransients
 
@@ -381,6 +712,260 @@ extern "C" {
 	__declspec(dllexport) int SPAD_CorrectTransients(USHORT* image, int width, int height, int timebins);
 	int SPAD_CorrectTransients_SingleThread(USHORT* image, int width, int height, int timebins);
 
+	/**
+	SPAD_CorrectTransients_Float
+
+	Deterministic version of SPAD_CorrectTransients. Instead of redistributing whole photons at random, each corrected time bin
+	gets the expected number of photons as a float, so no random numbers are used and the output is always the same.
+	Use when integer photon counts are not needed, e.g. for lifetime fitting. Faster than the random correction.
+
+	\param image Time resolved image to be corrected, not changed.
+	\param output Buffer for the corrected image, width * height * timebins floats. Must be pre-allocated.
+	\param width The width of the time resolved image.
+	\param height The height of the time resolved image.
+	\param timebins The number of timebins in the time resolved image.
+	\return Error code.
+	*/
+	__declspec(dllexport) int SPAD_CorrectTransients_Float(USHORT* image, float* output, int width, int height, int timebins);
+
+	/**
+	SPAD_CorrectTransientsBatch
+
+	Correct several images of the same size together, as SPAD_CorrectTransients. Each detector is corrected in all the
+	images before moving to the next, so its calibration is read from memory once for the batch instead of once per image.
+	Gives the same result as correcting the images one at a time, image n having the index + n of SPAD_set_image_index.
+
+	\param images Array of nImages time resolved images to be corrected in place.
+	\param nImages Number of images.
+	\param width The width of the time resolved images.
+	\param height The height of the time resolved images.
+	\param timebins The number of timebins in the time resolved images.
+	\return Error code.
+	*/
+	__declspec(dllexport) int SPAD_CorrectTransientsBatch(USHORT* images[], int nImages, int width, int height, int timebins);
+
+	/**
+	SPAD_CorrectTransientsBatch_Float
+
+	Deterministic version of SPAD_CorrectTransientsBatch, as SPAD_CorrectTransients_Float.
+
+	\param images Array of nImages time resolved images to be corrected, not changed.
+	\param outputs Array of nImages buffers for the corrected images, width * height * timebins floats each. Must be pre-allocated.
+	\param nImages Number of images.
+	\param width The width of the time resolved images.
+	\param height The height of the time resolved images.
+	\param timebins The number of timebins in the time resolved images.
+	\return Error code.
+	*/
+	__declspec(dllexport) int SPAD_CorrectTransientsBatch_Float(USHORT* images[], float* outputs[], int nImages, int width, int height, int timebins);
+
+	/**
+	SPAD_CorrectBinIntensity
+
+	Correct, bin and make the intensity image in one pass. Gives the same binned image as SPAD_CorrectTransients followed
+	by SPAD_bin, but each corrected transient is added straight into its binned transient so the full size corrected image
+	is never written and read back. The image is not changed.
+
+	\param image Time resolved image to be corrected.
+	\param width The width of the time resolved image.
+	\param height The height of the time resolved image.
+	\param timebins The number of timebins in the time resolved image.
+	\param bin_size Amount to bin, as SPAD_bin. 1 for no binning.
+	\param binned Buffer for the corrected and binned image, new_width * new_height * SPAD_get_output_timebins(timebins). Must be pre-allocated.
+	\param intensity (optional, can be NULL) Buffer for the photon total of each binned pixel in the output time window, new_width * new_height.
+	\param new_width Returns the width of the binned image.
+	\param new_height Returns the height of the binned image.
+	\return Error code.
+	*/
+	__declspec(dllexport) int SPAD_CorrectBinIntensity(USHORT* image, int width, int height, int timebins, int bin_size, USHORT* binned, UINT* intensity, int* new_width, int* new_height);
+
+	/**
+	SPAD_CorrectBinIntensity_Float
+
+	Deterministic version of SPAD_CorrectBinIntensity, as SPAD_CorrectTransients_Float followed by SPAD_bin_float.
+	*/
+	__declspec(dllexport) int SPAD_CorrectBinIntensity_Float(USHORT* image, int width, int height, int timebins, int bin_size, float* binned, float* intensity, int* new_width, int* new_height);
+
+	/**
+	SPAD_CorrectTransientsRows
+
+	Correct some of the rows of an image, as SPAD_CorrectTransients does for the whole image. For images too big to hold,
+	which can be read, corrected and saved a slab of rows at a time. Each row is corrected against the calibration of its
+	own detectors, and only the correction plan for the rows being corrected is built, so memory use depends on the number
+	of rows and not the size of the image. Random corrections with SPAD_set_random_seed give the same result as correcting
+	the whole image with the same SPAD_set_image_index.
+
+	\param rows Rows first_row to first_row + nRows - 1 of the time resolved image, corrected in place.
+	\param width The width of the whole time resolved image.
+	\param height The height of the whole time resolved image.
+	\param timebins The number of timebins in the time resolved image.
+	\param first_row The row of the image that rows starts with.
+	\param nRows The number of rows to correct.
+	\return Error code.
+	*/
+	__declspec(dllexport) int SPAD_CorrectTransientsRows(USHORT* rows, int width, int height, int timebins, int first_row, int nRows);
+
+	/**
+	SPAD_CorrectTransientsRows_Float
+
+	Deterministic version of SPAD_CorrectTransientsRows, as SPAD_CorrectTransients_Float. output gets width * nRows transients.
+	*/
+	__declspec(dllexport) int SPAD_CorrectTransientsRows_Float(USHORT* rows, float* output, int width, int height, int timebins, int first_row, int nRows);
+
+	/**
+	SPAD_CorrectBinIntensityRows
+
+	SPAD_CorrectBinIntensity for some of the rows of an image, see SPAD_CorrectTransientsRows. Binning the slabs of an image
+	one after the other gives the binned image if each slab except the last has a multiple of bin_size rows.
+
+	\param rows Rows first_row to first_row + nRows - 1 of the time resolved image, not changed.
+	\param width The width of the whole time resolved image.
+	\param height The height of the whole time resolved image.
+	\param timebins The number of timebins in the time resolved image.
+	\param first_row The row of the image that rows starts with.
+	\param nRows The number of rows to correct.
+	\param bin_size Amount to bin, as SPAD_bin. 1 for no binning.
+	\param binned Buffer for the corrected and binned rows, new_width * new_height * SPAD_get_output_timebins(timebins). Must be pre-allocated.
+	\param intensity (optional, can be NULL) Buffer for the photon total of each binned pixel, new_width * new_height.
+	\param new_width Returns the width of the binned rows.
+	\param new_height Returns the number of binned rows, nRows / bin_size.
+	\return Error code.
+	*/
+	__declspec(dllexport) int SPAD_CorrectBinIntensityRows(USHORT* rows, int width, int height, int timebins, int first_row, int nRows, int bin_size, USHORT* binned, UINT* intensity,
+		int* new_width, int* new_height);
+
+	/**
+	SPAD_CorrectBinIntensityRows_Float
+
+	Deterministic version of SPAD_CorrectBinIntensityRows, as SPAD_CorrectBinIntensity_Float.
+	*/
+	__declspec(dllexport) int SPAD_CorrectBinIntensityRows_Float(USHORT* rows, int width, int height, int timebins, int first_row, int nRows, int bin_size, float* binned, float* intensity,
+		int* new_width, int* new_height);
+
+	/**
+	SPAD_get_correction_plan_detector_bytes
+
+	Memory used by the correction plan for each detector, to work out how many rows SPAD_CorrectTransientsRows can be given
+	at a time. Only known once a plan has been built, 0 before then or if no plan is used.
+
+	\return Bytes per detector.
+	*/
+	__declspec(dllexport) size_t SPAD_get_correction_plan_detector_bytes(void);
+
+	/**
+	SPAD_set_simd_level
+
+	Choose the instruction set used by SPAD_CorrectTransients_Float and SPAD_bin_by_2. By default the best one the cpu supports is picked
+	the first time the correction plan is built. Only needed to compare the kernels or to work around a problem.
+
+	\param level SPAD_SIMD_AUTO, SPAD_SIMD_SCALAR, SPAD_SIMD_AVX2 or SPAD_SIMD_AVX512. Levels the cpu does not support are lowered.
+	\return The level that will be used.
+	*/
+	__declspec(dllexport) int SPAD_set_simd_level(int level);
+
+	/**
+	SPAD_set_fixed_timebin_kernels
+
+	The deterministic correction kernels and the search for the empty bins of each transient are compiled separately for
+	64, 128, 256, 512 and 1024 timebins, with the loops over the transient fully known to the compiler. They are used by default for images with
+	those numbers of timebins, other numbers use the generic kernels. Only needed to compare the kernels, see SPAD_timebins_benchmark.
+
+	\param enable 1 to use the fixed size kernels (default), 0 to always use the generic kernels.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_set_fixed_timebin_kernels(int enable);
+
+	/**
+	SPAD_set_correction_precision
+
+	Choose how the weights used by SPAD_CorrectTransients_Float and the error diffusion method are stored.
+	SPAD_PRECISION_FLOAT32 (default) or SPAD_PRECISION_FIXED16, which halves the memory read for every image. Fixed point
+	weights are within 1/131070 of the float ones and keep the photon total of every time bin.
+
+	\param precision SPAD_PRECISION_FLOAT32 or SPAD_PRECISION_FIXED16.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_set_correction_precision(int precision);
+
+	/**
+	SPAD_set_correction_method
+
+	Choose how SPAD_CorrectTransients splits the photons of each time bin between the corrected time bins.
+
+	SPAD_CORRECTION_BINOMIAL     A chain of binomial draws, one for each bin the photons can go to (default).
+	SPAD_CORRECTION_MULTINOMIAL  One multinomial draw for each bin, usually faster for low photon counts. Needs the correction plan,
+	                             otherwise the binomial chain is used.
+	SPAD_CORRECTION_ERROR_DIFFUSION  No random numbers. The expected counts are rounded along the transient, carrying the
+	                                 rounding error on to the next bin, so the photon total of each transient is kept.
+	                                 Always gives the same result, but without the photon noise of the other two.
+
+	The binomial and multinomial methods give the same statistics.
+
+	\param method One of the methods above.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_set_correction_method(int method);
+
+	/**
+	SPAD_set_output_time_window
+
+	Keep only some of the corrected time bins, optionally added together, e.g. 64 of 256 bins. The corrected photons go
+	straight into the shorter output transients as each transient is corrected, there is no extra pass over the image.
+	Applies to all the correction functions. The output has SPAD_get_output_timebins(timebins) bins in each transient:
+	SPAD_CorrectTransients packs them at the start of the image, the others need output buffers only this big.
+	A time window that does not end on a whole time_bin drops the last few bins.
+
+	\param start_bin First corrected bin to keep.
+	\param stop_bin Keep bins up to but not including this one, 0 for all the bins to the end.
+	\param time_bin Number of corrected bins added together into each output bin, 1 for none.
+	\return error code
+	*/
+	__declspec(dllexport) int SPAD_set_output_time_window(int start_bin, int stop_bin, int time_bin);
+
+	/**
+	SPAD_get_output_timebins
+
+	Number of time bins in each corrected transient with the output time window from SPAD_set_output_time_window.
+
+	\param timebins The number of timebins in the images to be corrected.
+	\return Number of output time bins.
+	*/
+	__declspec(dllexport) int SPAD_get_output_timebins(int timebins);
+
+	/**
+	SPAD_set_random_seed
+
+	Set the seed used for the random redistribution of photons by SPAD_CorrectTransients.
+	Each pixel and time bin of each image draws from its own stream derived from the seed and the image index (see
+	SPAD_set_image_index), so with a fixed seed a corrected image is identical whatever the number of threads, and the
+	noise of one image is independent of the next. If no seed is set a different one is used for every image.
+
+	\param seed The seed.
+	*/
+	__declspec(dllexport) void SPAD_set_random_seed(unsigned long long seed);
+
+	/**
+	SPAD_set_image_index
+
+	Set the index of the next image to be corrected, which with SPAD_set_random_seed picks its random streams.
+	Each correction of whole images moves the index on by the number of images, image n of a batch has the index + n.
+	The corrections of rows leave it alone, so all the slabs of an image use the same index; set it before each image.
+	An image is corrected identically alone, in a batch or a slab at a time only when it has the same index.
+
+	\param index Index of the next image, 0 at the start.
+	*/
+	__declspec(dllexport) void SPAD_set_image_index(unsigned long long index);
+
+	/**
+	SPAD_set_number_of_threads
+
+	Set the number of threads used by SPAD_CorrectTransients. The threads are created once and reused for every image.
+
+	\param nThreads The number of threads, 0 to use all hardware threads.
+	\return The number of threads that will be used.
+	*/
+	__declspec(dllexport) int SPAD_set_number_of_threads(int nThreads);
+
 
 
 	/* test functions */
@@ -397,6 +982,118 @@ extern "C" {
 	__declspec(dllexport) int SPAD_find_test(BYTE *data, unsigned long long nBytes);
 
 
+	/**
+	SPAD_multinomial_test
+
+	Checks that the multinomial and binomial chain correction methods give the same mean and variance for every bin of a
+	made up transient, and compares their speed. Writes a csv file of the results.
+
+	\param filepath Path of the csv file to write.
+	\return error code, < 0 if the methods do not agree.
+	*/
+	__declspec(dllexport) int SPAD_multinomial_test(char filepath[]);
+
+	/**
+	SPAD_error_diffusion_test
+
+	Corrects a set of made up transients with the error diffusion method and checks that the photon total of every
+	transient is unchanged and that the result is the same when repeated. The transients go through the corrections
+	used for images: the band kernel for dense transients and the plan for sparse ones, with float32 and fixed16 weights,
+	and the bin borders of each detector without a plan. Photons shifted past either end of a transient are not kept by
+	any correction, so the made up transients leave their first and last 4 bins empty.
+	The calibration is replaced by a made up one for 64 x 64 x 256 images, load the real one again afterwards, and the
+	precision is left at SPAD_PRECISION_FLOAT32.
+
+	\return error code, < 0 if any transient gains or loses photons.
+	*/
+	__declspec(dllexport) int SPAD_error_diffusion_test(void);
+
+	/**
+	SPAD_compact_calibration_test
+
+	Measures the accuracy of the compact forms of the calibration against the double one, using the current calibration.
+	Reports the largest error in the bin borders from float32 and fixed point bin width factor files, and the largest
+	error in the deterministic correction of a flat transient with fixed point weights, as a fraction of the photons per bin.
+
+	\param width The width of the time resolved images to be corrected.
+	\param height The height of the time resolved images to be corrected.
+	\param timebins The number of timebins in the time resolved images to be corrected.
+	\return error code, < 0 if an error is larger than expected.
+	*/
+	__declspec(dllexport) int SPAD_compact_calibration_test(int width, int height, int timebins);
+
+	/**
+	SPAD_binomial_benchmark
+
+	Times the binomial random number generators used to redistribute photons over a range of n and p, and checks their
+	mean and variance. Writes a csv file of the results.
+
+	\param filepath Path of the csv file to write.
+	*/
+	__declspec(dllexport) int SPAD_binomial_benchmark(char filepath[]);
+
+	/**
+	SPAD_batch_benchmark
+
+	Times SPAD_CorrectTransientsBatch and SPAD_CorrectTransientsBatch_Float on batches of 1, 2, 4, ... made up images using
+	the current calibration, and checks every image of a batch is the same as when it is corrected alone. Writes a csv file
+	of the throughput against the number of images. Needs memory for 2 * maxImages USHORT and maxImages float images.
+
+	\param filepath Path of the csv file to write.
+	\param width The width of the time resolved images.
+	\param height The height of the time resolved images.
+	\param timebins The number of timebins in the time resolved images.
+	\param maxImages Largest batch, e.g. 16.
+	\return error code, < 0 if the batch and single image corrections differ.
+	*/
+	__declspec(dllexport) int SPAD_batch_benchmark(char filepath[], int width, int height, int timebins, int maxImages);
+
+	/**
+	SPAD_timebins_benchmark
+
+	Times SPAD_CorrectTransients_Float with the fixed size and the generic kernels, see
+	SPAD_set_fixed_timebin_kernels, for each of 64, 128, 256, 512 and 1024 timebins, and 1000 which has no fixed size
+	kernels. Checks both kernels give the same corrected images and writes a csv file of the times and speedups.
+	The calibration is replaced by a made up one for each number of timebins and is not put back: the made up one for
+	the last size tried is left in use, so load the real calibration again before correcting any images. The setting
+	of SPAD_set_fixed_timebin_kernels is put back as it was.
+
+	\param filepath Path of the csv file to write.
+	\param width The width of the made up images.
+	\param height The height of the made up images.
+	\param repeats Number of times each is timed, the mean is written.
+	\return error code, < 0 if the fixed size and generic kernels differ.
+	*/
+	__declspec(dllexport) int SPAD_timebins_benchmark(char filepath[], int width, int height, int repeats);
+
+	/**
+	SPAD_bin_by_2_benchmark
+
+	Times SPAD_bin_by_2_overflow with each overflow policy, with the scalar and the SIMD kernels, on made up 192 x 128 x 256
+	and 768 x 512 x 256 (a 4 x 4 mosaic) images, and checks the kernels give the same images. Uses the current number of
+	threads, see SPAD_set_number_of_threads. Writes a csv file of the times and speedups. Needs about 500 MB.
+
+	\param filepath Path of the csv file to write.
+	\param repeats Number of times each is timed, the mean is written.
+	\return error code, < 0 if the kernels differ.
+	*/
+	__declspec(dllexport) int SPAD_bin_by_2_benchmark(char filepath[], int repeats);
+
+	/**
+	SPAD_gzip_benchmark
+
+	Times SPAD_save3DICSfile at compression levels 1, 3, 6 and 9, compressed by libics on one thread and in blocks of 256,
+	1024 and 4096 KB on the current number of threads, see SPAD_set_gzip_block_size, on a made up 192 x 128 x 256 image of
+	decays. Writes a csv file of the times, throughputs, compressed sizes and speedups over libics. The image is saved next
+	to the csv file and deleted afterwards.
+
+	\param filepath Path of the csv file to write.
+	\param repeats Number of times each is timed, the mean is written.
+	\return error code, < 0 if an image could not be saved.
+	*/
+	__declspec(dllexport) int SPAD_gzip_benchmark(char filepath[], int repeats);
+
+
     /**
 	SPAD_simpletest
 
@@ -1,6 +1,7 @@
 
 #include <windows.h>
 #include <iostream>
+#include <mutex>
 #include "SPAD-correct_internal.h"
 #include "SPAD-correct.h"
 
@@ -43,6 +44,48 @@ int SPAD_loadfile(char filepath[], BYTE** data, unsigned long long* nBytes)
 	return 0;
 }
 
+/* Name of a data file for the source line of an ics header, without its folder so the two can be moved together */
+const char* ics_source_name(const char* datapath)
+{
+	const char* name = datapath;
+	for (const char* p = datapath; *p; p++)
+		if (*p == '\\' || *p == '/' || *p == ':') name = p + 1;
+
+	return name;
+}
+
+/* A source file named without a folder is next to the ics file rather than in the working directory. Put the folder of
+   the ics file in front of it, for IcsGetData as well as for the parallel gzip and the memory mapping. */
+void resolve_ics_source(ICS* ip, const char* filepath)
+{
+	if (ip->srcFile[0] == '\0' || ics_source_name(ip->srcFile) != ip->srcFile)
+		return;
+
+	size_t folder = ics_source_name(filepath) - filepath;
+	if (folder == 0 || folder + strlen(ip->srcFile) >= ICS_MAXPATHLEN)
+		return;
+
+	char srcFile[ICS_MAXPATHLEN];
+	memcpy(srcFile, filepath, folder);
+	strcpy_s(srcFile + folder, ICS_MAXPATHLEN - folder, ip->srcFile);
+	strcpy_s(ip->srcFile, ICS_MAXPATHLEN, srcFile);
+}
+
+/* IcsGetData, except that gzip data with a .spadgzi index or several gzip members is decompressed on all the threads,
+   see SPAD-gzip.cpp. Only for data in the byte order of this machine, libics swaps any other. */
+static Ics_Error get_image_data(ICS* ip, void* buf, size_t bufsize)
+{
+	if (ip->compression == IcsCompr_gzip && ip->srcFile[0] != '\0' && ip->byteOrder[0] == 1 && ip->byteOrder[1] == 2) {
+		int ret = read_gzip_parallel(ip->srcFile, ip->srcOffset, buf, bufsize);
+		if (ret == 0)
+			return IcsErr_Ok;
+		if (ret < 0)
+			return IcsErr_CorruptedStream;
+	}
+
+	return IcsGetData(ip, buf, bufsize);
+}
+
 /* load an ics image file */
 int SPAD_load3DICSfile(char filepath[], USHORT** image, int* width, int* height, int* timebins)
 {
@@ -59,6 +102,7 @@ int SPAD_load3DICSfile(char filepath[], USHORT** image, int* width, int* height,
 		printf("SPAD_load3DICSfile ERROR: Cannot open ics file for reading.\n");
 		return(-1);
 	}
+	resolve_ics_source(ip, filepath);
 
 	IcsGetLayout(ip, &dt, &ndims, dims);
 	if (dt != Ics_uint16) {
@@ -73,7 +117,7 @@ int SPAD_load3DICSfile(char filepath[], USHORT** image, int* width, int* height,
 		return(-3);
 	}
 
-	retval = IcsGetData(ip, buf, bufsize);
+	retval = get_image_data(ip, buf, bufsize);
 	if (retval != IcsErr_Ok) {
 		printf("SPAD_load3DICSfile ERROR: IcsGetData failed.\n");
 		return(-4);
@@ -113,6 +157,7 @@ int SPAD_load3DICSfile_LV(char filepath[], USHORT* image, int width, int height,
 		printf("SPAD_load3DICSfile ERROR: Cannot open ics file for reading.\n");
 		return(-1);
 	}
+	resolve_ics_source(ip, filepath);
 
 	IcsGetLayout(ip, &dt, &ndims, dims);
 	if (dt != Ics_uint16) {
@@ -143,7 +188,7 @@ int SPAD_load3DICSfile_LV(char filepath[], USHORT* image, int width, int height,
 		return(-3);
 	}
 
-	retval = IcsGetData(ip, (void*)image, bufsize);
+	retval = get_image_data(ip, (void*)image, bufsize);
 	if (retval != IcsErr_Ok) {
 		printf("SPAD_load3DICSfile ERROR: IcsGetData failed.\n");
 		return(-4);
@@ -162,13 +207,122 @@ int SPAD_load3DICSfile_LV(char filepath[], USHORT* image, int width, int height,
 
 	return(0);
 }
-int SPAD_save3DICSfile(char filepath[], USHORT* histogram, int width, int height, int timebins, int compression_level,
-	BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel, double ns_per_bin)
+
+/*
+Zero copy loading of uncompressed ICS version 2 files.
+
+The data of a version 2 file is stored raw after the header, at the source file offset libics found when it read the
+header. Rather than reading it, the whole file is memory mapped copy-on-write and the image points into the mapping, so
+loading costs only the page faults as the image is first used. Correcting in place writes to private copies of the
+pages and the file is never changed. Anything else, gzip data, version 1 files, other byte orders or an odd data offset
+that would leave the image unaligned, is loaded by SPAD_load3DICSfile.
+*/
+#define MAX_MAPPED_IMAGES 64
+
+static spad_mapped_file gMappedImages[MAX_MAPPED_IMAGES];
+static std::mutex gMappedImagesMutex;   // images may be mapped on one thread and freed on another
+
+int SPAD_map3DICSfile(char filepath[], USHORT** image, int* width, int* height, int* timebins)
+{
+	ICS* ip;
+	Ics_DataType dt;
+	int ndims;
+	size_t dims[ICS_MAXDIM];
+	Ics_Error retval;
+
+	retval = IcsOpen(&ip, filepath, "r");
+	if (retval != IcsErr_Ok) {
+		printf("SPAD_map3DICSfile ERROR: Cannot open ics file for reading.\n");
+		return(-1);
+	}
+	resolve_ics_source(ip, filepath);
+
+	IcsGetLayout(ip, &dt, &ndims, dims);
+	size_t bufsize = IcsGetDataSize(ip);
+	int mappable = (dt == Ics_uint16 && ndims == 3 && ip->version == 2 && ip->compression == IcsCompr_uncompressed &&
+		ip->srcFile[0] != '\0' && ip->srcOffset % sizeof(USHORT) == 0 && ip->byteOrder[0] == 1 && ip->byteOrder[1] == 2);
+	char srcFile[ICS_MAXPATHLEN];
+	strcpy_s(srcFile, ICS_MAXPATHLEN, ip->srcFile);
+	size_t srcOffset = ip->srcOffset;
+	IcsClose(ip);
+
+	std::unique_lock<std::mutex> lock(gMappedImagesMutex);
+
+	int slot = 0;
+	while (slot < MAX_MAPPED_IMAGES && gMappedImages[slot].data != NULL) slot++;
+
+	if (!mappable || slot == MAX_MAPPED_IMAGES) {
+		lock.unlock();
+		return(SPAD_load3DICSfile(filepath, image, width, height, timebins));
+	}
+
+	spad_mapped_file* map = &gMappedImages[slot];
+	if (map_file(srcFile, 1, map) < 0 || map->size < srcOffset + bufsize) {
+		unmap_file(map);
+		lock.unlock();
+		return(SPAD_load3DICSfile(filepath, image, width, height, timebins));
+	}
+
+	*height = (int)dims[2];
+	*width = (int)dims[1];
+	*timebins = (int)dims[0];
+	*image = (USHORT*)((BYTE*)map->data + srcOffset);
+
+	return(0);
+}
+
+void SPAD_free3DICSimage(USHORT* image)
+{
+	if (image == NULL) return;
+
+	std::lock_guard<std::mutex> lock(gMappedImagesMutex);
+	for (int slot = 0; slot < MAX_MAPPED_IMAGES; slot++) {
+		if (in_mapped_file(&gMappedImages[slot], image)) {
+			unmap_file(&gMappedImages[slot]);
+			return;
+		}
+	}
+
+	free(image);
+}
+
+/* save a 3D histogram of any data type, used by SPAD_save3DICSfile and SPAD_save3DICSfile_float.
+   With a source file the histogram is already in that file, uncompressed, and only the header is written.
+   With a gzip block size set the histogram is compressed on all the threads into a .ids file next to the ics file, which
+   becomes the source, named without its folder. */
+static int save3DICSfile(char filepath[], void* histogram, const char* source, Ics_DataType data_type, size_t bytes_per_value, int width, int height, int timebins,
+	int compression_level, BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel, double ns_per_bin)
 {
 	ICS* imagefile;
 	Ics_Error retval;
 	size_t dims[3] = { (size_t)timebins, (size_t)width, (size_t)height };
-	size_t histsize = width * height * timebins * sizeof(USHORT);
+	size_t histsize = (size_t)width * height * timebins * bytes_per_value;
+	char gzipfilepath[MAX_PATH];
+
+	if (source == NULL && compression_level != 0 && gzip_parallel_active()) {
+		strcpy_s(gzipfilepath, MAX_PATH, filepath);
+		char* ext = strrchr(gzipfilepath, '.');
+		if (ext == NULL || strchr(ext, '\\') || strchr(ext, '/'))
+			ext = gzipfilepath + strlen(gzipfilepath);
+		strcpy_s(ext, 5, ".ids");
+
+		FILE* fp = NULL;
+		if (fopen_s(&fp, gzipfilepath, "wb") != 0 || fp == NULL) {
+			printf("SPAD_save3DICSfile ERROR: Cannot open ids file for writing.\n");
+			return -1;
+		}
+		char indexpath[MAX_PATH];
+		gzip_index_path(gzipfilepath, indexpath);
+		int ret = write_gzip_parallel(fp, histogram, histsize, compression_level, indexpath);
+		if (fclose(fp) != 0 || ret < 0) {
+			printf("SPAD_save3DICSfile ERROR: Cannot write ids file.\n");
+			return -2;
+		}
+		source = ics_source_name(gzipfilepath);   // found next to the ics file when loaded
+	}
+	else if (source != NULL) {
+		compression_level = 0;
+	}
 
 	retval = IcsOpen(&imagefile, filepath, "w2");
 	if (retval != IcsErr_Ok) {
@@ -176,8 +330,13 @@ int SPAD_save3DICSfile(char filepath[], USHORT* histogram, int width, int height
 		return -1;
 	}
 
-	IcsSetLayout(imagefile, Ics_uint16, 3, dims);
-	IcsSetData(imagefile, histogram, histsize);
+	IcsSetLayout(imagefile, data_type, 3, dims);
+	if (source != NULL) {
+		IcsSetSource(imagefile, source, 0);
+	}
+	else {
+		IcsSetData(imagefile, histogram, histsize);
+	}
 	if (compression_level == 0) {
 		IcsSetCompression(imagefile, IcsCompr_uncompressed, 0);
 	}
@@ -240,7 +399,34 @@ int SPAD_save3DICSfile(char filepath[], USHORT* histogram, int width, int height
 	return 0;
 }
 
-int SPAD_save2DICSfile(char filepath[], void* buffer, int width, int height, int bit_depth, int compression_level,
+int SPAD_save3DICSfile(char filepath[], USHORT* histogram, int width, int height, int timebins, int compression_level,
+	BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel, double ns_per_bin)
+{
+	return save3DICSfile(filepath, histogram, NULL, Ics_uint16, sizeof(USHORT), width, height, timebins, compression_level,
+		header, max_header_bytes, xy_microns_per_pixel, ns_per_bin);
+}
+
+int SPAD_save3DICSfile_float(char filepath[], float* histogram, int width, int height, int timebins, int compression_level,
+	BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel, double ns_per_bin)
+{
+	return save3DICSfile(filepath, histogram, NULL, Ics_real32, sizeof(float), width, height, timebins, compression_level,
+		header, max_header_bytes, xy_microns_per_pixel, ns_per_bin);
+}
+
+int SPAD_save3DICSheader(char filepath[], char datafilepath[], int width, int height, int timebins, double xy_microns_per_pixel, double ns_per_bin)
+{
+	return save3DICSfile(filepath, NULL, datafilepath, Ics_uint16, sizeof(USHORT), width, height, timebins, 0,
+		NULL, 0, xy_microns_per_pixel, ns_per_bin);
+}
+
+int SPAD_save3DICSheader_float(char filepath[], char datafilepath[], int width, int height, int timebins, double xy_microns_per_pixel, double ns_per_bin)
+{
+	return save3DICSfile(filepath, NULL, datafilepath, Ics_real32, sizeof(float), width, height, timebins, 0,
+		NULL, 0, xy_microns_per_pixel, ns_per_bin);
+}
+
+/* save a 2D image, used by SPAD_save2DICSfile and SPAD_save2DICSheader, source as for save3DICSfile */
+static int save2DICSfile(char filepath[], void* buffer, const char* source, int width, int height, int bit_depth, int compression_level,
 	BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel)
 {
 	ICS* imagefile;
@@ -274,7 +460,13 @@ int SPAD_save2DICSfile(char filepath[], void* buffer, int width, int height, int
 	}
 
 	IcsSetLayout(imagefile, data_type, 2, dims);
-	IcsSetData(imagefile, buffer, buffsize);
+	if (source != NULL) {
+		IcsSetSource(imagefile, source, 0);
+		compression_level = 0;
+	}
+	else {
+		IcsSetData(imagefile, buffer, buffsize);
+	}
 	if (compression_level == 0) {
 		IcsSetCompression(imagefile, IcsCompr_uncompressed, 0);
 	}
@@ -321,4 +513,15 @@ int SPAD_save2DICSfile(char filepath[], void* buffer, int width, int height, int
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+int SPAD_save2DICSfile(char filepath[], void* buffer, int width, int height, int bit_depth, int compression_level,
+	BYTE* header, unsigned long long max_header_bytes, double xy_microns_per_pixel)
+{
+	return save2DICSfile(filepath, buffer, NULL, width, height, bit_depth, compression_level, header, max_header_bytes, xy_microns_per_pixel);
+}
+
+int SPAD_save2DICSheader(char filepath[], char datafilepath[], int width, int height, int bit_depth, double xy_microns_per_pixel)
+{
+	return save2DICSfile(filepath, NULL, datafilepath, width, height, bit_depth, 0, NULL, 0, xy_microns_per_pixel);
+}
@@ -3,7 +3,6 @@
 #ifndef _INTERNAL_H_ 
 #define _INTERNAL_H_
 
-#include <process.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
@@ -27,4 +26,115 @@ extern int integration_count;
 // Predeclarations
 int SPAD_readHeader(BYTE* data, unsigned long long nBytes, ICS* imagefile);
 
+// Corrections
+typedef struct
+{
+    int timebins;
+    double* bin_borders;   // timebins + 1 values
+    int* bin_jindexes;     // timebins + 1 values
+    double* factors;       // timebins + 1 values, bin width factors rebuilt from the compressed calibration
+    int* nonzero_bins;     // timebins values, the bins of the current transient with photons
+    float* band_input;     // timebins values with CORRECTION_BAND_PAD zeros either side
+    float* expected;       // timebins values
+    USHORT* new_Int;       // timebins values
+    void* block;           // the single allocation holding all of the above
+    int borders_detector;  // detector whose bin borders are in bin_borders and bin_jindexes, -1 for none
+    long long skipped_pixels;   // empty transients not corrected, counted per worker
+    long long skipped_bins;     // empty bins not visited
+
+} correction_scratch;
+
+int alloc_correction_scratch(correction_scratch* scratch, int timebins);
+void free_correction_scratch(correction_scratch* scratch);
+void calc_bin_borders(double* bin_width_factors, int nbins, double shift, double scale, double* vals, int* jval);
+int find_nonzero_bins(USHORT* trans, int nbins, int* bins);
+void pack_bin_width_factors_fixed16(double* factors, short* packed, size_t n);
+void unpack_bin_width_factors_fixed16(short* packed, double* factors, size_t n);
+
+// Compressed bin width factors, see SPAD-bin_width_pca.cpp
+void free_bin_width_pca(void);
+void deactivate_bin_width_pca(void);
+int bin_width_pca_active(int width, int height, int timebins);
+void reconstruct_bin_width_factors(int detector, double* factors);
+
+// Memory mapped files, see SPAD-mapped_file.cpp
+typedef struct
+{
+    void* data;
+    size_t size;
+    void* file;      // Windows handles
+    void* mapping;
+
+} spad_mapped_file;
+
+int map_file(const char* path, int copy_on_write, spad_mapped_file* map);
+void unmap_file(spad_mapped_file* map);
+int in_mapped_file(spad_mapped_file* map, const void* p);
+void release_mapped_pages(spad_mapped_file* map, const void* p, size_t n);
+
+// Calibration file, see SPAD-calibration_file.cpp
+void release_calibration_array(double* p);
+
+// ICS files, see SPAD-correct_IO.cpp
+const char* ics_source_name(const char* datapath);
+void resolve_ics_source(ICS* ip, const char* filepath);
+
+// Parallel gzip, see SPAD-gzip.cpp
+int gzip_parallel_active(void);
+int write_gzip_parallel(FILE* fp, const void* data, size_t nBytes, int level, const char* indexpath);
+int read_gzip_parallel(const char* datapath, size_t offset, void* dest, size_t nBytes);
+void gzip_index_path(const char* datapath, char* indexpath);
+
+// Correction plan
+// Above this span the plan gets too big to be worth it, the corrections fall back to calculating borders for each transient
+#define MAX_CORRECTION_PLAN_SPAN 16
+
+void invalidate_correction_plan(void);
+int correction_plan_matches(int width, int height, int timebins);
+int correction_plan_covers(int width, int height, int timebins, int first_row, int nRows);
+int build_correction_plan(int width, int height, int timebins, int first_row, int nRows);
+size_t correction_plan_detector_bytes(void);
+int* correction_plan_first_bins(int detector);
+float* correction_plan_cumulative(int detector);
+
+// SIMD, the kernels are chosen at run time from the cpu and SPAD_set_simd_level
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SPAD_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC allows any intrinsics anywhere, gcc and clang need the functions using them marked
+#if defined(SPAD_X86) && defined(__GNUC__)
+#define SPAD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SPAD_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define SPAD_TARGET_AVX2
+#define SPAD_TARGET_AVX512
+#endif
+
+int simd_level(void);
+
+// Banded form of the plan for the deterministic correction, see SPAD-correction_band.cpp
+#define CORRECTION_BAND_LANES 16        // output bins per block, one AVX-512 register
+#define MAX_CORRECTION_BAND_DIAGONALS 16
+#define CORRECTION_BAND_PAD 32          // zeros either side of the transient, at least LANES + DIAGONALS - 1
+
+int build_correction_band(int width, int height, int timebins, int first_row, int nRows);
+size_t correction_band_detector_bytes(void);
+void free_correction_band(void);
+void band_correction_expected(USHORT* trans, float* output, int nbins, int detector, float* band_input);
+
+// Kernels specialised at compile time for the common numbers of timebins, see SPAD_set_fixed_timebin_kernels.
+// The kernel templates take NBINS, 0 for the generic kernel that uses the nbins given at run time.
+#define SPAD_FIXED_TIMEBINS(X) X(64) X(128) X(256) X(512) X(1024)
+
+// Thread pool
+typedef int (*pool_task_func)(void* param, int task, int worker);
+int pool_run(int nTasks, pool_task_func func, void* param);
+int pool_number_of_workers(void);
+void pool_set_number_of_threads(int nThreads);
+
 #endif // _INTERNAL_H_
@@ -0,0 +1,442 @@
+#include <windows.h>
+#include <iostream>
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+#include <limits.h>
+
+/*
+Banded form of the correction plan for the deterministic correction.
+
+The expected value correction of one transient is a linear map from the input bins to the output bins. As the bin widths
+are all close to 1 each output bin only gets photons from the 2 or 3 input bins around it, shifted by the timebase shift.
+The map is stored by diagonals: the output bins are split into blocks of CORRECTION_BAND_LANES and for each block
+
+    out[j0 + l] = sum over d of weights[d][l] * in[start + d + l]     l = 0..CORRECTION_BAND_LANES-1
+
+Every block has its own start, so the slow drift from the timebase scale does not widen the band. Each diagonal is one
+vector multiply add with no branches, so the correction runs at the speed the transients can be read.
+
+Each detector has one contiguous block:
+    int   starts[nblocks]                                   padded to a multiple of CORRECTION_BAND_LANES
+    W     weights[nblocks][ndiagonals][CORRECTION_BAND_LANES]
+
+The weights W are floats, or with SPAD_PRECISION_FIXED16 unsigned 16 bit fractions of 65535, which halves the memory
+read for every image. The 16 bit weights of each input bin are rounded from its cumulative fractions so they always add
+up to exactly 65535 and no photons are gained or lost by the rounding.
+
+The input is converted to floats in a scratch buffer with CORRECTION_BAND_PAD zeros either side, so blocks at the ends of
+the transient read zeros rather than checking the bounds. Weights for input bins outside the transient are zero anyway.
+*/
+
+BYTE* gCorrectionBand = NULL;
+int gCorrectionBandValid = 0;
+static int gnBandDiagonals = 0;
+static int gnBandBlocks = 0;
+static size_t gBandDetectorBytes = 0;
+static size_t gBandAllocatedBytes = 0;
+static int gBandPrecision = SPAD_PRECISION_FLOAT32;
+static int gSimdLevel = SPAD_SIMD_AUTO;
+static int gBandTimebins = 0;
+static size_t gBandFirstDetector = 0;   // the band is for the same rows as the plan
+int gFixedTimebinKernels = 1;
+
+typedef void (*band_kernel_func)(USHORT* trans, float* out, int nbins, int starts[], void* weights, int nDiagonals, float* in);
+static band_kernel_func gBandKernel = NULL;   // chosen by select_band_kernel
+static void select_band_kernel(void);
+
+static int* band_starts(int detector)
+{
+    return (int*)(gCorrectionBand + (detector - gBandFirstDetector) * gBandDetectorBytes);
+}
+
+static void* band_weights(int detector)
+{
+    int nStarts = (gnBandBlocks + CORRECTION_BAND_LANES - 1) / CORRECTION_BAND_LANES * CORRECTION_BAND_LANES;
+    return (void*)(gCorrectionBand + (detector - gBandFirstDetector) * gBandDetectorBytes + nStarts * sizeof(int));
+}
+
+size_t correction_band_detector_bytes(void)
+{
+    return (gCorrectionBandValid ? gBandDetectorBytes : 0);
+}
+
+void free_correction_band(void)
+{
+    free(gCorrectionBand);
+    gCorrectionBand = NULL;
+    gCorrectionBandValid = 0;
+    gnBandDiagonals = 0;
+    gnBandBlocks = 0;
+    gBandDetectorBytes = 0;
+    gBandAllocatedBytes = 0;
+}
+
+// Range of (i - l) over the input bins i giving photons to the output bins of each block, from the plan of one detector
+static void band_block_ranges(int timebins, int* first_bins, float* cumulative, int span, int* lo, int* hi)
+{
+    int nBlocks = (timebins + CORRECTION_BAND_LANES - 1) / CORRECTION_BAND_LANES;
+
+    for (int b = 0; b < nBlocks; b++) {
+        lo[b] = INT_MAX;
+        hi[b] = INT_MIN;
+    }
+
+    for (int i = 0; i < timebins; i++) {
+        float* c = cumulative + i * span;
+        float done = 0.0f;
+        for (int k = 0; k < span; k++) {
+            int j = first_bins[i] + k;
+            float f = c[k] - done;
+            done = c[k];
+            if (f <= 0.0f || j < 0 || j >= timebins) continue;
+            int b = j / CORRECTION_BAND_LANES;
+            int d = i - (j - b * CORRECTION_BAND_LANES);
+            if (d < lo[b]) lo[b] = d;
+            if (d > hi[b]) hi[b] = d;
+        }
+    }
+}
+
+int build_correction_band(int width, int height, int timebins, int first_row, int nRows)
+{
+    extern int gnCorrectionPlanSpan;
+    int first = first_row * width, stop = (first_row + nRows) * width;   // detectors in the band
+    int span = gnCorrectionPlanSpan;
+    int nBlocks = (timebins + CORRECTION_BAND_LANES - 1) / CORRECTION_BAND_LANES;
+
+    gCorrectionBandValid = 0;
+
+    if (!correction_plan_covers(width, height, timebins, first_row, nRows)) return(-1);
+
+    int* lo = (int*)malloc(2 * nBlocks * sizeof(int));
+    if (!lo) return(-2);
+    int* hi = lo + nBlocks;
+
+    // First pass, find the number of diagonals needed
+    // A start is i - l for some input bin i and lane l, so reads stay within LANES + DIAGONALS - 1 of the transient
+    int nDiagonals = 1;
+    for (int k = first; k < stop; k++) {
+        band_block_ranges(timebins, correction_plan_first_bins(k), correction_plan_cumulative(k), span, lo, hi);
+        for (int b = 0; b < nBlocks; b++) {
+            if (lo[b] > hi[b]) continue;   // no photons arrive in this block
+            int n = hi[b] - lo[b] + 1;
+            if (n > nDiagonals) nDiagonals = n;
+        }
+        if (nDiagonals > MAX_CORRECTION_BAND_DIAGONALS) {
+            free(lo);
+            return(-3);
+        }
+    }
+
+    // Get space, reusing the old band if it is big enough
+    int nStarts = (nBlocks + CORRECTION_BAND_LANES - 1) / CORRECTION_BAND_LANES * CORRECTION_BAND_LANES;
+    size_t weight_bytes = (gBandPrecision == SPAD_PRECISION_FIXED16) ? sizeof(USHORT) : sizeof(float);
+    size_t detector_bytes = nStarts * sizeof(int) + (size_t)nBlocks * nDiagonals * CORRECTION_BAND_LANES * weight_bytes;
+    size_t band_bytes = detector_bytes * (stop - first);
+    if (!gCorrectionBand || band_bytes > gBandAllocatedBytes) {
+        free(gCorrectionBand);
+        gCorrectionBand = (BYTE*)malloc(band_bytes);
+        gBandAllocatedBytes = band_bytes;
+    }
+    if (!gCorrectionBand) {
+        printf("Warning: Could not allocate banded correction plan.\n");
+        free(lo);
+        free_correction_band();
+        return(-2);
+    }
+
+    gBandDetectorBytes = detector_bytes;
+    gnBandDiagonals = nDiagonals;
+    gnBandBlocks = nBlocks;
+    gBandFirstDetector = first;
+
+    // Second pass, scatter the fractions of each input bin onto the diagonals
+    for (int k = first; k < stop; k++) {
+        int* first_bins = correction_plan_first_bins(k);
+        float* cumulative = correction_plan_cumulative(k);
+        int* starts = band_starts(k);
+        float* weights = (float*)band_weights(k);
+        USHORT* fixed_weights = (USHORT*)weights;
+
+        band_block_ranges(timebins, first_bins, cumulative, span, lo, hi);
+
+        for (int b = 0; b < nBlocks; b++) {
+            if (lo[b] > hi[b]) lo[b] = b * CORRECTION_BAND_LANES;   // empty block, any start inside the transient will do
+            starts[b] = lo[b];
+        }
+        memset(weights, 0, (size_t)nBlocks * nDiagonals * CORRECTION_BAND_LANES * weight_bytes);
+
+        for (int i = 0; i < timebins; i++) {
+            float* c = cumulative + i * span;
+            float done = 0.0f;
+            int fixed_done = 0;
+            for (int s = 0; s < span; s++) {
+                int j = first_bins[i] + s;
+                float f = c[s] - done;
+                int fixed = (int)(c[s] * 65535.0f + 0.5f) - fixed_done;
+                done = c[s];
+                fixed_done += fixed;
+                if (f <= 0.0f || j < 0 || j >= timebins) continue;
+                int b = j / CORRECTION_BAND_LANES;
+                int l = j - b * CORRECTION_BAND_LANES;
+                int d = i - l - starts[b];
+                size_t index = ((size_t)b * nDiagonals + d) * CORRECTION_BAND_LANES + l;
+                if (gBandPrecision == SPAD_PRECISION_FIXED16)
+                    fixed_weights[index] = (USHORT)fixed;
+                else
+                    weights[index] = f;
+            }
+        }
+    }
+
+    free(lo);
+
+    gBandTimebins = timebins;
+    select_band_kernel();   // pick the best the cpu can do for this size, here before any threads use it
+
+    gCorrectionBandValid = 1;
+
+    return(0);
+}
+
+
+/// Kernels, out gets nbins values, in must have CORRECTION_BAND_PAD readable values either side of the nbins.
+/// With NBINS > 0 the kernel only works for that many bins and the loops have fixed trip counts, so the compiler unrolls
+/// the conversion of the transient and, as the sizes are multiples of CORRECTION_BAND_LANES, drops the last partial block.
+
+static inline float band_weight_scale(float*) { return 1.0f; }
+static inline float band_weight_scale(USHORT*) { return 1.0f / 65535.0f; }
+
+template <typename W, int NBINS>
+static void band_kernel_scalar(USHORT* trans, float* out, int nbins, int starts[], void* weights, int nDiagonals, float* in)
+{
+    if (NBINS) nbins = NBINS;
+    float scale = band_weight_scale((W*)weights);
+
+    for (int i = 0; i < nbins; i++)
+        in[i] = (float)trans[i];
+
+    for (int j0 = 0, b = 0; j0 < nbins; j0 += CORRECTION_BAND_LANES, b++) {
+        float acc[CORRECTION_BAND_LANES] = { 0 };
+        W* w = (W*)weights + (size_t)b * nDiagonals * CORRECTION_BAND_LANES;
+
+        for (int d = 0; d < nDiagonals; d++) {
+            float* x = in + starts[b] + d;
+            for (int l = 0; l < CORRECTION_BAND_LANES; l++)
+                acc[l] += (float)w[l] * x[l];
+            w += CORRECTION_BAND_LANES;
+        }
+
+        int n = min(CORRECTION_BAND_LANES, nbins - j0);
+        for (int l = 0; l < n; l++)
+            out[j0 + l] = acc[l] * scale;
+    }
+}
+
+#ifdef SPAD_X86
+
+SPAD_TARGET_AVX2 static inline __m256 band_load8(const float* w) { return _mm256_loadu_ps(w); }
+SPAD_TARGET_AVX2 static inline __m256 band_load8(const USHORT* w) { return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)w))); }
+
+template <typename W, int NBINS>
+SPAD_TARGET_AVX2 static void band_kernel_avx2(USHORT* trans, float* out, int nbins, int starts[], void* weights, int nDiagonals, float* in)
+{
+    if (NBINS) nbins = NBINS;
+    __m256 scale = _mm256_set1_ps(band_weight_scale((W*)weights));
+
+    int i = 0;
+    for (; i + 8 <= nbins; i += 8) {
+        __m128i t = _mm_loadu_si128((__m128i*)(trans + i));
+        _mm256_storeu_ps(in + i, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(t)));
+    }
+    for (; i < nbins; i++)
+        in[i] = (float)trans[i];
+
+    for (int j0 = 0, b = 0; j0 < nbins; j0 += CORRECTION_BAND_LANES, b++) {
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        W* w = (W*)weights + (size_t)b * nDiagonals * CORRECTION_BAND_LANES;
+        float* x = in + starts[b];
+
+        for (int d = 0; d < nDiagonals; d++) {
+            acc0 = _mm256_fmadd_ps(band_load8(w), _mm256_loadu_ps(x), acc0);
+            acc1 = _mm256_fmadd_ps(band_load8(w + 8), _mm256_loadu_ps(x + 8), acc1);
+            w += CORRECTION_BAND_LANES;
+            x++;
+        }
+        acc0 = _mm256_mul_ps(acc0, scale);
+        acc1 = _mm256_mul_ps(acc1, scale);
+
+        if (j0 + CORRECTION_BAND_LANES <= nbins) {
+            _mm256_storeu_ps(out + j0, acc0);
+            _mm256_storeu_ps(out + j0 + 8, acc1);
+        }
+        else {  // last partial block
+            float acc[CORRECTION_BAND_LANES];
+            _mm256_storeu_ps(acc, acc0);
+            _mm256_storeu_ps(acc + 8, acc1);
+            for (int l = 0; l < nbins - j0; l++)
+                out[j0 + l] = acc[l];
+        }
+    }
+}
+
+SPAD_TARGET_AVX512 static inline __m512 band_load16(const float* w) { return _mm512_loadu_ps(w); }
+SPAD_TARGET_AVX512 static inline __m512 band_load16(const USHORT* w) { return _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i*)w))); }
+
+template <typename W, int NBINS>
+SPAD_TARGET_AVX512 static void band_kernel_avx512(USHORT* trans, float* out, int nbins, int starts[], void* weights, int nDiagonals, float* in)
+{
+    if (NBINS) nbins = NBINS;
+    __m512 scale = _mm512_set1_ps(band_weight_scale((W*)weights));
+
+    int i = 0;
+    for (; i + 16 <= nbins; i += 16) {
+        __m256i t = _mm256_loadu_si256((__m256i*)(trans + i));
+        _mm512_storeu_ps(in + i, _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(t)));
+    }
+    for (; i < nbins; i++)
+        in[i] = (float)trans[i];
+
+    for (int j0 = 0, b = 0; j0 < nbins; j0 += CORRECTION_BAND_LANES, b++) {
+        __m512 acc = _mm512_setzero_ps();
+        W* w = (W*)weights + (size_t)b * nDiagonals * CORRECTION_BAND_LANES;
+        float* x = in + starts[b];
+
+        for (int d = 0; d < nDiagonals; d++) {
+            acc = _mm512_fmadd_ps(band_load16(w), _mm512_loadu_ps(x), acc);
+            w += CORRECTION_BAND_LANES;
+            x++;
+        }
+        acc = _mm512_mul_ps(acc, scale);
+
+        int n = min(CORRECTION_BAND_LANES, nbins - j0);
+        _mm512_mask_storeu_ps(out + j0, (__mmask16)((1u << n) - 1), acc);
+    }
+}
+
+static int cpu_simd_level(void)
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7) return(SPAD_SIMD_SCALAR);
+
+    __cpuid(regs, 1);
+    int fma = (regs[2] >> 12) & 1;
+    int osxsave = (regs[2] >> 27) & 1;
+    if (!osxsave) return(SPAD_SIMD_SCALAR);
+    unsigned long long xcr0 = _xgetbv(0);
+
+    __cpuidex(regs, 7, 0);
+    int avx2 = (regs[1] >> 5) & 1;
+    int avx512f = (regs[1] >> 16) & 1;
+
+    if (avx512f && (xcr0 & 0xE6) == 0xE6) return(SPAD_SIMD_AVX512);   // OS saves the zmm and mask registers
+    if (avx2 && fma && (xcr0 & 0x6) == 0x6) return(SPAD_SIMD_AVX2);
+    return(SPAD_SIMD_SCALAR);
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return(SPAD_SIMD_AVX512);
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return(SPAD_SIMD_AVX2);
+    return(SPAD_SIMD_SCALAR);
+#endif
+}
+
+#else
+
+static int cpu_simd_level(void)
+{
+    return(SPAD_SIMD_SCALAR);
+}
+
+#endif // SPAD_X86
+
+// The level set by SPAD_set_simd_level, or the best the cpu can do
+int simd_level(void)
+{
+    int cpu = cpu_simd_level();
+
+    if (gSimdLevel == SPAD_SIMD_AUTO || gSimdLevel > cpu) return(cpu);
+    return(gSimdLevel);
+}
+
+// Kernel for the simd level and weight precision
+template <int NBINS>
+static band_kernel_func band_kernel(int level, int fixed)
+{
+    switch (level) {
+#ifdef SPAD_X86
+    case SPAD_SIMD_AVX512:
+        return fixed ? band_kernel_avx512<USHORT, NBINS> : band_kernel_avx512<float, NBINS>;
+    case SPAD_SIMD_AVX2:
+        return fixed ? band_kernel_avx2<USHORT, NBINS> : band_kernel_avx2<float, NBINS>;
+#endif
+    default:
+        return fixed ? band_kernel_scalar<USHORT, NBINS> : band_kernel_scalar<float, NBINS>;
+    }
+}
+
+// and the number of timebins of the band, if there is a kernel for it
+static void select_band_kernel(void)
+{
+    int cpu = cpu_simd_level();
+    int level = gSimdLevel;
+    int fixed = (gBandPrecision == SPAD_PRECISION_FIXED16);
+
+    if (level == SPAD_SIMD_AUTO || level > cpu) level = cpu;
+
+    switch (gFixedTimebinKernels ? gBandTimebins : 0) {
+#define BAND_KERNEL_CASE(n) case n: gBandKernel = band_kernel<n>(level, fixed); break;
+    SPAD_FIXED_TIMEBINS(BAND_KERNEL_CASE)
+#undef BAND_KERNEL_CASE
+    default:
+        gBandKernel = band_kernel<0>(level, fixed);
+        break;
+    }
+}
+
+int SPAD_set_simd_level(int level)
+{
+    int cpu = cpu_simd_level();
+
+    if (level == SPAD_SIMD_AUTO || level > cpu) level = cpu;
+    if (level < SPAD_SIMD_SCALAR) level = SPAD_SIMD_SCALAR;
+#ifndef SPAD_X86
+    level = SPAD_SIMD_SCALAR;
+#endif
+
+    gSimdLevel = level;
+    select_band_kernel();
+
+    return(level);
+}
+
+int SPAD_set_fixed_timebin_kernels(int enable)
+{
+    gFixedTimebinKernels = (enable != 0);
+    select_band_kernel();
+
+    return(0);
+}
+
+int SPAD_set_correction_precision(int precision)
+{
+    if (precision != SPAD_PRECISION_FLOAT32 && precision != SPAD_PRECISION_FIXED16) {
+        printf("ERROR: Unknown correction precision %d.\n", precision);
+        return(-1);
+    }
+
+    if (precision != gBandPrecision) {
+        gBandPrecision = precision;
+        invalidate_correction_plan();   // rebuilt with the new weights on next use
+        select_band_kernel();
+    }
+
+    return(0);
+}
+
+void band_correction_expected(USHORT* trans, float* output, int nbins, int detector, float* band_input)
+{
+    gBandKernel(trans, output, nbins, band_starts(detector), band_weights(detector), gnBandDiagonals, band_input);
+}
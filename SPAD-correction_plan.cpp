@@ -0,0 +1,210 @@
+#include <windows.h>
+#include <iostream>
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+
+extern double* gBinWidthFactors;
+extern int gnBinWidthFactors;
+extern double* gTimebaseShifts;
+extern int gnTimebaseShifts;
+extern double* gTimebaseScales;
+extern int gnTimebaseScales;
+extern int gCorrectionBandValid;
+extern int gBinWidthPCAActive;
+
+/*
+The correction plan holds, for every detector, how the photons of each input bin are split between the output bins.
+It only depends on the bin width factors, timebase shifts and timebase scales, so it is built once and then every image
+corrected with the same calibration just streams its photon counts against it.
+It can also be built for a band of rows only, so correcting an image a slab of rows at a time needs a plan the size of
+the slab and not of the image.
+
+Each detector has one contiguous block:
+    int   first_bins[timebins]          output bin receiving the first part of input bin i (may be outside 0..timebins-1)
+    float cumulative[timebins * span]   cumulative fraction of input bin i that has been given to output bins first_bins[i]..first_bins[i]+k
+
+The last used cumulative fraction of each input bin is exactly 1.0 and the unused entries are padded with 1.0.
+Input bins with no width have all fractions 0.0 and their photons are dropped, as in combined_correction.
+*/
+
+// Also used by corrections
+BYTE* gCorrectionPlan = NULL;
+int gCorrectionPlanValid = 0;
+int gnCorrectionPlanSpan = 0;
+size_t gCorrectionPlanDetectorBytes = 0;
+static int gPlanWidth = 0, gPlanHeight = 0, gPlanTimebins = 0;
+static int gPlanFirstRow = 0, gPlanRows = 0;    // rows of the image the plan is for
+static size_t gPlanAllocatedBytes = 0;
+
+void invalidate_correction_plan(void)
+{
+    gCorrectionPlanValid = 0;
+    gCorrectionBandValid = 0;
+}
+
+int correction_plan_matches(int width, int height, int timebins)
+{
+    return (correction_plan_covers(width, height, timebins, 0, height));
+}
+
+int correction_plan_covers(int width, int height, int timebins, int first_row, int nRows)
+{
+    return (gCorrectionPlanValid && gPlanWidth == width && gPlanHeight == height && gPlanTimebins == timebins &&
+        first_row >= gPlanFirstRow && first_row + nRows <= gPlanFirstRow + gPlanRows);
+}
+
+size_t correction_plan_detector_bytes(void)
+{
+    return (gCorrectionPlanValid ? gCorrectionPlanDetectorBytes : 0);
+}
+
+// detector is the index in the whole image
+int* correction_plan_first_bins(int detector)
+{
+    size_t k = detector - (size_t)gPlanFirstRow * gPlanWidth;
+    return (int*)(gCorrectionPlan + k * gCorrectionPlanDetectorBytes);
+}
+
+float* correction_plan_cumulative(int detector)
+{
+    size_t k = detector - (size_t)gPlanFirstRow * gPlanWidth;
+    return (float*)(gCorrectionPlan + k * gCorrectionPlanDetectorBytes + gPlanTimebins * sizeof(int));
+}
+
+void SPAD_free_correction_plan(void)
+{
+    free(gCorrectionPlan);
+    gCorrectionPlan = NULL;
+    gCorrectionPlanValid = 0;
+    free_correction_band();
+    gnCorrectionPlanSpan = 0;
+    gCorrectionPlanDetectorBytes = 0;
+    gPlanWidth = gPlanHeight = gPlanTimebins = 0;
+    gPlanFirstRow = gPlanRows = 0;
+    gPlanAllocatedBytes = 0;
+}
+
+int SPAD_build_correction_plan(int width, int height, int timebins)
+{
+    return(build_correction_plan(width, height, timebins, 0, height));
+}
+
+// Plan for rows first_row to first_row + nRows - 1 of a width x height image
+int build_correction_plan(int width, int height, int timebins, int first_row, int nRows)
+{
+    int nPixels = width * height;
+    int first = first_row * width, stop = (first_row + nRows) * width;   // detectors in the plan
+
+    if (gBinWidthPCAActive) {   // the point of compressing the factors is not to have anything this size
+        SPAD_free_correction_plan();
+        return(-4);
+    }
+
+    if (first_row < 0 || nRows < 1 || first_row + nRows > height) {
+        printf("ERROR: Rows %d to %d are not in a %d row image, cannot build correction plan.\n", first_row, first_row + nRows - 1, height);
+        return(-1);
+    }
+
+    if (!gBinWidthFactors) SPAD_reset_bin_width_factors(width, height, timebins);
+    if (!gTimebaseShifts) SPAD_reset_timebase_shifts(width, height, timebins);
+    if (!gTimebaseScales) SPAD_reset_timebase_scales(width, height);
+
+    if (gnBinWidthFactors != nPixels * timebins || gnTimebaseShifts != nPixels || gnTimebaseScales != nPixels) {
+        printf("ERROR: Calibration does not match a %d x %d x %d image, cannot build correction plan.\n", width, height, timebins);
+        return(-1);
+    }
+
+    correction_scratch scratch;
+    if (alloc_correction_scratch(&scratch, timebins) < 0) return(-2);
+
+    // First pass, find the largest number of output bins any input bin is split between
+    int span = 1;
+    double* bin_width_factors = gBinWidthFactors + (size_t)first * timebins;
+    for (int k = first; k < stop; k++) {
+        calc_bin_borders(bin_width_factors, timebins, gTimebaseShifts[k], gTimebaseScales[k], scratch.bin_borders, scratch.bin_jindexes);
+        for (int i = 0; i < timebins; i++) {
+            if (scratch.bin_borders[i + 1] - scratch.bin_borders[i] <= 0.0) continue;
+            int s = scratch.bin_jindexes[i + 1] - scratch.bin_jindexes[i] + 1;
+            if (s > span) span = s;
+        }
+        bin_width_factors += timebins;
+    }
+
+    if (span > MAX_CORRECTION_PLAN_SPAN) {
+        printf("Warning: Input bins span up to %d output bins, correction plan not used.\n", span);
+        free_correction_scratch(&scratch);
+        SPAD_free_correction_plan();
+        return(-3);
+    }
+
+    // Get space, reusing the old plan if it is big enough
+    size_t detector_bytes = timebins * sizeof(int) + (size_t)timebins * span * sizeof(float);
+    size_t plan_bytes = detector_bytes * (stop - first);
+    if (!gCorrectionPlan || plan_bytes > gPlanAllocatedBytes) {
+        free(gCorrectionPlan);
+        gCorrectionPlan = (BYTE*)malloc(plan_bytes);
+        gPlanAllocatedBytes = plan_bytes;
+    }
+    if (!gCorrectionPlan) {
+        printf("ERROR: Could not allocate correction plan.\n");
+        free_correction_scratch(&scratch);
+        SPAD_free_correction_plan();
+        return(-2);
+    }
+
+    gCorrectionPlanDetectorBytes = detector_bytes;
+    gnCorrectionPlanSpan = span;
+    gPlanWidth = width;
+    gPlanHeight = height;
+    gPlanTimebins = timebins;
+    gPlanFirstRow = first_row;
+    gPlanRows = nRows;
+
+    // Second pass, fill the cumulative fractions, same splitting as combined_correction
+    bin_width_factors = gBinWidthFactors + (size_t)first * timebins;
+    for (int k = first; k < stop; k++) {
+        int* first_bins = correction_plan_first_bins(k);
+        float* cumulative = correction_plan_cumulative(k);
+        double* bin_borders = scratch.bin_borders;
+        int* bin_jindexes = scratch.bin_jindexes;
+
+        calc_bin_borders(bin_width_factors, timebins, gTimebaseShifts[k], gTimebaseScales[k], bin_borders, bin_jindexes);
+
+        for (int i = 0; i < timebins; i++) {
+            float* c = cumulative + i * span;
+            double b1 = bin_borders[i];
+            double b2 = bin_borders[i + 1];
+            double t = b2 - b1;
+            int bj1 = bin_jindexes[i];
+            int bj2 = bin_jindexes[i + 1];
+
+            first_bins[i] = bj1;
+
+            if (t <= 0.0) {   // bin i has no width, photons are lost
+                for (int s = 0; s < span; s++) c[s] = 0.0f;
+                continue;
+            }
+
+            double f = min(1 - (b1 - bj1), t);  // pre
+            c[0] = (float)(f / t);
+            for (int s = 1; s < bj2 - bj1; s++) {   // whole bins
+                f += 1.0;
+                c[s] = (float)(f / t);
+            }
+            for (int s = bj2 - bj1; s < span; s++) {  // remainder and padding
+                c[s] = 1.0f;
+            }
+        }
+
+        bin_width_factors += timebins;
+    }
+
+    free_correction_scratch(&scratch);
+
+    gCorrectionPlanValid = 1;
+
+    // Banded form for the deterministic correction, if it does not fit that correction uses the plan
+    build_correction_band(width, height, timebins, first_row, nRows);
+
+    return(0);
+}
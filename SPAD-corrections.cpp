@@ -4,6 +4,7 @@
 #include "SPAD-correct_internal.h"
 #include <random>
 #include <cmath> 
+#include "SPAD-random.h"
 
 extern double* gBinWidthFactors;
 extern int gnBinWidthFactors;
@@ -11,57 +12,33 @@ extern double* gTimebaseShifts;
 extern int gnTimebaseShifts;
 extern double* gTimebaseScales;
 extern int gnTimebaseScales;
-
-// MSVC Binomial random number generation, 39 ms for 16x16
-
+extern int gCorrectionPlanValid;
+extern int gnCorrectionPlanSpan;
+extern int gCorrectionBandValid;
+extern int gBinWidthPCAActive;
+extern int gFixedTimebinKernels;
+
+// Seed for the random streams, keyed with the pixel and bin, see SPAD-random.h
+static unsigned long long gRandomSeed = 0;
+static int gRandomSeedSet = 0;
+static unsigned long long gImageIndex = 0;   // image the next correction starts at, see SPAD_set_image_index
 static std::random_device rd;
-static std::mt19937_64 gen(rd());
-using BinomialDist = std::binomial_distribution<>;
-
-int MSVC_rbinom(int n, double p)
-{
-    if (p <= 0.0) return(0);
-    if (p >= 1.0) return(n);
-    BinomialDist rand_binom(n, p);
-    return rand_binom(gen);
-}
-
 
-// Brute force photon by photon, 17 ms for 16x16
-// Speed depends on n with large n slower
-///*
-int rbinom(int n, double p)
+// Seed of the streams for image number image of the current call, counted from gImageIndex.
+// With a seed set each image gets its own streams, the seed mixed with the image index (splitmix64),
+// image index 0 keeps the seed as it is.
+unsigned long long get_random_seed(int image)
 {
-    if (p <= 0.0) return(0);
-    if (p >= 1.0) return(n);
-
-//    if (n > 5) return(MSVC_rbinom(n, p)); ????  Makes it 2x slower with my data
-    if (n > 100) return(MSVC_rbinom(n, p));
-
-    int x = 0;
-    int P = (int)(p * RAND_MAX);
-
-    for (int i = 0; i < n; i++) {
-        if (rand() < P) {
-            x++;
-        }
+    if (gRandomSeedSet) {
+        unsigned long long z = gImageIndex + image;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return(gRandomSeed ^ z ^ (z >> 31));
     }
 
-    return (x);
-}
-//*/
-
-// Non random alternative for comparison with redistribution of photons fractionally
-// Should return n*p
-// But result needs to remain integer for saving back to uint16
-// To use, uncomment and comment the real version.
-// This is better tested in R.
-/*
-int rbinom(int n, double p)
-{
-    return ((int)((double)n * p));
+    // Different every time if no seed was given
+    return (((unsigned long long)rd() << 32) | rd());
 }
-*/
 
 /*
 Set functions for bin_width_factors (timebins * detectors) and time shifts (per detector)
@@ -79,15 +56,15 @@ N = photons passing i to j
 
 
 */
-USHORT* combined_correction(USHORT* trans, int nbins, 
-    double bin_borders[], int bin_jindexes[])
+void combined_correction(USHORT* trans, int nbins, int bins[], int nNonzero,
+    double bin_borders[], int bin_jindexes[], USHORT* new_Int, unsigned long long seed, int detector)
 {
-    USHORT* new_Int;
+    spad_rng rng;
 
-    new_Int = (USHORT*)calloc(nbins, sizeof(USHORT));
-    if (new_Int == NULL) return NULL;
+    memset(new_Int, 0, nbins * sizeof(USHORT));
 
-    for (int i = 0; i < nbins; i++) {
+    for (int b = 0; b < nNonzero; b++) {   // only the bins with photons
+        int i = bins[b];
         int j, N;
         double f, p;
 
@@ -98,15 +75,16 @@ USHORT* combined_correction(USHORT* trans, int nbins,
         if (t <= 0.0) continue;    // bin i has no width (!)
 
         int n = (int)trans[i];
-        if (n <= 0) continue;      // bin i has no photons
 
         int bj1 = bin_jindexes[i];
         int bj2 = bin_jindexes[i+1];  // by design it has nbins+1 values
 
+        spad_rng_init(&rng, seed, detector, i);   // own stream for this bin
+
         j = bj1;
         f = min(1 - (b1 - bj1), t); // pre, not more than what is available
         p = f / t;
-        N = rbinom(n, p);
+        N = rbinom(n, p, &rng);
         if(j>=0 && j<nbins)
             new_Int[j] += N;
         j = j + 1;
@@ -118,7 +96,7 @@ USHORT* combined_correction(USHORT* trans, int nbins,
                 while (j < bj2) {
                     f = 1; // whole
                     p = f / t;
-                    N = rbinom(n, p);
+                    N = rbinom(n, p, &rng);
                     if (j >= 0 && j < nbins)
                         new_Int[j] += N;
                     j = j + 1;
@@ -134,93 +112,495 @@ USHORT* combined_correction(USHORT* trans, int nbins,
             new_Int[j] += N;
 
     }
-          
-    return(new_Int);
 }
 
+/*
+Deterministic version of combined_correction, each output bin gets the expected number of photons as a float.
+Used when there is no correction plan.
+*/
+void combined_correction_expected(USHORT* trans, int nbins, int bins[], int nNonzero,
+    double bin_borders[], int bin_jindexes[], float* new_Float)
+{
+    memset(new_Float, 0, nbins * sizeof(float));
+
+    for (int b = 0; b < nNonzero; b++) {
+        int i = bins[b];
+        double b1 = bin_borders[i];
+        double b2 = bin_borders[i + 1];
+
+        double t = b2 - b1;
+        if (t <= 0.0) continue;    // bin i has no width (!)
+
+        double n = (double)trans[i];
+
+        int bj1 = bin_jindexes[i];
+        int bj2 = bin_jindexes[i + 1];
+
+        double f = min(1 - (b1 - bj1), t); // pre
+        if (bj1 >= 0 && bj1 < nbins)
+            new_Float[bj1] += (float)(n * f / t);
+
+        for (int j = max(bj1 + 1, 0); j < min(bj2, nbins); j++)  // whole
+            new_Float[j] += (float)(n / t);
+
+        if (bj2 > bj1 && bj2 >= 0 && bj2 < nbins)   // remainder
+            new_Float[bj2] += (float)(n * (b2 - bj2) / t);
+    }
+}
+
+/// Scratch space for correcting one transient at a time (correction_scratch in SPAD-correct_internal.h).
+/// Allocated once per thread as a single block, sized for the number of timebins, and reused for every transient
+/// so that the per pixel loop does not touch the heap.
 
-int correct_transient(USHORT* trans, int nbins, double bin_borders[], int bin_jindexes[])
+int alloc_correction_scratch(correction_scratch* scratch, int timebins)
 {
-    if (trans == NULL) return(-1);
+    size_t nvals = (size_t)timebins + 1;
+    size_t nband = (size_t)timebins + 2 * CORRECTION_BAND_PAD;
+    size_t bytes = 2 * nvals * sizeof(double) + (nvals + timebins) * sizeof(int) + (nband + timebins) * sizeof(float) + timebins * sizeof(USHORT);
+
+    scratch->block = malloc(bytes);
+    if (scratch->block == NULL) return(-1);
+
+    // doubles first so everything stays aligned
+    scratch->bin_borders = (double*)scratch->block;
+    scratch->factors = scratch->bin_borders + nvals;
+    scratch->bin_jindexes = (int*)(scratch->factors + nvals);
+    scratch->nonzero_bins = scratch->bin_jindexes + nvals;
+    scratch->band_input = (float*)(scratch->nonzero_bins + timebins) + CORRECTION_BAND_PAD;
+    scratch->expected = scratch->band_input + timebins + CORRECTION_BAND_PAD;
+    scratch->new_Int = (USHORT*)(scratch->expected + timebins);
+    scratch->timebins = timebins;
+    scratch->borders_detector = -1;
+    scratch->skipped_pixels = 0;
+    scratch->skipped_bins = 0;
+
+    // The band kernels read either side of the transient, these pads are never written so stay zero
+    memset(scratch->band_input - CORRECTION_BAND_PAD, 0, nband * sizeof(float));
 
-    USHORT* signal = combined_correction(trans, nbins, bin_borders, bin_jindexes);
+    return(0);
+}
 
-    if (signal == NULL) {
-        return(-2);
+void free_correction_scratch(correction_scratch* scratch)
+{
+    free(scratch->block);
+    scratch->block = NULL;
+    scratch->bin_borders = NULL;
+    scratch->bin_jindexes = NULL;
+    scratch->factors = NULL;
+    scratch->nonzero_bins = NULL;
+    scratch->band_input = NULL;
+    scratch->expected = NULL;
+    scratch->new_Int = NULL;
+}
+
+/*
+Same splitting as combined_correction but using the precalculated correction plan.
+The conditional probability of a photon going to output bin first_bin+k, given it did not go to an earlier one, 
+comes from the cumulative fractions: (c[k] - c[k-1]) / (1 - c[k-1]).
+*/
+void plan_correction(USHORT* trans, int nbins, int bins[], int nNonzero, int first_bins[], float cumulative[], int span, USHORT* new_Int,
+    unsigned long long seed, int detector)
+{
+    spad_rng rng;
+
+    memset(new_Int, 0, nbins * sizeof(USHORT));
+
+    for (int b = 0; b < nNonzero; b++) {
+        int i = bins[b];
+        int n = (int)trans[i];
+
+        int j = first_bins[i];
+        float* c = cumulative + i * span;
+        double done = 0.0;         // fraction of bin i already handed out
+
+        spad_rng_init(&rng, seed, detector, i);   // own stream for this bin
+
+        for (int k = 0; k < span && n > 0; k++, j++) {
+            double p = ((double)c[k] - done) / (1.0 - done);
+            int N = rbinom(n, p, &rng);
+            if (j >= 0 && j < nbins)
+                new_Int[j] += N;
+            n = n - N;
+            done = c[k];
+        }
+    }
+}
+
+/*
+Alternative to plan_correction that treats the split of each input bin as one multinomial draw over its fractions.
+For the usual low photon counts each photon takes one 32 bit random number, compared with the cumulative fractions
+as integer thresholds, so a bin split between k output bins costs n random numbers rather than k-1 binomials.
+Above MULTINOMIAL_PHOTON_MAX_N photons it is cheaper to draw the multinomial as a chain of binomials.
+*/
+#define MULTINOMIAL_PHOTON_MAX_N 4
+
+void plan_correction_multinomial(USHORT* trans, int nbins, int bins[], int nNonzero, int first_bins[], float cumulative[], int span, USHORT* new_Int,
+    unsigned long long seed, int detector)
+{
+    spad_rng rng;
+    unsigned int thresholds[MAX_CORRECTION_PLAN_SPAN];
+    int counts[MAX_CORRECTION_PLAN_SPAN];
+
+    memset(new_Int, 0, nbins * sizeof(USHORT));
+
+    for (int b = 0; b < nNonzero; b++) {
+        int i = bins[b];
+        int n = (int)trans[i];
+
+        float* c = cumulative + i * span;
+        if (c[span - 1] <= 0.0f) continue;  // bin i has no width, photons are lost
+
+        // last output bin that receives photons, its cumulative fraction is 1.0
+        int last = 0;
+        while (last < span - 1 && c[last] < 1.0f) last++;
+
+        spad_rng_init(&rng, seed, detector, i);   // own stream for this bin
+
+        for (int k = 0; k <= last; k++) counts[k] = 0;
+
+        if (n <= MULTINOMIAL_PHOTON_MAX_N) {
+            for (int k = 0; k < last; k++)
+                thresholds[k] = (unsigned int)((double)c[k] * 4294967296.0);  // c < 1 so this fits
+
+            for (int photon = 0; photon < n; photon++) {
+                unsigned int u = spad_rng_next(&rng);
+                int k = 0;
+                while (k < last && u >= thresholds[k]) k++;
+                counts[k]++;
+            }
+        }
+        else {
+            double done = 0.0;
+            for (int k = 0; k < last; k++) {
+                double p = ((double)c[k] - done) / (1.0 - done);
+                counts[k] = rbinom(n, p, &rng);
+                n = n - counts[k];
+                done = c[k];
+            }
+            counts[last] = n;
+        }
+
+        int j = first_bins[i];
+        for (int k = 0; k <= last; k++, j++) {
+            if (j >= 0 && j < nbins)
+                new_Int[j] += counts[k];
+        }
+    }
+}
+
+/*
+Deterministic correction with the plan. Each output bin gets the expected number of photons, n * fraction, as a float.
+This is the product of the banded correction matrix of the detector with the transient, but only visiting the bins with
+photons, so for sparse transients it is much less work than the band kernels.
+*/
+void plan_correction_expected(USHORT* trans, int nbins, int bins[], int nNonzero, int first_bins[], float cumulative[], int span, float* new_Float)
+{
+    memset(new_Float, 0, nbins * sizeof(float));
+
+    for (int b = 0; b < nNonzero; b++) {
+        int i = bins[b];
+        float n = (float)trans[i];
+        float* c = cumulative + i * span;
+        int j = first_bins[i];
+        float done = 0.0f;
+
+        for (int k = 0; k < span; k++, j++) {
+            float f = c[k] - done;   // zero for the padding
+            done = c[k];
+            if ((unsigned int)j < (unsigned int)nbins)
+                new_Float[j] += n * f;
+        }
+    }
+}
+
+/*
+Round the expected counts of a transient to whole photons, carrying the rounding error of each bin on to the next.
+Bin j gets round(S[j]) - round(S[j-1]) where S is the running total of the expected counts, which is the same as
+carrying the error but has no dependence between bins except the running total. The total is kept to the nearest photon
+and, as the running total never decreases, no bin goes negative.
+*/
+void error_diffusion_round(float* expected, int nbins, USHORT* new_Int)
+{
+    double total = 0.0, done = 0.0;
+
+    for (int j = 0; j < nbins; j++) {
+        total += expected[j];
+        double r = floor(total + 0.5);
+        new_Int[j] = (USHORT)min(r - done, 65535.0);
+        done = r;
+    }
+}
+
+/// Method used to split photons between bins, see SPAD_set_correction_method
+
+static int gCorrectionMethod = SPAD_CORRECTION_BINOMIAL;
+
+int SPAD_set_correction_method(int method)
+{
+    if (method != SPAD_CORRECTION_BINOMIAL && method != SPAD_CORRECTION_MULTINOMIAL && method != SPAD_CORRECTION_ERROR_DIFFUSION) {
+        printf("ERROR: Unknown correction method %d.\n", method);
+        return(-1);
+    }
+
+    gCorrectionMethod = method;
+
+    return(0);
+}
+
+// Output time window and temporal binning, the whole transient by default
+static int gOutputStartBin = 0;
+static int gOutputStopBin = 0;
+static int gOutputTimeBin = 1;
+
+int SPAD_set_output_time_window(int start_bin, int stop_bin, int time_bin)
+{
+    if (start_bin < 0 || time_bin < 1 || (stop_bin > 0 && stop_bin - start_bin < time_bin)) {
+        printf("ERROR: Output time window %d to %d is not valid for time binning by %d.\n", start_bin, stop_bin, time_bin);
+        return(-1);
+    }
+
+    gOutputStartBin = start_bin;
+    gOutputStopBin = stop_bin;
+    gOutputTimeBin = time_bin;
+
+    return(0);
+}
+
+int SPAD_get_output_timebins(int timebins)
+{
+    int stop = (gOutputStopBin > 0) ? min(gOutputStopBin, timebins) : timebins;
+
+    return(max(stop - gOutputStartBin, 0) / gOutputTimeBin);
+}
+
+static int output_time_window_active(int timebins)
+{
+    return (gOutputStartBin != 0 || gOutputTimeBin != 1 || (gOutputStopBin > 0 && gOutputStopBin < timebins));
+}
+
+/*
+Find the bins of a transient that have photons. Many images have most bins, or whole transients, empty and every kernel
+only needs to visit the bins in the list. The empty check is a plain OR over the transient that the compiler vectorises,
+the list is written without branches.
+*/
+#define SPARSE_TRANSIENT_FRACTION 16   // with fewer than 1/16 of the bins filled the deterministic correction uses the list
+
+template <int NBINS>
+static inline int find_nonzero_bins_n(USHORT* trans, int nbins, int* bins)
+{
+    if (NBINS) nbins = NBINS;
+
+    USHORT any = 0;
+    for (int i = 0; i < nbins; i++)
+        any |= trans[i];
+    if (!any) return(0);
+
+    int n = 0;
+    for (int i = 0; i < nbins; i++) {
+        bins[n] = i;
+        n += (trans[i] != 0);
+    }
+
+    return(n);
+}
+
+int find_nonzero_bins(USHORT* trans, int nbins, int* bins)
+{
+    if (gFixedTimebinKernels) {
+        switch (nbins) {
+#define NONZERO_BINS_CASE(n) case n: return(find_nonzero_bins_n<n>(trans, nbins, bins));
+        SPAD_FIXED_TIMEBINS(NONZERO_BINS_CASE)
+#undef NONZERO_BINS_CASE
+        }
+    }
+
+    return(find_nonzero_bins_n<0>(trans, nbins, bins));
+}
+
+/// Bin width factors of one detector, rebuilt in the scratch space if the compressed calibration is in use
+static double* transient_bin_width_factors(int detector, int nbins, correction_scratch* scratch)
+{
+    if (gBinWidthPCAActive) {
+        reconstruct_bin_width_factors(detector, scratch->factors);
+        return(scratch->factors);
+    }
+
+    return(&(gBinWidthFactors[(size_t)detector * nbins]));
+}
+
+/// Bin borders of one detector into the scratch space, kept while the same detector is corrected in several images
+static void transient_bin_borders(int detector, int nbins, correction_scratch* scratch)
+{
+    if (scratch->borders_detector == detector) return;
+
+    calc_bin_borders(transient_bin_width_factors(detector, nbins, scratch), nbins, gTimebaseShifts[detector], gTimebaseScales[detector], scratch->bin_borders, scratch->bin_jindexes);
+    scratch->borders_detector = detector;
+}
+
+/// Returns the number of bins with photons, < 0 on error
+int correct_transient_expected(USHORT* trans, float* output, int nbins, int detector, correction_scratch* scratch)
+{
+    if (trans == NULL || output == NULL) return(-1);
+
+    int nNonzero = find_nonzero_bins(trans, nbins, scratch->nonzero_bins);
+    scratch->skipped_bins += nbins - nNonzero;
+
+    if (nNonzero == 0) {   // nothing to move
+        memset(output, 0, nbins * sizeof(float));
+        scratch->skipped_pixels++;
+    }
+    else if (gCorrectionBandValid && nNonzero * SPARSE_TRANSIENT_FRACTION >= nbins) {
+        band_correction_expected(trans, output, nbins, detector, scratch->band_input);
+    }
+    else if (gCorrectionPlanValid) {
+        plan_correction_expected(trans, nbins, scratch->nonzero_bins, nNonzero, correction_plan_first_bins(detector), correction_plan_cumulative(detector), gnCorrectionPlanSpan, output);
+    }
+    else {
+        transient_bin_borders(detector, nbins, scratch);
+
+        combined_correction_expected(trans, nbins, scratch->nonzero_bins, nNonzero, scratch->bin_borders, scratch->bin_jindexes, output);
+    }
+
+    return(nNonzero);
+}
+
+/// Correct one transient without changing it, returns the corrected counts: trans itself if nothing moved, or scratch->new_Int
+USHORT* correct_transient_counts(USHORT* trans, int nbins, int detector, unsigned long long seed, correction_scratch* scratch)
+{
+    if (gCorrectionMethod == SPAD_CORRECTION_ERROR_DIFFUSION) {
+        if (correct_transient_expected(trans, scratch->expected, nbins, detector, scratch) > 0) {   // empty transients stay empty
+            error_diffusion_round(scratch->expected, nbins, scratch->new_Int);
+            return(scratch->new_Int);
+        }
+        return(trans);
+    }
+
+    int nNonzero = find_nonzero_bins(trans, nbins, scratch->nonzero_bins);
+    scratch->skipped_bins += nbins - nNonzero;
+
+    if (nNonzero == 0) {   // empty transient stays empty, leave it alone
+        scratch->skipped_pixels++;
+        return(trans);
+    }
+
+    if (gCorrectionPlanValid && gCorrectionMethod == SPAD_CORRECTION_MULTINOMIAL) {
+        plan_correction_multinomial(trans, nbins, scratch->nonzero_bins, nNonzero, correction_plan_first_bins(detector), correction_plan_cumulative(detector), gnCorrectionPlanSpan, scratch->new_Int, seed, detector);
     }
+    else if (gCorrectionPlanValid) {
+        plan_correction(trans, nbins, scratch->nonzero_bins, nNonzero, correction_plan_first_bins(detector), correction_plan_cumulative(detector), gnCorrectionPlanSpan, scratch->new_Int, seed, detector);
+    }
+    else {
+        // calculate the bin borders for transient in this pixel
+        transient_bin_borders(detector, nbins, scratch);
+
+        combined_correction(trans, nbins, scratch->nonzero_bins, nNonzero, scratch->bin_borders, scratch->bin_jindexes, scratch->new_Int, seed, detector);
+    }
+
+    return(scratch->new_Int);
+}
 
-    memcpy(trans, signal, nbins * sizeof(USHORT));
+int correct_transient(USHORT* trans, int nbins, int detector, unsigned long long seed, correction_scratch* scratch)
+{
+    if (trans == NULL) return(-1);
 
-    free(signal);
+    USHORT* corrected = correct_transient_counts(trans, nbins, detector, seed, scratch);
+    if (corrected != trans)
+        memcpy(trans, corrected, nbins * sizeof(USHORT));
 
     return(0);
 }
 
-void calc_bin_borders(double* bin_width_factors, int nbins, double shift, double scale, double **times, int **jvals)
+void calc_bin_borders(double* bin_width_factors, int nbins, double shift, double scale, double *vals, int *jval)
 {
     int nvals = nbins + 1;
-    double* vals = (double*)malloc(nvals * sizeof(double));
-    int* jval = (int*)malloc(nvals * sizeof(int));
     double t = -shift;
     for (int i = 0; i < nvals; i++) {
         vals[i] = t;
         jval[i] = (int)ceil(t) - 1;
         t += bin_width_factors[i] * scale;
     }
+}
+
+/// Scratch space for each pool worker, kept between images and only reallocated if the number of timebins changes
+
+static correction_scratch* gWorkerScratch = NULL;
+static int gnWorkerScratch = 0;
+
+int check_worker_scratch_space(int nWorkers)
+{
+    if (gnWorkerScratch < nWorkers) {
+        correction_scratch* s = (correction_scratch*)realloc(gWorkerScratch, nWorkers * sizeof(correction_scratch));
+        if (!s) return(-1);
+        memset(s + gnWorkerScratch, 0, (nWorkers - gnWorkerScratch) * sizeof(correction_scratch));
+        gWorkerScratch = s;
+        gnWorkerScratch = nWorkers;
+    }
+
+    return(0);
+}
 
-    *times = vals;
-    *jvals = jval;
+correction_scratch* get_worker_scratch(int worker, int timebins)
+{
+    correction_scratch* scratch = &(gWorkerScratch[worker]);
+
+    if (scratch->block && scratch->timebins != timebins)
+        free_correction_scratch(scratch);
+
+    // Allocated by the worker itself, so the memory is local to the thread using it
+    if (!scratch->block && alloc_correction_scratch(scratch, timebins) < 0)
+        return NULL;
+
+    return scratch;
 }
 
-/// Struct to hold info for each thread for thread_correct
+/// Struct to hold info for the pool tasks of thread_correct
+
+#define CORRECTION_TILE_PIXELS 64   // detectors per task, small enough for the pool to balance busy and quiet parts of the image
 
 typedef struct
 {
-    USHORT* image;
+    USHORT** images;       // nImages images of the same size, or the same rows of them
+    float** outputs;       // for the deterministic correction, NULL when correcting in place
+    int nImages;
     int width;
-    int height;
+    int height;            // rows in images
     int timebins;
-    int start_row, stop_row;
+    int first_row;         // row of the whole image that images start at
+    unsigned long long* seeds;   // one for each image
 
 } thread_correct_info;
 
-void thread_correct(void* param)
+int thread_correct(void* param, int task, int worker)
 {
-    USHORT* trans = NULL;
-    double* bin_width_factors = NULL;
-
     thread_correct_info* info = (thread_correct_info*)param;
 
-    USHORT* image = info->image;
-    int width = info->width;
-    int height = info->height;
     int timebins = info->timebins;
-    int start = info->start_row;
-    int stop = info->stop_row;
-
-    trans = &(image[start * width * timebins]);   // init to first transient
-    bin_width_factors = &(gBinWidthFactors[start * timebins]);  // init to factors for first pixel
-
-    int k = start * width;  // index into gTimebaseShifts and gTimebaseScales
-
-    for (int i = start; i < stop; i++) {
-        for (int j = 0; j < width; j++) {
-
-			// calculate the bin borders for transient in this pixel
-			double* bin_borders;
-			int* bin_jindexes;
-			calc_bin_borders(bin_width_factors, timebins, gTimebaseShifts[k], gTimebaseScales[k], &bin_borders, &bin_jindexes);
-
-            correct_transient(trans, timebins, bin_borders, bin_jindexes);
-            trans += timebins; // next transient
-            k++;
+    int nPixels = info->width * info->height;
+    int start = task * CORRECTION_TILE_PIXELS;
+    int stop = min(start + CORRECTION_TILE_PIXELS, nPixels);
 
-			free(bin_borders);
-			free(bin_jindexes);
+    correction_scratch* scratch = get_worker_scratch(worker, timebins);
+    if (scratch == NULL) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-2);
+    }
 
-			bin_width_factors += timebins; // factors for next pixel
+    // k is the detector index into the plan or gBinWidthFactors, gTimebaseShifts and gTimebaseScales
+    // Each detector is done in all the images before the next, so its calibration is read from memory once for all of them
+    int first_detector = info->first_row * info->width;
+    for (int p = start; p < stop; p++) {
+        size_t offset = (size_t)p * timebins;
+        int k = first_detector + p;
+        for (int n = 0; n < info->nImages; n++) {
+            USHORT* trans = &(info->images[n][offset]);
+            if (info->outputs)
+                correct_transient_expected(trans, &(info->outputs[n][offset]), timebins, k, scratch);
+            else
+                correct_transient(trans, timebins, k, info->seeds[n], scratch);
         }
     }
+
+    return(0);
 }
 
 
@@ -234,98 +614,1014 @@ uses global bin width factors etc.
 
 */
 
-int SPAD_CorrectTransients(USHORT* image, int width, int height, int timebins)
+// Fill in any missing calibration and build the plan if the calibration has changed, or if the plan is for other rows.
+// If the plan cannot be built the borders are calculated per transient.
+static int check_calibration(int width, int height, int timebins, int first_row, int nRows)
 {
-    const int nThreads = 16;
-    HANDLE hThread[16];
-    thread_correct_info info[16];
-    int rows_per_thread = height / nThreads;
-    int i;
+    if (gBinWidthPCAActive) {
+        if (!bin_width_pca_active(width, height, timebins)) {
+            printf("ERROR: Compressed bin width factors do not match a %d x %d x %d image.\n", width, height, timebins);
+            return(-1);
+        }
+    }
+    else if (!gBinWidthFactors) SPAD_reset_bin_width_factors(width, height, timebins);
+    if (!gTimebaseShifts) SPAD_reset_timebase_shifts(width, height, timebins);
+    if (!gTimebaseScales) SPAD_reset_timebase_scales(width, height);
 
-    // DEBUG with single thread
-    //return (SPAD_CorrectTransients_SingleThread(image, width, height, timebins));
+    if (!gBinWidthPCAActive && !correction_plan_covers(width, height, timebins, first_row, nRows))
+        build_correction_plan(width, height, timebins, first_row, nRows);
+
+    return(0);
+}
+
+static int correct_image_time_window(USHORT* image, float* output, int width, int height, int timebins, int first_row, int nRows, int image_number);
+
+// Correct rows first_row to first_row + nRows - 1 of width x height images, images and outputs hold just those rows
+static int correct_image_rows(USHORT* images[], float* outputs[], int nImages, int width, int height, int timebins, int first_row, int nRows)
+{
+    thread_correct_info info;
+    size_t nValues = (size_t)width * nRows * timebins;
+
+    if (first_row < 0 || nRows < 1 || first_row + nRows > height) {
+        printf("ERROR: Rows %d to %d are not in a %d row image.\n", first_row, first_row + nRows - 1, height);
+        return(-1);
+    }
 
-    if (!gBinWidthFactors && !gTimebaseShifts && !gTimebaseScales) {
+    if (output_time_window_active(timebins)) {
+        for (int n = 0; n < nImages; n++) {
+            int ret = correct_image_time_window(images[n], outputs ? outputs[n] : NULL, width, height, timebins, first_row, nRows, n);
+            if (ret < 0) return(ret);
+        }
+        return(0);
+    }
+
+    if (!gBinWidthFactors && !gBinWidthPCAActive && !gTimebaseShifts && !gTimebaseScales) {
         printf("Warning: No calibration set, nothing to do!\n");
+        if (outputs) {
+            for (int n = 0; n < nImages; n++)
+                for (size_t i = 0; i < nValues; i++) outputs[n][i] = (float)images[n][i];
+        }
         return (0);
     }
 
-    if (!gBinWidthFactors) SPAD_reset_bin_width_factors(width, height, timebins);
-    if (!gTimebaseShifts) SPAD_reset_timebase_shifts(width, height, timebins);
-    if (!gTimebaseScales) SPAD_reset_timebase_scales(width, height);
+    if (check_calibration(width, height, timebins, first_row, nRows) < 0) return(-1);
+
+    int nWorkers = pool_number_of_workers();
+    if (check_worker_scratch_space(nWorkers) < 0) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-2);
+    }
 
-    // Seed random number generation
-    srand((unsigned int)time(NULL));
+    unsigned long long* seeds = (unsigned long long*)malloc(nImages * sizeof(unsigned long long));
+    if (!seeds) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-2);
+    }
+    for (int n = 0; n < nImages; n++)
+        seeds[n] = get_random_seed(n);
+
+    info.images = images;
+    info.outputs = outputs;
+    info.nImages = nImages;
+    info.width = width;
+    info.height = nRows;
+    info.timebins = timebins;
+    info.first_row = first_row;
+    info.seeds = seeds;
+
+    int nTiles = (width * nRows + CORRECTION_TILE_PIXELS - 1) / CORRECTION_TILE_PIXELS;
+
+    for (int w = 0; w < nWorkers; w++) {
+        correction_scratch* scratch = &(gWorkerScratch[w]);
+        scratch->borders_detector = -1;   // the calibration may have changed since the last image
+        scratch->skipped_pixels = 0;
+        scratch->skipped_bins = 0;
+    }
 
     clock_t tStart = clock();
-    printf("Starting %d threads\n", nThreads);
-    for (i = 0; i < nThreads - 1; i++) {
+    if (nImages > 1)
+        printf("Correcting %d images with %d threads\n", nImages, nWorkers);
+    else
+        printf("Correcting with %d threads\n", nWorkers);
+    int ret = pool_run(nTiles, thread_correct, &info);
+    printf("Finished threads: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
 
-        info[i].image = image;
-        info[i].width = width;
-        info[i].height = height;
-        info[i].timebins = timebins;
-        info[i].start_row = rows_per_thread * i;
-        info[i].stop_row = info[i].start_row + rows_per_thread;
+    free(seeds);
 
-        hThread[i] = (HANDLE)_beginthread(thread_correct, 0, &info[i]);
+    long long skipped_pixels = 0, skipped_bins = 0;
+    for (int w = 0; w < nWorkers; w++) {
+        skipped_pixels += gWorkerScratch[w].skipped_pixels;
+        skipped_bins += gWorkerScratch[w].skipped_bins;
     }
+    printf("Skipped %lld of %lld empty transients and %lld of %lld empty bins\n", skipped_pixels, (long long)nImages * width * nRows,
+        skipped_bins, (long long)nImages * nValues);
 
-    // Last thread gets remaining rows
-    info[i].image = image;
-    info[i].width = width;
-    info[i].height = height;
-    info[i].timebins = timebins;
-    info[i].start_row = rows_per_thread * i;
-    info[i].stop_row = height;
+    return(ret);
+}
 
-    hThread[i] = (HANDLE)_beginthread(thread_correct, 0, &info[i]);
+// Whole images, the next correction starts at the image after these
+int correct_images(USHORT* images[], float* outputs[], int nImages, int width, int height, int timebins)
+{
+    int ret = correct_image_rows(images, outputs, nImages, width, height, timebins, 0, height);
+    gImageIndex += nImages;
 
-    // Wait for threads to end
-    DWORD ret = WaitForMultipleObjects(nThreads, hThread, TRUE, ULONG_MAX);   // wait for as long as we can
-    if (ret == WAIT_TIMEOUT) {
-        printf("ERROR: THREAD TIMEOUT\n");
-        return(-1);
-    }
-    printf("Finished threads: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+    return(ret);
+}
 
-    return(0);
+int correct_image(USHORT* image, float* output, int width, int height, int timebins)
+{
+    return(correct_images(&image, output ? &output : NULL, 1, width, height, timebins));
 }
 
+/*
+Correction fused with binning and the intensity image.
+
+Each task makes one row of the binned image. The bin_size x bin_size transients of each binned pixel are corrected one
+at a time in the worker's scratch space and added straight into the binned transient, which stays in L1, and the photon
+total goes into the intensity image. The corrected full size image is never written, so the binning and intensity passes
+over it are gone and the input image is not changed.
+Only the bins in the output time window are kept, added together time_bin at a time, so cropping and binning in time
+also cost no extra pass and the output is smaller to save.
+*/
 
-int SPAD_CorrectTransients_SingleThread(USHORT* image, int width, int height, int timebins)
+typedef struct
 {
-    USHORT* trans = NULL;
-    double* bin_width_factors = NULL;
+    USHORT* image;
+    USHORT* binned;        // corrected and binned image, NULL for the deterministic correction
+    UINT* intensity;       // photon total of each binned pixel, may be NULL
+    float* binned_float;   // deterministic correction versions of the above
+    float* intensity_float;
+    int width;
+    int height;            // of the whole image
+    int timebins;
+    int first_row;         // rows of the whole image in image, always a multiple of bin_size rows except for the last
+    int nRows;
+    int bin_size;
+    int new_width;
+    int out_start;         // output time window, see SPAD_set_output_time_window
+    int out_timebins;
+    int time_bin;
+    int image_number;      // of a batch, for the random streams
+    unsigned long long seed;
+
+} thread_correct_bin_info;
+
+// Four partial sums so the additions do not wait for each other
+static double sum_transient_float(float* trans, int nbins)
+{
+    double s[4] = { 0.0, 0.0, 0.0, 0.0 };
+    int i = 0;
+
+    for (; i + 4 <= nbins; i += 4) {
+        s[0] += trans[i];
+        s[1] += trans[i + 1];
+        s[2] += trans[i + 2];
+        s[3] += trans[i + 3];
+    }
+    for (; i < nbins; i++) s[0] += trans[i];
 
-    if (!gBinWidthFactors) SPAD_reset_bin_width_factors(width, height, timebins);
-    if (!gTimebaseShifts) SPAD_reset_timebase_shifts(width, height, timebins);
-    if (!gTimebaseScales) SPAD_reset_timebase_scales(width, height);
+    return((s[0] + s[1]) + (s[2] + s[3]));
+}
 
-    trans = image;   // init to first transient
-    bin_width_factors = gBinWidthFactors;  // init to factors for first pixel
+int thread_correct_bin(void* param, int task, int worker)
+{
+    thread_correct_bin_info* info = (thread_correct_bin_info*)param;
 
-    // Seed random number generation
-    srand((unsigned int)time(NULL));
+    int timebins = info->timebins;
+    int b = info->bin_size;
+    int start = info->out_start, nOut = info->out_timebins, tb = info->time_bin;
+    int whole = (start == 0 && nOut == timebins && tb == 1);
 
-    int k = 0;  // index into gTimebaseShifts and gTimebaseScales
+    correction_scratch* scratch = get_worker_scratch(worker, timebins);
+    if (scratch == NULL) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-2);
+    }
 
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
+    for (int x = 0; x < info->new_width; x++) {
+        size_t out = ((size_t)task * info->new_width + x);
+        USHORT* binned = info->binned ? &(info->binned[out * nOut]) : NULL;
+        float* binned_float = info->binned_float ? &(info->binned_float[out * nOut]) : NULL;
+        UINT total = 0;
 
-			double* bin_borders;
-			int* bin_jindexes;
-			calc_bin_borders(bin_width_factors, timebins, gTimebaseShifts[k], gTimebaseScales[k], &bin_borders, &bin_jindexes);
+        if (binned) memset(binned, 0, nOut * sizeof(USHORT));
 
-            correct_transient(trans, timebins, bin_borders, bin_jindexes);
-            trans += timebins; // next transient
-            k++;
+        for (int dy = 0; dy < b; dy++) {
+            for (int dx = 0; dx < b; dx++) {
+                int p = (task * b + dy) * info->width + x * b + dx;   // pixel of image
+                int k = info->first_row * info->width + p;            // detector
+                USHORT* trans = &(info->image[(size_t)p * timebins]);
 
-			free(bin_borders);
-			free(bin_jindexes);
+                if (binned_float && dy == 0 && dx == 0 && whole) {   // the first goes straight into the output
+                    correct_transient_expected(trans, binned_float, timebins, k, scratch);
+                }
+                else if (binned_float) {
+                    correct_transient_expected(trans, scratch->expected, timebins, k, scratch);
+                    float* corrected = scratch->expected + start;
+                    if (dy == 0 && dx == 0) memset(binned_float, 0, nOut * sizeof(float));
+                    for (int i = 0; i < nOut; i++)
+                        for (int j = 0; j < tb; j++)
+                            binned_float[i] += corrected[i * tb + j];
+                }
+                else {
+                    USHORT* corrected = correct_transient_counts(trans, timebins, k, info->seed, scratch) + start;
+                    for (int i = 0; i < nOut; i++) {
+                        UINT sum = binned[i];
+                        for (int j = 0; j < tb; j++)
+                            sum += corrected[i * tb + j];
+                        total += sum - binned[i];
+                        binned[i] = (sum > 65535) ? 65535 : (USHORT)sum;    // saturates as SPAD_bin does
+                    }
+                }
+            }
+        }
+
+        if (info->intensity) info->intensity[out] = total;
+        if (info->intensity_float) info->intensity_float[out] = (float)sum_transient_float(binned_float, nOut);
+    }
+
+    return(0);
+}
+
+static int correct_bin_image(thread_correct_bin_info* info, int* new_width, int* new_height)
+{
+    int width = info->width, height = info->height, timebins = info->timebins;
+
+    int b = info->bin_size;
+    if (b < 1) {
+        printf("ERROR: Bin size %d is not allowed.\n", b);
+        return(-1);
+    }
+    if (info->first_row < 0 || info->nRows < 1 || info->first_row + info->nRows > height) {
+        printf("ERROR: Rows %d to %d are not in a %d row image.\n", info->first_row, info->first_row + info->nRows - 1, height);
+        return(-1);
+    }
+    info->new_width = width / b;
+    int nRows = info->nRows / b;
+
+    if (new_width) *new_width = info->new_width;
+    if (new_height) *new_height = nRows;
+
+    info->out_start = gOutputStartBin;
+    info->out_timebins = SPAD_get_output_timebins(timebins);
+    info->time_bin = gOutputTimeBin;
+    if (info->out_timebins < 1) {
+        printf("ERROR: Output time window is outside the %d timebins.\n", timebins);
+        return(-1);
+    }
+
+    if (check_calibration(width, height, timebins, info->first_row, info->nRows) < 0) return(-1);
+
+    int nWorkers = pool_number_of_workers();
+    if (check_worker_scratch_space(nWorkers) < 0) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-2);
+    }
+
+    for (int w = 0; w < nWorkers; w++) {
+        correction_scratch* scratch = &(gWorkerScratch[w]);
+        scratch->borders_detector = -1;
+        scratch->skipped_pixels = 0;
+        scratch->skipped_bins = 0;
+    }
+
+    info->seed = get_random_seed(info->image_number);
+
+    clock_t tStart = clock();
+    printf("Correcting and binning %d x %d with %d threads\n", b, b, nWorkers);
+    int ret = pool_run(nRows, thread_correct_bin, info);
+    printf("Finished threads: %.2fs\n", ((double)clock() - (double)tStart) / CLOCKS_PER_SEC);
+
+    // Only the whole b x b blocks are corrected
+    long long nTransients = (long long)info->new_width * b * nRows * b;
+    long long skipped_pixels = 0, skipped_bins = 0;
+    for (int w = 0; w < nWorkers; w++) {
+        skipped_pixels += gWorkerScratch[w].skipped_pixels;
+        skipped_bins += gWorkerScratch[w].skipped_bins;
+    }
+    printf("Skipped %lld of %lld empty transients and %lld of %lld empty bins\n", skipped_pixels, nTransients,
+        skipped_bins, nTransients * timebins);
+
+    return(ret);
+}
+
+// Correction with an output time window, the fused correction without spatial binning.
+// In place, the shorter transients are packed at the start of the image.
+static int correct_image_time_window(USHORT* image, float* output, int width, int height, int timebins, int first_row, int nRows, int image_number)
+{
+    thread_correct_bin_info info;
+
+    memset(&info, 0, sizeof(info));
+    info.image = image;
+    info.width = width;
+    info.height = height;
+    info.timebins = timebins;
+    info.first_row = first_row;
+    info.nRows = nRows;
+    info.bin_size = 1;
+    info.image_number = image_number;
+
+    if (output) {
+        info.binned_float = output;
+        return(correct_bin_image(&info, NULL, NULL));
+    }
+
+    size_t nValues = (size_t)width * nRows * SPAD_get_output_timebins(timebins);
+    info.binned = (USHORT*)malloc(nValues * sizeof(USHORT));
+    if (!info.binned) {
+        printf("ERROR: Could not allocate space for the corrected image.\n");
+        return(-2);
+    }
+
+    int ret = correct_bin_image(&info, NULL, NULL);
+    if (ret >= 0)
+        memcpy(image, info.binned, nValues * sizeof(USHORT));
+
+    free(info.binned);
+
+    return(ret);
+}
+
+int SPAD_CorrectBinIntensity(USHORT* image, int width, int height, int timebins, int bin_size, USHORT* binned, UINT* intensity, int* new_width, int* new_height)
+{
+    int ret = SPAD_CorrectBinIntensityRows(image, width, height, timebins, 0, height, bin_size, binned, intensity, new_width, new_height);
+    gImageIndex++;
+
+    return(ret);
+}
+
+int SPAD_CorrectBinIntensity_Float(USHORT* image, int width, int height, int timebins, int bin_size, float* binned, float* intensity, int* new_width, int* new_height)
+{
+    int ret = SPAD_CorrectBinIntensityRows_Float(image, width, height, timebins, 0, height, bin_size, binned, intensity, new_width, new_height);
+    gImageIndex++;
+
+    return(ret);
+}
+
+int SPAD_CorrectBinIntensityRows(USHORT* rows, int width, int height, int timebins, int first_row, int nRows, int bin_size, USHORT* binned, UINT* intensity,
+    int* new_width, int* new_height)
+{
+    thread_correct_bin_info info;
+
+    if (rows == NULL || binned == NULL) {
+        printf("ERROR: No image or output buffer supplied.\n");
+        return(-1);
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.image = rows;
+    info.binned = binned;
+    info.intensity = intensity;
+    info.width = width;
+    info.height = height;
+    info.timebins = timebins;
+    info.first_row = first_row;
+    info.nRows = nRows;
+    info.bin_size = bin_size;
+
+    return(correct_bin_image(&info, new_width, new_height));
+}
+
+int SPAD_CorrectBinIntensityRows_Float(USHORT* rows, int width, int height, int timebins, int first_row, int nRows, int bin_size, float* binned, float* intensity,
+    int* new_width, int* new_height)
+{
+    thread_correct_bin_info info;
+
+    if (rows == NULL || binned == NULL) {
+        printf("ERROR: No image or output buffer supplied.\n");
+        return(-1);
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.image = rows;
+    info.binned_float = binned;
+    info.intensity_float = intensity;
+    info.width = width;
+    info.height = height;
+    info.timebins = timebins;
+    info.first_row = first_row;
+    info.nRows = nRows;
+    info.bin_size = bin_size;
+
+    return(correct_bin_image(&info, new_width, new_height));
+}
+
+int SPAD_CorrectTransients(USHORT* image, int width, int height, int timebins)
+{
+    // DEBUG with single thread
+    //return (SPAD_CorrectTransients_SingleThread(image, width, height, timebins));
+
+    return(correct_image(image, NULL, width, height, timebins));
+}
+
+int SPAD_CorrectTransients_Float(USHORT* image, float* output, int width, int height, int timebins)
+{
+    if (output == NULL) {
+        printf("ERROR: No output buffer supplied.\n");
+        return(-1);
+    }
 
-			bin_width_factors += timebins; // factors for next pixel
+    return(correct_image(image, output, width, height, timebins));
+}
+
+int SPAD_CorrectTransientsRows(USHORT* rows, int width, int height, int timebins, int first_row, int nRows)
+{
+    if (rows == NULL) {
+        printf("ERROR: No image supplied.\n");
+        return(-1);
+    }
+
+    return(correct_image_rows(&rows, NULL, 1, width, height, timebins, first_row, nRows));
+}
+
+int SPAD_CorrectTransientsRows_Float(USHORT* rows, float* output, int width, int height, int timebins, int first_row, int nRows)
+{
+    if (rows == NULL || output == NULL) {
+        printf("ERROR: No image or output buffer supplied.\n");
+        return(-1);
+    }
+
+    return(correct_image_rows(&rows, &output, 1, width, height, timebins, first_row, nRows));
+}
+
+size_t SPAD_get_correction_plan_detector_bytes(void)
+{
+    return(correction_plan_detector_bytes() + correction_band_detector_bytes());
+}
+
+int SPAD_CorrectTransientsBatch(USHORT* images[], int nImages, int width, int height, int timebins)
+{
+    if (images == NULL || nImages < 1) {
+        printf("ERROR: No images supplied.\n");
+        return(-1);
+    }
+
+    return(correct_images(images, NULL, nImages, width, height, timebins));
+}
+
+int SPAD_CorrectTransientsBatch_Float(USHORT* images[], float* outputs[], int nImages, int width, int height, int timebins)
+{
+    if (images == NULL || outputs == NULL || nImages < 1) {
+        printf("ERROR: No images or output buffers supplied.\n");
+        return(-1);
+    }
+
+    return(correct_images(images, outputs, nImages, width, height, timebins));
+}
+
+void SPAD_set_random_seed(unsigned long long seed)
+{
+    gRandomSeed = seed;
+    gRandomSeedSet = 1;
+}
+
+void SPAD_set_image_index(unsigned long long index)
+{
+    gImageIndex = index;
+}
+
+int SPAD_set_number_of_threads(int nThreads)
+{
+    pool_set_number_of_threads(nThreads);
+
+    return(pool_number_of_workers());
+}
+
+
+int SPAD_CorrectTransients_SingleThread(USHORT* image, int width, int height, int timebins)
+{
+    USHORT* trans = NULL;
+
+    if (check_calibration(width, height, timebins, 0, height) < 0) return(-1);
+
+    trans = image;   // init to first transient
+
+    unsigned long long seed = get_random_seed(0);
+
+    int k = 0;  // index into gTimebaseShifts and gTimebaseScales
+
+    correction_scratch scratch;
+    if (alloc_correction_scratch(&scratch, timebins) < 0) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-2);
+    }
+
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            correct_transient(trans, timebins, k, seed, &scratch);
+            trans += timebins; // next transient
+            k++;
         }
     }
+
+    printf("Skipped %lld of %d empty transients and %lld of %lld empty bins\n", scratch.skipped_pixels, width * height,
+        scratch.skipped_bins, (long long)width * height * timebins);
+
+    free_correction_scratch(&scratch);
+    gImageIndex++;
+
     return(0);
 }
+
+
+/* test functions */
+
+int SPAD_multinomial_test(char filepath[])
+{
+    FILE* fp;
+    const int nbins = 256, span = 3, nRuns = 20000;
+    int first_bins[nbins];
+    float cumulative[nbins * span];
+    USHORT trans[nbins], new_Int[nbins];
+    double sum[2][nbins], sum2[2][nbins], seconds[2];
+    int ret = 0;
+
+    fopen_s(&fp, filepath, "w");
+    if (!fp) {
+        printf("ERROR: Could not open multinomial test file.\n");
+        return(-1);
+    }
+
+    // A made up transient, bins of random width between 0.5 and 1.5 from a shift of -2, photon counts from 0 to 200
+    spad_rng rng;
+    spad_rng_init(&rng, 1, 0, 0);
+    double b1 = -2.0;
+    for (int i = 0; i < nbins; i++) {
+        double b2 = b1 + 0.5 + spad_rng_uniform(&rng);
+        double t = b2 - b1;
+        int bj1 = (int)ceil(b1) - 1;
+        int bj2 = (int)ceil(b2) - 1;
+        float* c = cumulative + i * span;
+        double f = min(1 - (b1 - bj1), t);
+        c[0] = (float)(f / t);
+        for (int s = 1; s < bj2 - bj1; s++) {
+            f += 1.0;
+            c[s] = (float)(f / t);
+        }
+        for (int s = bj2 - bj1; s < span; s++) c[s] = 1.0f;
+        first_bins[i] = bj1;
+        trans[i] = (USHORT)(spad_rng_next(&rng) % 201);
+        b1 = b2;
+    }
+
+    int bins[nbins];
+    int nNonzero = find_nonzero_bins(trans, nbins, bins);
+
+    // Mean and variance of each output bin from the binomial chain and the multinomial draw
+    for (int m = 0; m < 2; m++) {
+        memset(sum[m], 0, sizeof(sum[m]));
+        memset(sum2[m], 0, sizeof(sum2[m]));
+        clock_t tStart = clock();
+        for (int r = 0; r < nRuns; r++) {
+            if (m == 0)
+                plan_correction(trans, nbins, bins, nNonzero, first_bins, cumulative, span, new_Int, 1000 + r, 0);
+            else
+                plan_correction_multinomial(trans, nbins, bins, nNonzero, first_bins, cumulative, span, new_Int, 1000 + r, 0);
+            for (int j = 0; j < nbins; j++) {
+                sum[m][j] += new_Int[j];
+                sum2[m][j] += (double)new_Int[j] * new_Int[j];
+            }
+        }
+        seconds[m] = ((double)clock() - (double)tStart) / CLOCKS_PER_SEC;
+    }
+
+    // Compare, the means should agree within the noise and the variances closely
+    double max_z = 0.0, max_var_ratio = 1.0;
+    fprintf(fp, "bin, binomial mean, multinomial mean, binomial variance, multinomial variance, z\n");
+    for (int j = 0; j < nbins; j++) {
+        double m0 = sum[0][j] / nRuns, m1 = sum[1][j] / nRuns;
+        double v0 = sum2[0][j] / nRuns - m0 * m0, v1 = sum2[1][j] / nRuns - m1 * m1;
+        double z = (v0 + v1 > 0) ? (m1 - m0) / sqrt((v0 + v1) / nRuns) : 0.0;
+        fprintf(fp, "%d, %f, %f, %f, %f, %f\n", j, m0, m1, v0, v1, z);
+        if (fabs(z) > max_z) max_z = fabs(z);
+        if (v0 > 1.0 && v1 > 1.0 && max(v0 / v1, v1 / v0) > max_var_ratio) max_var_ratio = max(v0 / v1, v1 / v0);
+    }
+
+    fclose(fp);
+
+    printf("Binomial chain %.3f us, multinomial %.3f us per transient. Max mean difference z = %.2f, max variance ratio %.3f\n",
+        1E6 * seconds[0] / nRuns, 1E6 * seconds[1] / nRuns, max_z, max_var_ratio);
+
+    if (max_z > 5.0 || max_var_ratio > 1.1) {
+        printf("ERROR: Multinomial and binomial corrections do not agree.\n");
+        ret = -2;
+    }
+
+    return(ret);
+}
+
+int SPAD_error_diffusion_test(void)
+{
+    const int width = 64, height = 64, nbins = 256;   // one made up detector for each transient
+    const int nPixels = width * height;
+    const char* paths[] = { "band", "plan", "borders" };
+    int nTested[3] = { 0 }, nBad[3] = { 0 }, nDifferent[3] = { 0 };
+    double max_error[3] = { 0.0 };
+    USHORT trans[nbins], first[nbins];
+    int ret = 0;
+
+    // Made up bins of width 0.5 to 1.5 scaled to cover the whole transient, shifted by up to 2 bins.
+    if (SPAD_reset_bin_width_factors(width, height, nbins) < 0 || SPAD_reset_timebase_shifts(width, height, nbins) < 0 ||
+        SPAD_reset_timebase_scales(width, height) < 0) {
+        printf("ERROR: Could not allocate the calibration.\n");
+        return(-1);
+    }
+    double* factors = SPAD_get_bin_width_factors_ptr();
+    double* shifts = SPAD_get_timebase_shifts_ptr();
+    double* scales = SPAD_get_timebase_scales_ptr();
+
+    spad_rng rng;
+    spad_rng_init(&rng, 2, 0, 0);
+    for (int k = 0; k < nPixels; k++) {
+        double total_width = 0.0;
+        for (int i = 0; i < nbins; i++) {
+            factors[(size_t)k * nbins + i] = 0.5 + spad_rng_uniform(&rng);
+            total_width += factors[(size_t)k * nbins + i];
+        }
+        shifts[k] = 4.0 * spad_rng_uniform(&rng) - 2.0;
+        scales[k] = nbins / total_width;
+    }
+
+    correction_scratch scratch;
+    if (alloc_correction_scratch(&scratch, nbins) < 0) {
+        printf("ERROR: Could not allocate correction scratch space.\n");
+        return(-1);
+    }
+
+    int method = gCorrectionMethod;
+    gCorrectionMethod = SPAD_CORRECTION_ERROR_DIFFUSION;
+
+    clock_t tStart = clock();
+
+    // The correction used in the images: the band for dense transients and the plan for sparse ones, at both precisions
+    // of their weights, then the bin borders of each detector when there is no plan.
+    for (int pass = 0; ret == 0 && pass < 3; pass++) {
+        if (pass < 2) {
+            SPAD_set_correction_precision(pass ? SPAD_PRECISION_FIXED16 : SPAD_PRECISION_FLOAT32);
+            if (SPAD_build_correction_plan(width, height, nbins) < 0 || !gCorrectionBandValid) {
+                printf("ERROR: Could not build the correction plan and band.\n");
+                ret = -1;
+                break;
+            }
+        }
+        else {
+            invalidate_correction_plan();
+        }
+        scratch.borders_detector = -1;
+
+        for (int k = 0; k < nPixels; k++) {
+            for (int dense = 0; dense < 2; dense++) {
+                // Photons shifted past either end of the transient are lost, so the first and last 4 bins are empty.
+                // Dense transients have photons in every other bin, sparse ones in a few.
+                int maxCount = 1 + (k * 2 + dense) % 1000;
+                memset(trans, 0, sizeof(trans));
+                for (int i = 4; i < nbins - 4; i++) {
+                    if (dense ? (i % 2 == 0) : (spad_rng_next(&rng) % 64 == 0))
+                        trans[i] = (USHORT)(1 + spad_rng_next(&rng) % maxCount);
+                }
+
+                long sum_in = 0, sum_out = 0;
+                for (int i = 0; i < nbins; i++)
+                    sum_in += trans[i];
+
+                int nNonzero = find_nonzero_bins(trans, nbins, scratch.nonzero_bins);
+                if (nNonzero == 0) continue;   // left as it is
+                int path = !gCorrectionPlanValid ? 2 : (nNonzero * SPARSE_TRANSIENT_FRACTION >= nbins) ? 0 : 1;
+
+                USHORT* counts = NULL;
+                for (int repeat = 0; repeat < 2; repeat++) {
+                    counts = correct_transient_counts(trans, nbins, k, 0, &scratch);
+                    if (repeat == 0) memcpy(first, counts, nbins * sizeof(USHORT));
+                }
+
+                double sum_expected = 0.0;
+                for (int j = 0; j < nbins; j++) {
+                    sum_out += counts[j];
+                    sum_expected += scratch.expected[j];
+                }
+
+                nTested[path]++;
+                max_error[path] = max(max_error[path], fabs(sum_expected - sum_in));
+                if (sum_out != sum_in) nBad[path]++;
+                if (memcmp(first, counts, nbins * sizeof(USHORT)) != 0) nDifferent[path]++;
+            }
+        }
+    }
+
+    printf("Error diffusion %.3f us per transient\n", 1E6 * ((double)clock() - (double)tStart) / CLOCKS_PER_SEC / (12 * nPixels));
+    for (int path = 0; path < 3; path++) {
+        printf("  %-7s %d of %d transients changed their photon total, %d were not repeatable, expected counts off by up to %.2e photons\n",
+            paths[path], nBad[path], nTested[path], nDifferent[path], max_error[path]);
+        if (nBad[path] > 0 || nDifferent[path] > 0) ret = -2;
+        if (ret == 0 && nTested[path] == 0) ret = -3;
+    }
+
+    gCorrectionMethod = method;
+    SPAD_set_correction_precision(SPAD_PRECISION_FLOAT32);
+    free_correction_scratch(&scratch);
+
+    if (ret == -2)
+        printf("ERROR: Error diffusion did not keep the photon totals.\n");
+    if (ret == -3)
+        printf("ERROR: Not every correction was tested.\n");
+
+    return(ret);
+}
+
+int SPAD_compact_calibration_test(int width, int height, int timebins)
+{
+    int nPixels = width * height;
+    size_t nValues = (size_t)nPixels * timebins;
+    const USHORT photons = 1000;
+    int ret = 0;
+
+    if (!gBinWidthFactors || gnBinWidthFactors != nValues || !gTimebaseShifts || !gTimebaseScales) {
+        printf("ERROR: Calibration does not match a %d x %d x %d image.\n", width, height, timebins);
+        return(-1);
+    }
+
+    double* factors = (double*)malloc(nValues * sizeof(double));
+    short* packed = (short*)malloc(nValues * sizeof(short));
+    USHORT* image = (USHORT*)malloc(nValues * sizeof(USHORT));
+    float* output[2] = { (float*)malloc(nValues * sizeof(float)), (float*)malloc(nValues * sizeof(float)) };
+    correction_scratch scratch[2];
+    int scratch_ok = (alloc_correction_scratch(&scratch[0], timebins) == 0) + (alloc_correction_scratch(&scratch[1], timebins) == 0);
+
+    if (!factors || !packed || !image || !output[0] || !output[1] || scratch_ok < 2) {
+        printf("ERROR: Could not allocate space for the compact calibration test.\n");
+        ret = -2;
+    }
+
+    // Bin borders from the float32 and fixed point files against the double ones
+    for (int precision = SPAD_PRECISION_FLOAT32; ret == 0 && precision <= SPAD_PRECISION_FIXED16; precision++) {
+        if (precision == SPAD_PRECISION_FLOAT32) {
+            for (size_t i = 0; i < nValues; i++) factors[i] = (float)gBinWidthFactors[i];
+        }
+        else {
+            pack_bin_width_factors_fixed16(gBinWidthFactors, packed, nValues);
+            unpack_bin_width_factors_fixed16(packed, factors, nValues);
+        }
+
+        double max_border = 0.0, max_output = 0.0, max_scale = 0.0;
+        for (int i = 0; i < timebins; i++) image[i] = photons;
+        int nNonzero = find_nonzero_bins(image, timebins, scratch[0].nonzero_bins);
+
+        for (int k = 0; k < nPixels; k++) {
+            size_t offset = (size_t)k * timebins;
+            calc_bin_borders(&gBinWidthFactors[offset], timebins, gTimebaseShifts[k], gTimebaseScales[k], scratch[0].bin_borders, scratch[0].bin_jindexes);
+            calc_bin_borders(&factors[offset], timebins, gTimebaseShifts[k], gTimebaseScales[k], scratch[1].bin_borders, scratch[1].bin_jindexes);
+            combined_correction_expected(image, timebins, scratch[0].nonzero_bins, nNonzero, scratch[0].bin_borders, scratch[0].bin_jindexes, scratch[0].expected);
+            combined_correction_expected(image, timebins, scratch[0].nonzero_bins, nNonzero, scratch[1].bin_borders, scratch[1].bin_jindexes, scratch[1].expected);
+            max_scale = max(max_scale, gTimebaseScales[k]);
+            for (int i = 0; i <= timebins; i++)
+                max_border = max(max_border, fabs(scratch[0].bin_borders[i] - scratch[1].bin_borders[i]));
+            for (int i = 0; i < timebins; i++)
+                max_output = max(max_output, fabs((double)scratch[0].expected[i] - scratch[1].expected[i]) / photons);
+        }
+
+        printf("%s bin width factors: max bin border error %.2e bins, max correction error %.2e of the photons per bin\n",
+            precision == SPAD_PRECISION_FLOAT32 ? "float32" : "fixed16", max_border, max_output);
+
+        // one fixed point step, or float rounding over the transient, times the timebase scale
+        double bound = max_scale * ((precision == SPAD_PRECISION_FLOAT32) ? 1E-4 : 1.0 / 16384 + 1E-9);
+        if (max_border > bound) ret = -3;
+    }
+
+    // Deterministic correction with fixed point weights against float weights
+    if (ret == 0) {
+        for (size_t i = 0; i < nValues; i++) image[i] = photons;
+
+        SPAD_set_correction_precision(SPAD_PRECISION_FLOAT32);
+        correct_image(image, output[0], width, height, timebins);
+        SPAD_set_correction_precision(SPAD_PRECISION_FIXED16);
+        correct_image(image, output[1], width, height, timebins);
+        SPAD_set_correction_precision(SPAD_PRECISION_FLOAT32);
+
+        double max_output = 0.0;
+        for (size_t i = 0; i < nValues; i++)
+            max_output = max(max_output, fabs((double)output[0][i] - output[1][i]) / photons);
+
+        printf("fixed16 correction weights: max correction error %.2e of the photons per bin\n", max_output);
+
+        if (max_output > 1E-4) ret = -3;  // a few diagonals each within half of 1/65535
+    }
+
+    if (ret == -3)
+        printf("ERROR: Compact calibration is less accurate than expected.\n");
+
+    free(factors);
+    free(packed);
+    free(image);
+    free(output[0]);
+    free(output[1]);
+    free_correction_scratch(&scratch[0]);
+    free_correction_scratch(&scratch[1]);
+
+    return(ret);
+}
+
+int SPAD_batch_benchmark(char filepath[], int width, int height, int timebins, int maxImages)
+{
+    FILE* fp;
+    size_t nValues = (size_t)width * height * timebins;
+    int ret = 0;
+
+    if (maxImages < 1) return(-1);
+
+    fopen_s(&fp, filepath, "w");
+    if (!fp) {
+        printf("ERROR: Could not open batch benchmark file.\n");
+        return(-1);
+    }
+
+    USHORT** images = (USHORT**)calloc(maxImages, sizeof(USHORT*));
+    USHORT** originals = (USHORT**)calloc(maxImages, sizeof(USHORT*));
+    float** outputs = (float**)calloc(maxImages, sizeof(float*));
+    USHORT* single = (USHORT*)malloc(nValues * sizeof(USHORT));
+    float* single_output = (float*)malloc(nValues * sizeof(float));
+    int ok = (images && originals && outputs && single && single_output);
+
+    for (int n = 0; ok && n < maxImages; n++) {
+        images[n] = (USHORT*)malloc(nValues * sizeof(USHORT));
+        originals[n] = (USHORT*)malloc(nValues * sizeof(USHORT));
+        outputs[n] = (float*)malloc(nValues * sizeof(float));
+        ok = (images[n] && originals[n] && outputs[n]);
+        if (!ok) break;
+
+        // made up counts, a different image each time
+        spad_rng rng;
+        spad_rng_init(&rng, 2024, 0, n);
+        for (size_t i = 0; i < nValues; i++)
+            originals[n][i] = (USHORT)(spad_rng_next(&rng) % 24);
+    }
+
+    if (!ok) {
+        printf("ERROR: Could not allocate space for the batch benchmark.\n");
+        ret = -2;
+    }
+
+    // Fixed seed so the batch can be compared with single images of the same index, put back after
+    unsigned long long seed = gRandomSeed;
+    int seed_set = gRandomSeedSet;
+    unsigned long long image_index = gImageIndex;
+    SPAD_set_random_seed(12345);
+
+    // First correction builds the plan, keep it out of the timings
+    if (ret == 0) {
+        memcpy(single, originals[0], nValues * sizeof(USHORT));
+        correct_image(single, NULL, width, height, timebins);
+    }
+
+    fprintf(fp, "images, method, s per batch, images per s, Mpixels per s\n");
+
+    for (int nImages = 1; ret == 0 && nImages <= maxImages; nImages *= 2) {
+        for (int f = 0; f < 2; f++) {
+            for (int n = 0; n < nImages; n++)
+                memcpy(images[n], originals[n], nValues * sizeof(USHORT));
+
+            SPAD_set_image_index(0);
+            clock_t tStart = clock();
+            if (f)
+                SPAD_CorrectTransientsBatch_Float(images, outputs, nImages, width, height, timebins);
+            else
+                SPAD_CorrectTransientsBatch(images, nImages, width, height, timebins);
+            double s = ((double)clock() - (double)tStart) / CLOCKS_PER_SEC;
+
+            // Every image of the batch must be the same as when it is corrected alone
+            for (int n = 0; n < nImages; n++) {
+                memcpy(single, originals[n], nValues * sizeof(USHORT));
+                SPAD_set_image_index(n);
+                if (f) {
+                    correct_image(single, single_output, width, height, timebins);
+                    if (memcmp(single_output, outputs[n], nValues * sizeof(float)) != 0) ret = -3;
+                }
+                else {
+                    correct_image(single, NULL, width, height, timebins);
+                    if (memcmp(single, images[n], nValues * sizeof(USHORT)) != 0) ret = -3;
+                }
+            }
+
+            const char* name = f ? "float" : "random";
+            double per_s = (s > 0) ? nImages / s : 0.0;
+            fprintf(fp, "%d, %s, %.4f, %.2f, %.2f\n", nImages, name, s, per_s, per_s * width * height / 1E6);
+            printf("Batch of %d images %s: %.3fs, %.2f images per s\n", nImages, name, s, per_s);
+        }
+    }
+
+    if (ret == -3)
+        printf("ERROR: Batch correction differs from single image correction.\n");
+
+    gRandomSeed = seed;
+    gRandomSeedSet = seed_set;
+    gImageIndex = image_index;
+
+    for (int n = 0; n < maxImages; n++) {
+        if (images) free(images[n]);
+        if (originals) free(originals[n]);
+        if (outputs) free(outputs[n]);
+    }
+    free(images);
+    free(originals);
+    free(outputs);
+    free(single);
+    free(single_output);
+    fclose(fp);
+
+    return(ret);
+}
+
+int SPAD_timebins_benchmark(char filepath[], int width, int height, int repeats)
+{
+    const int sizes[] = { 64, 128, 256, 512, 1024, 1000 };   // 1000 has no fixed size kernels, for comparison
+    const int nSizes = sizeof(sizes) / sizeof(sizes[0]);
+    FILE* fp;
+    int ret = 0;
+
+    if (repeats < 1) return(-1);
+
+    fopen_s(&fp, filepath, "w");
+    if (!fp) {
+        printf("ERROR: Could not open timebins benchmark file.\n");
+        return(-1);
+    }
+
+    size_t maxValues = (size_t)width * height * 1024;
+    USHORT* image = (USHORT*)malloc(maxValues * sizeof(USHORT));
+    float* output[2] = { (float*)malloc(maxValues * sizeof(float)), (float*)malloc(maxValues * sizeof(float)) };
+
+    if (!image || !output[0] || !output[1]) {
+        printf("ERROR: Could not allocate space for the timebins benchmark.\n");
+        ret = -2;
+    }
+
+    fprintf(fp, "timebins, kernel, s per image, Mpixels per s, speedup\n");
+
+    int fixed_kernels = gFixedTimebinKernels;   // put back after
+
+    for (int n = 0; ret == 0 && n < nSizes; n++) {
+        int timebins = sizes[n];
+        int nPixels = width * height;
+        size_t nValues = (size_t)nPixels * timebins;
+        double s_correct[2];
+
+        // Made up calibration with bins a few % different in width and detectors shifted by up to 1.5 bins
+        if (SPAD_reset_bin_width_factors(width, height, timebins) < 0 || SPAD_reset_timebase_shifts(width, height, timebins) < 0 ||
+            SPAD_reset_timebase_scales(width, height) < 0) {
+            ret = -2;
+            break;
+        }
+        double* factors = SPAD_get_bin_width_factors_ptr();
+        double* shifts = SPAD_get_timebase_shifts_ptr();
+        double* scales = SPAD_get_timebase_scales_ptr();
+        for (size_t i = 0; i < nValues; i++)
+            factors[i] = 1.0 + 0.05 * sin(0.37 * i);
+        for (int k = 0; k < nPixels; k++) {
+            shifts[k] = 0.5 * (k % 7) - 1.5;
+            scales[k] = 1.0 + 0.002 * (k % 5);
+        }
+
+        spad_rng rng;
+        spad_rng_init(&rng, 2024, 0, timebins);
+        for (size_t i = 0; i < nValues; i++)
+            image[i] = (USHORT)(spad_rng_next(&rng) % 24);
+
+        if (SPAD_build_correction_plan(width, height, timebins) < 0) {
+            ret = -2;
+            break;
+        }
+
+        for (int fixed = 0; fixed < 2; fixed++) {
+            SPAD_set_fixed_timebin_kernels(fixed);
+            correct_image(image, output[fixed], width, height, timebins);   // warm up
+
+            clock_t tStart = clock();
+            for (int r = 0; r < repeats; r++)
+                correct_image(image, output[fixed], width, height, timebins);
+            s_correct[fixed] = ((double)clock() - (double)tStart) / CLOCKS_PER_SEC / repeats;
+        }
+
+        // The fixed size kernels do the same arithmetic in the same order
+        if (memcmp(output[0], output[1], nValues * sizeof(float)) != 0)
+            ret = -3;
+
+        for (int fixed = 0; fixed < 2; fixed++) {
+            const char* name = fixed ? "fixed" : "generic";
+            double per_s = (s_correct[fixed] > 0) ? nPixels / s_correct[fixed] / 1E6 : 0.0;
+            double speedup = (fixed && s_correct[1] > 0) ? s_correct[0] / s_correct[1] : 1.0;
+            fprintf(fp, "%d, %s, %.5f, %.2f, %.3f\n", timebins, name, s_correct[fixed], per_s, speedup);
+        }
+        printf("%d timebins: %.4fs per image generic, %.4fs fixed size\n", timebins, s_correct[0], s_correct[1]);
+    }
+
+    if (ret == -3)
+        printf("ERROR: Fixed size kernels differ from the generic kernels.\n");
+
+    SPAD_set_fixed_timebin_kernels(fixed_kernels);
+
+    free(image);
+    free(output[0]);
+    free(output[1]);
+    fclose(fp);
+
+    return(ret);
+}
@@ -0,0 +1,579 @@
+#include <windows.h>
+#include <iostream>
+#include <zlib.h>   // zlib is built into libics_static
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+#include "SPAD-random.h"
+
+/*
+Parallel gzip for saving images.
+
+libics compresses the whole image on one thread, which for level 1 is slower than the correction. Here the data is cut
+into blocks that are deflated on all the pool workers at once and written one after the other as a single gzip member,
+as pigz does. Each block but the last ends with a full flush, which ends on a byte boundary and does not refer back to
+the block before, so the blocks can be deflated independently and their output just concatenated. The CRC of the whole
+member is made from the CRCs of the blocks with crc32_combine. Any gzip reader reads the result, and since no block
+depends on another a reader that knows where they start can inflate them in parallel too.
+
+The blocks are done in waves of a few per worker, so the memory needed is a few blocks per worker whatever the size of
+the image. Smaller blocks balance better between the workers, larger blocks compress a little better.
+
+Reading is the other way round. A gzip stream does not say where its blocks or members start, so the writer leaves a
+small .spadgzi index next to the data with the compressed and uncompressed offset of each block. With it the blocks are
+inflated on all the workers straight into the image. Files from elsewhere may have several gzip members, e.g. from
+concatenating or from parallel compressors, but no index. These are inflated once on one thread, noting where each member
+starts, and if there is more than one member the index is saved so that the next load is parallel. An index that does
+not match its data, from a file rewritten since, is ignored and made again.
+*/
+
+#define GZIP_BLOCKS_PER_WORKER 4   // per wave
+#define GZIP_HEADER_BYTES 10
+#define GZIP_TRAILER_BYTES 8
+
+static size_t gGzipBlockBytes = 0;   // 0 to let libics compress on one thread
+
+// .spadgzi index, little endian, followed by nEntries pairs of compressed and uncompressed offsets from the start of the
+// gzip data. Entries are raw deflate blocks ending in a full flush inside one gzip member, or whole gzip members.
+#define GZIP_INDEX_MAGIC "SPADGZI"
+#define GZIP_INDEX_VERSION 1
+#define GZIP_INDEX_BLOCKS 0
+#define GZIP_INDEX_MEMBERS 1
+
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int kind;                      // GZIP_INDEX_BLOCKS or GZIP_INDEX_MEMBERS
+    unsigned long long compressed_bytes;    // of the whole gzip data, to spot an index left from an older file
+    unsigned long long uncompressed_bytes;
+    unsigned int last_crc;                  // CRC in the trailer of the last member, or whatever is 8 bytes from the end
+    unsigned int reserved;
+    unsigned long long nEntries;
+
+} gzip_index_header;
+
+typedef struct
+{
+    const BYTE* data;
+    size_t nBytes;
+    size_t block_bytes;
+    size_t first_block;     // of the wave
+    size_t nBlocks;         // in the whole stream
+    int level;
+    BYTE** out;             // one buffer for each block of a wave
+    size_t out_bytes;       // size of each buffer
+    size_t* out_sizes;      // compressed size of each block
+    uLong* crcs;
+
+} gzip_wave_info;
+
+static int thread_gzip_block(void* param, int task, int worker)
+{
+    gzip_wave_info* info = (gzip_wave_info*)param;
+    size_t block = info->first_block + task;
+    size_t start = block * info->block_bytes;
+    size_t n = min(info->block_bytes, info->nBytes - start);
+    int last = (block == info->nBlocks - 1);
+    z_stream strm;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, info->level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)   // raw deflate, the gzip header is written once
+        return(-1);
+
+    strm.next_in = (Bytef*)(info->data + start);
+    strm.avail_in = (uInt)n;
+    strm.next_out = info->out[task];
+    strm.avail_out = (uInt)info->out_bytes;
+
+    int ret = deflate(&strm, last ? Z_FINISH : Z_FULL_FLUSH);
+    info->out_sizes[task] = info->out_bytes - strm.avail_out;
+    deflateEnd(&strm);
+
+    if (ret != (last ? Z_STREAM_END : Z_OK) || strm.avail_in != 0)
+        return(-2);
+
+    info->crcs[task] = crc32(crc32(0L, Z_NULL, 0), info->data + start, (uInt)n);
+
+    return(0);
+}
+
+static void put_le32(BYTE* p, unsigned long v)
+{
+    p[0] = (BYTE)v;
+    p[1] = (BYTE)(v >> 8);
+    p[2] = (BYTE)(v >> 16);
+    p[3] = (BYTE)(v >> 24);
+}
+
+static unsigned long get_le32(const BYTE* p)
+{
+    return (unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+// The index of a gzip data file is next to it, named as it with .spadgzi
+void gzip_index_path(const char* datapath, char* indexpath)
+{
+    strcpy_s(indexpath, MAX_PATH, datapath);
+    char* ext = strrchr(indexpath, '.');
+    if (ext == NULL || strchr(ext, '\\') || strchr(ext, '/'))
+        ext = indexpath + strlen(indexpath);
+    *ext = '\0';
+    strcat_s(indexpath, MAX_PATH, ".spadgzi");
+}
+
+static int write_gzip_index(const char* indexpath, unsigned int kind, unsigned long long compressed_bytes, unsigned long long uncompressed_bytes,
+    unsigned long crc, unsigned long long* offsets, size_t nEntries)
+{
+    gzip_index_header header;
+    FILE* fp = NULL;
+
+    memset(&header, 0, sizeof(header));
+    strcpy_s(header.magic, sizeof(header.magic), GZIP_INDEX_MAGIC);
+    header.version = GZIP_INDEX_VERSION;
+    header.kind = kind;
+    header.compressed_bytes = compressed_bytes;
+    header.uncompressed_bytes = uncompressed_bytes;
+    header.last_crc = (unsigned int)crc;
+    header.nEntries = nEntries;
+
+    if (fopen_s(&fp, indexpath, "wb") != 0 || fp == NULL) {
+        printf("WARNING: Could not write gzip index %s, the image will be read on one thread.\n", indexpath);
+        return(-1);
+    }
+    int ok = (fwrite(&header, sizeof(header), 1, fp) == 1 && fwrite(offsets, 2 * sizeof(unsigned long long), nEntries, fp) == nEntries);
+    if (fclose(fp) != 0 || !ok) {
+        remove(indexpath);
+        printf("WARNING: Could not write gzip index %s, the image will be read on one thread.\n", indexpath);
+        return(-1);
+    }
+
+    return(0);
+}
+
+// Write nBytes of data to fp as one gzip member, compressed in blocks on all the pool workers, and the index of the blocks
+// to indexpath unless it is NULL
+int write_gzip_parallel(FILE* fp, const void* data, size_t nBytes, int level, const char* indexpath)
+{
+    size_t block_bytes = gGzipBlockBytes ? gGzipBlockBytes : ((size_t)1 << 20);
+    size_t nBlocks = max((nBytes + block_bytes - 1) / block_bytes, (size_t)1);
+    size_t nSlots = min((size_t)pool_number_of_workers() * GZIP_BLOCKS_PER_WORKER, nBlocks);
+    gzip_wave_info info;
+    int ret = 0;
+
+    memset(&info, 0, sizeof(info));
+    info.data = (const BYTE*)data;
+    info.nBytes = nBytes;
+    info.block_bytes = block_bytes;
+    info.nBlocks = nBlocks;
+    info.level = level;
+    info.out_bytes = compressBound((uLong)block_bytes) + 64;   // room for the flush marker too
+    info.out = (BYTE**)calloc(nSlots, sizeof(BYTE*));
+    info.out_sizes = (size_t*)malloc(nSlots * sizeof(size_t));
+    info.crcs = (uLong*)malloc(nSlots * sizeof(uLong));
+    unsigned long long* offsets = (unsigned long long*)malloc(nBlocks * 2 * sizeof(unsigned long long));
+    if (!info.out || !info.out_sizes || !info.crcs || !offsets) ret = -1;
+    for (size_t s = 0; ret == 0 && s < nSlots; s++) {
+        info.out[s] = (BYTE*)malloc(info.out_bytes);
+        if (!info.out[s]) ret = -1;
+    }
+    if (ret < 0)
+        printf("ERROR: Could not allocate gzip blocks.\n");
+
+    // gzip header, no name or time, OS unknown
+    BYTE header[GZIP_HEADER_BYTES] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, (BYTE)(level == 1 ? 4 : level == 9 ? 2 : 0), 255 };
+    if (ret == 0 && fwrite(header, 1, sizeof(header), fp) != sizeof(header)) ret = -3;
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    unsigned long long written = GZIP_HEADER_BYTES;
+    for (size_t first = 0; ret == 0 && first < nBlocks; first += nSlots) {
+        int nWave = (int)min(nSlots, nBlocks - first);
+        info.first_block = first;
+
+        if (pool_run(nWave, thread_gzip_block, &info) < 0) {
+            printf("ERROR: Compression failed.\n");
+            ret = -2;
+            break;
+        }
+
+        for (int b = 0; b < nWave; b++) {
+            size_t n = min(block_bytes, nBytes - (first + b) * block_bytes);
+            crc = crc32_combine(crc, info.crcs[b], (z_off_t)n);
+            offsets[2 * (first + b)] = written;
+            offsets[2 * (first + b) + 1] = (unsigned long long)(first + b) * block_bytes;
+            written += info.out_sizes[b];
+            if (fwrite(info.out[b], 1, info.out_sizes[b], fp) != info.out_sizes[b]) {
+                ret = -3;
+                break;
+            }
+        }
+    }
+
+    BYTE trailer[GZIP_TRAILER_BYTES];
+    put_le32(trailer, crc);
+    put_le32(trailer + 4, (unsigned long)(nBytes & 0xFFFFFFFF));
+    if (ret == 0 && fwrite(trailer, 1, sizeof(trailer), fp) != sizeof(trailer)) ret = -3;
+    if (ret == -3)
+        printf("ERROR: Could not write compressed data.\n");
+
+    // Only one block has nothing to share between the workers when read
+    if (ret == 0 && indexpath != NULL && nBlocks > 1)
+        write_gzip_index(indexpath, GZIP_INDEX_BLOCKS, written + GZIP_TRAILER_BYTES, nBytes, crc, offsets, nBlocks);
+    else if (indexpath != NULL)
+        remove(indexpath);   // any from an older file
+
+    for (size_t s = 0; info.out && s < nSlots; s++)
+        free(info.out[s]);
+    free(info.out);
+    free(info.out_sizes);
+    free(info.crcs);
+    free(offsets);
+
+    return(ret);
+}
+
+// Read the index of gz, NULL if there is none or it is for other data
+static unsigned long long* read_gzip_index(const char* indexpath, const BYTE* gz, size_t gzBytes, size_t nBytes, unsigned int* kind, size_t* nEntries)
+{
+    gzip_index_header header;
+    FILE* fp = NULL;
+
+    if (fopen_s(&fp, indexpath, "rb") != 0 || fp == NULL)
+        return(NULL);
+
+    unsigned long long* offsets = NULL;
+    if (fread(&header, sizeof(header), 1, fp) == 1 && strcmp(header.magic, GZIP_INDEX_MAGIC) == 0 && header.version == GZIP_INDEX_VERSION &&
+        header.compressed_bytes == gzBytes && header.uncompressed_bytes == nBytes && header.last_crc == get_le32(gz + gzBytes - GZIP_TRAILER_BYTES) &&
+        header.nEntries > 0 && header.nEntries <= gzBytes / 2) {
+        offsets = (unsigned long long*)malloc((size_t)header.nEntries * 2 * sizeof(unsigned long long));
+        if (offsets && fread(offsets, 2 * sizeof(unsigned long long), (size_t)header.nEntries, fp) != header.nEntries) {
+            free(offsets);
+            offsets = NULL;
+        }
+    }
+    fclose(fp);
+
+    // The entries must be in order and inside the data
+    for (size_t e = 0; offsets && e < header.nEntries; e++) {
+        unsigned long long next_c = (e + 1 < header.nEntries) ? offsets[2 * e + 2] : gzBytes;
+        unsigned long long next_u = (e + 1 < header.nEntries) ? offsets[2 * e + 3] : nBytes;
+        if (offsets[2 * e] >= next_c || offsets[2 * e + 1] > next_u || (e == 0 && offsets[1] != 0) || next_c - offsets[2 * e] > UINT_MAX) {
+            free(offsets);
+            offsets = NULL;
+        }
+    }
+    if (!offsets)
+        return(NULL);
+
+    *kind = header.kind;
+    *nEntries = (size_t)header.nEntries;
+
+    return(offsets);
+}
+
+typedef struct
+{
+    const BYTE* gz;
+    size_t gzBytes;
+    BYTE* dest;
+    size_t nBytes;
+    unsigned long long* offsets;
+    size_t nEntries;
+    unsigned int kind;
+    uLong* crcs;            // of each block, to check against the trailer
+
+} gunzip_info;
+
+// Inflate one indexed block or member straight into its place in the image
+static int thread_gunzip_entry(void* param, int task, int worker)
+{
+    gunzip_info* info = (gunzip_info*)param;
+    int last = (task == (int)info->nEntries - 1);
+    unsigned long long start_c = info->offsets[2 * task], start_u = info->offsets[2 * task + 1];
+    unsigned long long end_c = last ? info->gzBytes : info->offsets[2 * task + 2];
+    unsigned long long end_u = last ? info->nBytes : info->offsets[2 * task + 3];
+    int members = (info->kind == GZIP_INDEX_MEMBERS);
+    z_stream strm;
+    BYTE spare;
+
+    if (end_u - start_u > UINT_MAX)
+        return(-1);
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, members ? 16 + MAX_WBITS : -MAX_WBITS) != Z_OK)
+        return(-1);
+
+    strm.next_in = (Bytef*)(info->gz + start_c);
+    strm.avail_in = (uInt)(end_c - start_c);
+    strm.next_out = info->dest + start_u;
+    strm.avail_out = (uInt)(end_u - start_u);
+
+    int ret = inflate(&strm, Z_SYNC_FLUSH);
+    int full = (strm.avail_out == 0);
+    if (full && ret == Z_OK) {
+        // The end of the block or member may not have been reached yet, it must give nothing more
+        strm.next_out = &spare;
+        strm.avail_out = 1;
+        ret = inflate(&strm, Z_SYNC_FLUSH);
+        if (strm.avail_out == 0) full = 0;
+    }
+    inflateEnd(&strm);
+
+    int ok;
+    if (members)
+        ok = full && ret == Z_STREAM_END && (last || strm.avail_in == 0);   // zlib has checked the trailer
+    else if (last)
+        ok = full && ret == Z_STREAM_END && strm.avail_in == GZIP_TRAILER_BYTES;
+    else
+        ok = full && (ret == Z_OK || ret == Z_BUF_ERROR) && strm.avail_in == 0;
+    if (!ok)
+        return(-2);
+
+    if (!members)
+        info->crcs[task] = crc32_z(crc32(0L, Z_NULL, 0), info->dest + start_u, (z_size_t)(end_u - start_u));
+
+    return(0);
+}
+
+// Inflate gz member by member on one thread, noting where each starts in offsets
+static int scan_gzip_members(const BYTE* gz, size_t gzBytes, BYTE* dest, size_t nBytes, unsigned long long** offsets, size_t* nMembers)
+{
+    const size_t chunk = (size_t)1 << 30;
+    size_t pos = 0, out = 0, allocated = 0;
+    z_stream strm;
+    int ret = Z_OK;
+
+    *offsets = NULL;
+    *nMembers = 0;
+
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return(-1);
+
+    // Anything after the last member that is not another member is ignored, as gzip does
+    while (ret == Z_OK && pos + 1 < gzBytes && gz[pos] == 0x1f && gz[pos + 1] == 0x8b) {
+        if (*nMembers == allocated) {
+            allocated = max(allocated * 2, (size_t)64);
+            unsigned long long* more = (unsigned long long*)realloc(*offsets, allocated * 2 * sizeof(unsigned long long));
+            if (!more) {
+                ret = Z_MEM_ERROR;
+                break;
+            }
+            *offsets = more;
+        }
+        (*offsets)[2 * *nMembers] = pos;
+        (*offsets)[2 * *nMembers + 1] = out;
+        (*nMembers)++;
+
+        inflateReset(&strm);
+        strm.next_in = (Bytef*)(gz + pos);
+        strm.avail_in = 0;
+        do {
+            BYTE spare;
+            if (strm.avail_in == 0) {
+                size_t left = gzBytes - (strm.next_in - gz);
+                if (left == 0) {
+                    ret = Z_DATA_ERROR;   // cut short
+                    break;
+                }
+                strm.avail_in = (uInt)min(left, chunk);
+            }
+            if (out < nBytes) {
+                strm.next_out = dest + out;
+                strm.avail_out = (uInt)min(nBytes - out, chunk);
+            }
+            else {
+                strm.next_out = &spare;
+                strm.avail_out = 1;
+            }
+            uInt avail = strm.avail_out;
+            ret = inflate(&strm, Z_NO_FLUSH);
+            if (out < nBytes)
+                out += avail - strm.avail_out;
+            else if (strm.avail_out == 0)
+                ret = Z_DATA_ERROR;   // more than the image
+        } while (ret == Z_OK);
+
+        pos = strm.next_in - gz;
+        if (ret == Z_STREAM_END) ret = Z_OK;
+    }
+    inflateEnd(&strm);
+
+    if (ret != Z_OK || out != nBytes || *nMembers == 0) {
+        free(*offsets);
+        *offsets = NULL;
+        return(-2);
+    }
+
+    return(0);
+}
+
+// Read nBytes of gzip data from datapath at offset into dest, in parallel if the blocks or members are known.
+// Returns 1 if the file cannot be read this way, to read it with libics instead.
+int read_gzip_parallel(const char* datapath, size_t offset, void* dest, size_t nBytes)
+{
+    spad_mapped_file map;
+    char indexpath[MAX_PATH];
+
+    if (map_file(datapath, 0, &map) < 0)
+        return(1);
+
+    const BYTE* gz = (const BYTE*)map.data + offset;
+    size_t gzBytes = (map.size > offset) ? map.size - offset : 0;
+    if (gzBytes < GZIP_HEADER_BYTES + GZIP_TRAILER_BYTES || gz[0] != 0x1f || gz[1] != 0x8b) {
+        unmap_file(&map);
+        return(1);
+    }
+
+    gzip_index_path(datapath, indexpath);
+    gunzip_info info;
+    memset(&info, 0, sizeof(info));
+    info.gz = gz;
+    info.gzBytes = gzBytes;
+    info.dest = (BYTE*)dest;
+    info.nBytes = nBytes;
+    info.offsets = read_gzip_index(indexpath, gz, gzBytes, nBytes, &info.kind, &info.nEntries);
+
+    int ret = -1;
+    if (info.offsets) {
+        info.crcs = (uLong*)malloc(info.nEntries * sizeof(uLong));
+        if (info.crcs && pool_run((int)info.nEntries, thread_gunzip_entry, &info) == 0) {
+            ret = 0;
+            if (info.kind == GZIP_INDEX_BLOCKS) {
+                uLong crc = crc32(0L, Z_NULL, 0);
+                for (size_t e = 0; e < info.nEntries; e++) {
+                    unsigned long long end_u = (e + 1 < info.nEntries) ? info.offsets[2 * e + 3] : nBytes;
+                    crc = crc32_combine(crc, info.crcs[e], (z_off_t)(end_u - info.offsets[2 * e + 1]));
+                }
+                if (crc != get_le32(gz + gzBytes - GZIP_TRAILER_BYTES) || get_le32(gz + gzBytes - 4) != (nBytes & 0xFFFFFFFF))
+                    ret = -2;
+            }
+        }
+        if (ret < 0)
+            printf("WARNING: %s does not match its gzip index, reading it on one thread.\n", datapath);
+        free(info.crcs);
+        free(info.offsets);
+    }
+
+    if (ret < 0) {
+        unsigned long long* offsets;
+        size_t nMembers;
+        ret = scan_gzip_members(gz, gzBytes, (BYTE*)dest, nBytes, &offsets, &nMembers);
+        if (ret < 0)
+            printf("ERROR: Could not decompress %s.\n", datapath);
+        else if (nMembers > 1)   // the next load is parallel
+            write_gzip_index(indexpath, GZIP_INDEX_MEMBERS, gzBytes, nBytes, get_le32(gz + gzBytes - GZIP_TRAILER_BYTES), offsets, nMembers);
+        else
+            remove(indexpath);   // any from an older file
+        free(offsets);
+    }
+
+    unmap_file(&map);
+
+    return(ret);
+}
+
+int gzip_parallel_active(void)
+{
+    return (gGzipBlockBytes > 0);
+}
+
+int SPAD_set_gzip_block_size(int block_kb)
+{
+    if (block_kb < 0 || block_kb > 1024 * 1024) {
+        printf("ERROR: gzip block size %d KB is not allowed.\n", block_kb);
+        return(-1);
+    }
+
+    gGzipBlockBytes = (size_t)block_kb * 1024;
+
+    return(0);
+}
+
+
+int SPAD_gzip_benchmark(char filepath[], int repeats)
+{
+    const int width = 192, height = 128, timebins = 256;
+    const int levels[] = { 1, 3, 6, 9 };
+    const int block_kb[] = { 256, 1024, 4096 };
+    size_t nValues = (size_t)width * height * timebins;
+    char imagepath[MAX_PATH];
+    FILE* fp;
+    int ret = 0;
+
+    if (repeats < 1) return(-1);
+
+    fopen_s(&fp, filepath, "w");
+    if (!fp) {
+        printf("ERROR: Could not open gzip benchmark file.\n");
+        return(-1);
+    }
+
+    // Scratch image saved next to the results
+    strcpy_s(imagepath, MAX_PATH, filepath);
+    strcat_s(imagepath, MAX_PATH, ".ics");
+
+    // Made up decays, a peak at a different place in each pixel and a few photons everywhere else, as a corrected image
+    USHORT* image = (USHORT*)malloc(nValues * sizeof(USHORT));
+    if (!image) {
+        printf("ERROR: Could not allocate space for the gzip benchmark.\n");
+        fclose(fp);
+        return(-2);
+    }
+    for (int k = 0; k < width * height; k++) {
+        spad_rng rng;
+        spad_rng_init(&rng, 2024, k, 0);
+        double peak = 40.0 + (spad_rng_next(&rng) % 20), amplitude = 5.0 + (spad_rng_next(&rng) % 200) / 10.0;
+        for (int i = 0; i < timebins; i++) {
+            double expected = (i < peak) ? 0.2 : 0.2 + amplitude * exp(-(i - peak) / 40.0);
+            image[(size_t)k * timebins + i] = (USHORT)(expected * 2.0 * spad_rng_uniform(&rng) + 0.5);
+        }
+    }
+
+    size_t saved_block_bytes = gGzipBlockBytes;
+    int nWorkers = pool_number_of_workers();
+    double MB = nValues * sizeof(USHORT) / (1024.0 * 1024.0);
+
+    fprintf(fp, "level, writer, block KB, threads, ms, MB per s, compressed MB, speedup\n");
+
+    for (int l = 0; ret == 0 && l < sizeof(levels) / sizeof(levels[0]); l++) {
+        double libics_ms = 0.0;
+
+        for (int b = -1; ret == 0 && b < (int)(sizeof(block_kb) / sizeof(block_kb[0])); b++) {
+            gGzipBlockBytes = (b < 0) ? 0 : (size_t)block_kb[b] * 1024;   // -1 is libics on one thread
+            double ms = 0.0;
+
+            for (int r = 0; r < repeats; r++) {
+                clock_t tStart = clock();
+                ret = SPAD_save3DICSfile(imagepath, image, width, height, timebins, levels[l], NULL, 0, 1.0, 1.0);
+                ms += 1000.0 * ((double)clock() - (double)tStart) / CLOCKS_PER_SEC / repeats;
+                if (ret < 0) break;
+            }
+            if (b < 0) libics_ms = ms;
+
+            // Size of whichever file holds the compressed data
+            char datapath[MAX_PATH];
+            strcpy_s(datapath, MAX_PATH, imagepath);
+            if (b >= 0) strcpy_s(strrchr(datapath, '.'), 5, ".ids");
+            FILE* data;
+            long long nBytes = 0;
+            fopen_s(&data, datapath, "rb");
+            if (data) {
+                _fseeki64(data, 0, SEEK_END);
+                nBytes = _ftelli64(data);
+                fclose(data);
+            }
+
+            fprintf(fp, "%d, %s, %d, %d, %.2f, %.1f, %.2f, %.2f\n", levels[l], (b < 0) ? "libics" : "parallel", (b < 0) ? 0 : block_kb[b],
+                (b < 0) ? 1 : nWorkers, ms, MB / (ms / 1000.0), nBytes / (1024.0 * 1024.0), libics_ms / ms);
+        }
+    }
+
+    gGzipBlockBytes = saved_block_bytes;
+    remove(imagepath);
+    strcpy_s(strrchr(imagepath, '.'), 5, ".ids");
+    remove(imagepath);
+    free(image);
+    fclose(fp);
+
+    return(ret);
+}
@@ -0,0 +1,80 @@
+#include <windows.h>
+#include <iostream>
+#include "SPAD-correct.h"
+#include "SPAD-correct_internal.h"
+
+/*
+Memory mapped files, for loading large files without reading them.
+
+Only the pages that are used are read from disk, and the pages of a file mapped by several processes are shared between
+them by the OS. With copy_on_write the mapping can be written to, a page is then copied for this process only and the file
+is never changed.
+*/
+
+int map_file(const char* path, int copy_on_write, spad_mapped_file* map)
+{
+    memset(map, 0, sizeof(spad_mapped_file));
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return(-1);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return(-2);
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (!mapping) {
+        CloseHandle(file);
+        return(-3);
+    }
+
+    void* data = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    if (!data) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return(-3);
+    }
+
+    map->data = data;
+    map->size = (size_t)size.QuadPart;
+    map->file = file;
+    map->mapping = mapping;
+
+    return(0);
+}
+
+void unmap_file(spad_mapped_file* map)
+{
+    if (!map->data) return;
+
+    UnmapViewOfFile(map->data);
+    CloseHandle((HANDLE)map->mapping);
+    CloseHandle((HANDLE)map->file);
+
+    memset(map, 0, sizeof(spad_mapped_file));
+}
+
+int in_mapped_file(spad_mapped_file* map, const void* p)
+{
+    return (map->data && (const BYTE*)p >= (const BYTE*)map->data && (const BYTE*)p < (const BYTE*)map->data + map->size);
+}
+
+// Tell the OS the pages from p to p + n are not needed for now, they are read from the file again if they are used.
+// Only whole pages in the range are released. Pages written to keep their contents, they just leave the working set.
+void release_mapped_pages(spad_mapped_file* map, const void* p, size_t n)
+{
+    if (!in_mapped_file(map, p)) return;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    size_t page = si.dwPageSize;
+
+    size_t end = min((size_t)((const BYTE*)p - (const BYTE*)map->data) + n, map->size);
+    size_t start = ((size_t)((const BYTE*)p - (const BYTE*)map->data) + page - 1) / page * page;
+    end = end / page * page;
+    if (end <= start) return;
+
+    VirtualUnlock((BYTE*)map->data + start, end - start);   // the pages are not locked, so this removes them from the working set
+}
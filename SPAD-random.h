@@ -0,0 +1,101 @@
+/*
+	Counter based random numbers for the photon redistribution.
+
+	Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", SC11).
+	Every stream is keyed by the seed and counts along (draw, bin, pixel), so each transient and bin gets its own
+	independent stream with no shared state between threads. A corrected image is then the same whatever the number
+	of threads or the order the pixels were done in.
+*/
+
+#pragma once
+
+#ifndef _SPAD_RANDOM_H_
+#define _SPAD_RANDOM_H_
+
+typedef struct
+{
+	unsigned int key[2];
+	unsigned int counter[4];   // draw number (2 words), bin, pixel
+	unsigned int out[4];       // last block of 4 random numbers
+	int used;                  // number of values in out already handed out
+
+} spad_rng;
+
+static inline unsigned int spad_mulhilo(unsigned int a, unsigned int b, unsigned int* hi)
+{
+	unsigned long long product = (unsigned long long)a * b;
+	*hi = (unsigned int)(product >> 32);
+	return (unsigned int)product;
+}
+
+static inline void spad_philox4x32_10(const unsigned int counter[4], const unsigned int key[2], unsigned int out[4])
+{
+	unsigned int c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	unsigned int k0 = key[0], k1 = key[1];
+
+	for (int round = 0; round < 10; round++) {
+		unsigned int hi0, hi1;
+		unsigned int lo0 = spad_mulhilo(0xD2511F53, c0, &hi0);
+		unsigned int lo1 = spad_mulhilo(0xCD9E8D57, c2, &hi1);
+		c0 = hi1 ^ c1 ^ k0;
+		c1 = lo1;
+		c2 = hi0 ^ c3 ^ k1;
+		c3 = lo0;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+/// Start the stream for one bin of one pixel
+static inline void spad_rng_init(spad_rng* rng, unsigned long long seed, unsigned int pixel, unsigned int bin)
+{
+	rng->key[0] = (unsigned int)seed;
+	rng->key[1] = (unsigned int)(seed >> 32);
+	rng->counter[0] = 0;
+	rng->counter[1] = 0;
+	rng->counter[2] = bin;
+	rng->counter[3] = pixel;
+	rng->used = 4;
+}
+
+/// Next 32 bit random number from the stream
+static inline unsigned int spad_rng_next(spad_rng* rng)
+{
+	if (rng->used == 4) {
+		spad_philox4x32_10(rng->counter, rng->key, rng->out);
+		if (++rng->counter[0] == 0) rng->counter[1]++;
+		rng->used = 0;
+	}
+
+	return rng->out[rng->used++];
+}
+
+/// Uniform random number in (0, 1)
+static inline double spad_rng_uniform(spad_rng* rng)
+{
+	return ((double)spad_rng_next(rng) + 0.5) * (1.0 / 4294967296.0);
+}
+
+/// Wrapper so the stream can be used with the std random distributions
+struct spad_rng_engine
+{
+	typedef unsigned int result_type;
+	spad_rng* rng;
+
+	spad_rng_engine(spad_rng* r) : rng(r) {}
+	static constexpr result_type (min)() { return 0; }
+	static constexpr result_type (max)() { return 0xFFFFFFFF; }
+	result_type operator()() { return spad_rng_next(rng); }
+};
+
+// Binomial random numbers, see SPAD-binomial.cpp
+int rbinom(int n, double p, spad_rng* rng);
+int rbinom_original(int n, double p, spad_rng* rng);
+int MSVC_rbinom(int n, double p, spad_rng* rng);
+
+#endif // _SPAD_RANDOM_H_
@@ -0,0 +1,236 @@
+/*
+	Persistent work stealing thread pool used to run the corrections (and anything else that splits into independent tasks).
+
+	Only uses the standard library so it builds on Windows and Linux.
+	The pool is created on first use and kept for the life of the process, so a batch of images does not pay for
+	thread creation on every image. The calling thread takes part as worker 0.
+
+	Each call to pool_run splits the task indices evenly between the workers. A worker takes tasks from the front of its
+	own range and, when that is empty, steals the back half of another worker's range. A range is a begin/end pair packed
+	into one 64 bit atomic so both the owner and the thieves update it with a single compare and swap.
+*/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+typedef int (*pool_task_func)(void* param, int task, int worker);
+
+class thread_pool
+{
+public:
+	thread_pool(int nWorkers);
+	~thread_pool();
+
+	int run(int nTasks, pool_task_func func, void* param);
+	int workers() { return nWorkers; }
+
+private:
+	void worker_loop(int worker);
+	void do_tasks(int worker);
+	bool pop_task(int worker, int* task);
+	bool steal_tasks(int worker);
+
+	static unsigned long long pack(unsigned int begin, unsigned int end) { return ((unsigned long long)end << 32) | begin; }
+	static unsigned int range_begin(unsigned long long r) { return (unsigned int)(r & 0xFFFFFFFF); }
+	static unsigned int range_end(unsigned long long r) { return (unsigned int)(r >> 32); }
+
+	struct alignas(64) task_range {     // one cache line each so workers do not share
+		std::atomic<unsigned long long> range;
+	};
+
+	int nWorkers;
+	std::vector<std::thread> threads;
+	task_range* ranges;
+
+	// The current job
+	pool_task_func func;
+	void* param;
+	std::atomic<int> error;
+
+	// Start and finish signalling
+	std::mutex run_mutex;     // one job at a time
+	std::mutex mutex;
+	std::condition_variable start_cv, done_cv;
+	unsigned long long generation;
+	int nFinished;
+	bool stop;
+};
+
+thread_pool::thread_pool(int n) : nWorkers(n), func(NULL), param(NULL), error(0), generation(0), nFinished(0), stop(false)
+{
+	ranges = new task_range[nWorkers];
+	for (int w = 0; w < nWorkers; w++)
+		ranges[w].range = 0;
+
+	for (int w = 1; w < nWorkers; w++)
+		threads.push_back(std::thread(&thread_pool::worker_loop, this, w));
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+	}
+	start_cv.notify_all();
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	delete[] ranges;
+}
+
+bool thread_pool::pop_task(int worker, int* task)
+{
+	std::atomic<unsigned long long>& range = ranges[worker].range;
+	unsigned long long r = range.load();
+
+	while (1) {
+		unsigned int b = range_begin(r), e = range_end(r);
+		if (b >= e) return false;
+		if (range.compare_exchange_weak(r, pack(b + 1, e))) {
+			*task = (int)b;
+			return true;
+		}
+	}
+}
+
+bool thread_pool::steal_tasks(int worker)
+{
+	// Try all other workers, starting with the next one along
+	for (int i = 1; i < nWorkers; i++) {
+		std::atomic<unsigned long long>& victim = ranges[(worker + i) % nWorkers].range;
+		unsigned long long r = victim.load();
+
+		while (1) {
+			unsigned int b = range_begin(r), e = range_end(r);
+			if (b >= e) break;
+			unsigned int n = (e - b + 1) / 2;   // take the back half, rounded up
+			if (victim.compare_exchange_weak(r, pack(b, e - n))) {
+				ranges[worker].range.store(pack(e - n, e));   // own range is empty, only thieves could look at it
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+void thread_pool::do_tasks(int worker)
+{
+	int task;
+
+	do {
+		while (pop_task(worker, &task)) {
+			int ret = func(param, task, worker);
+			if (ret < 0) {
+				int ok = 0;
+				error.compare_exchange_strong(ok, ret);   // keep the first error
+			}
+		}
+	} while (steal_tasks(worker));
+}
+
+void thread_pool::worker_loop(int worker)
+{
+	unsigned long long seen = 0;
+
+	while (1) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			start_cv.wait(lock, [&] { return stop || generation != seen; });
+			if (stop) return;
+			seen = generation;
+		}
+
+		do_tasks(worker);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			nFinished++;
+		}
+		done_cv.notify_one();
+	}
+}
+
+int thread_pool::run(int nTasks, pool_task_func f, void* p)
+{
+	std::lock_guard<std::mutex> run_lock(run_mutex);
+
+	if (nTasks <= 0) return(0);
+
+	func = f;
+	param = p;
+	error = 0;
+
+	// Even split to start with, stealing balances the rest
+	for (int w = 0; w < nWorkers; w++) {
+		unsigned int b = (unsigned int)((long long)nTasks * w / nWorkers);
+		unsigned int e = (unsigned int)((long long)nTasks * (w + 1) / nWorkers);
+		ranges[w].range.store(pack(b, e));
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		nFinished = 0;
+		generation++;
+	}
+	start_cv.notify_all();
+
+	do_tasks(0);
+
+	// Wait for all workers to have finished with this job before it is changed
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done_cv.wait(lock, [&] { return nFinished == nWorkers - 1; });
+	}
+
+	return(error);
+}
+
+
+// The pool, created on first use. Not destroyed at exit on purpose, joining threads while a dll is unloading can deadlock.
+static thread_pool* gPool = NULL;
+static int gnPoolThreads = 0;   // 0 = use all hardware threads
+static std::mutex gPoolMutex;
+
+static thread_pool* get_pool(void)
+{
+	std::lock_guard<std::mutex> lock(gPoolMutex);
+
+	if (!gPool) {
+		int n = gnPoolThreads;
+		if (n <= 0) n = (int)std::thread::hardware_concurrency();
+		if (n <= 0) n = 1;
+		gPool = new thread_pool(n);
+	}
+
+	return gPool;
+}
+
+int pool_run(int nTasks, pool_task_func func, void* param)
+{
+	return get_pool()->run(nTasks, func, param);
+}
+
+int pool_number_of_workers(void)
+{
+	return get_pool()->workers();
+}
+
+void pool_set_number_of_threads(int nThreads)
+{
+	std::lock_guard<std::mutex> lock(gPoolMutex);
+
+	if (nThreads < 0) nThreads = 0;
+	if (nThreads == gnPoolThreads) return;
+
+	gnPoolThreads = nThreads;
+
+	// Recreated with the new size on next use
+	delete gPool;
+	gPool = NULL;
+}
@@ -19,9 +19,19 @@ int gnTimebaseScales = 0;
 
 int check_timebase_scales_space(int width, int height)
 {
+    // Called before the factors are changed, so any correction plan built from them is now out of date
+    invalidate_correction_plan();
+
     // get space for height scales + 1 delta between peaks
 	int nPixels = width * height;
 
+    if (gTimebaseScales && gnTimebaseScales != nPixels) {   // different size of image
+        release_calibration_array(gTimebaseScales);
+        gTimebaseScales = NULL;
+        free(gPeak2Pos);
+        gPeak2Pos = NULL;
+    }
+
     if (!gTimebaseScales) {
         gTimebaseScales = (double*)malloc((nPixels + 1) * sizeof(double));  // one value for each pixel sensor
         gnTimebaseScales = nPixels;
@@ -178,6 +188,7 @@ int SPAD_reset_timebase_scales(int width, int height)
 
 double* SPAD_get_timebase_scales_ptr()
 {
+    invalidate_correction_plan();   // caller may change the factors through the pointer
     return gTimebaseScales;
 }
 
@@ -45,9 +45,19 @@ double find_peak(UINT* trans, int nbins)
 
 int check_timebase_shifts_space(int width, int height)
 {
+    // Called before the factors are changed, so any correction plan built from them is now out of date
+    invalidate_correction_plan();
+
     // get space for height shifts + 1 mean position for later scale calcs
 	int nPixels = width * height;
 
+    if (gTimebaseShifts && gnTimebaseShifts != nPixels) {   // different size of image
+        release_calibration_array(gTimebaseShifts);
+        gTimebaseShifts = NULL;
+        free(gPeak1Pos);
+        gPeak1Pos = NULL;
+    }
+
     if (!gTimebaseShifts) {
         gTimebaseShifts = (double*)malloc((nPixels + 1) * sizeof(double));  // one value for each sensor
         gnTimebaseShifts = nPixels;
@@ -147,6 +157,7 @@ int SPAD_reset_timebase_shifts(int width, int height, int timebins)
 
 double* SPAD_get_timebase_shifts_ptr()
 {
+    invalidate_correction_plan();   // caller may change the factors through the pointer
     return gTimebaseShifts;
 }
 